@@ -0,0 +1,58 @@
+//
+// Created by aln0 on 4/17/23.
+//
+
+#ifndef ROCKS_FUSE_BENCH_ALLOCS_H
+#define ROCKS_FUSE_BENCH_ALLOCS_H
+
+#include <benchmark/benchmark.h>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// every heap allocation of the process is counted, include this from exactly one file of a benchmark binary
+static std::atomic<size_t> alloc_cnt{0};
+static std::atomic<size_t> alloc_bytes{0};
+
+void* operator new(size_t sz) {
+    alloc_cnt.fetch_add(1, std::memory_order_relaxed);
+    alloc_bytes.fetch_add(sz, std::memory_order_relaxed);
+    if(void* p = malloc(sz ? sz : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+/**
+ * allocations made between start() and stop(), summed over the iterations of a benchmark
+ */
+struct alloc_meter {
+    size_t cnt = 0, bytes = 0;
+    size_t cnt0 = 0, bytes0 = 0;
+
+    void start() {
+        cnt0 = alloc_cnt.load(std::memory_order_relaxed);
+        bytes0 = alloc_bytes.load(std::memory_order_relaxed);
+    }
+
+    void stop() {
+        cnt += alloc_cnt.load(std::memory_order_relaxed) - cnt0;
+        bytes += alloc_bytes.load(std::memory_order_relaxed) - bytes0;
+    }
+
+    /**
+     * report the allocations and, when known, the bytes copied per iteration
+     */
+    void report(benchmark::State& state, size_t copied = 0) const {
+        state.counters["allocs"] = benchmark::Counter(cnt, benchmark::Counter::kAvgIterations);
+        state.counters["alloc_bytes"] = benchmark::Counter(bytes, benchmark::Counter::kAvgIterations);
+        if(copied) {
+            state.counters["copied"] = benchmark::Counter(copied);
+        }
+    }
+};
+
+#endif //ROCKS_FUSE_BENCH_ALLOCS_H
@@ -0,0 +1,185 @@
+//
+// Created by aln0 on 4/17/23.
+//
+
+#include "types.h"
+#include "bench_allocs.h"
+#include <cstddef>
+#include <sys/stat.h>
+
+/**
+ * inode_t in isolation, no db. a directory of n entries is built in one pass and serialized,
+ * adding them one by one would take quadratic time. "copied" is the bytes one op moves given the layout
+ */
+
+static size_t attr_sz() {
+    return inode_t().attr_sz;
+}
+
+static string dentry_name(size_t i) {
+    return "file_" + std::to_string(i);
+}
+
+/**
+ * @return a directory inode holding n entries as read from db
+ */
+static string serialized_dir(size_t n) {
+    inode_t dir_inode;
+    dir_inode.mode = S_IFDIR | 0755;
+    std::vector<rfs_dirent> ents;
+    for(size_t i = 0; i < n; i++) {
+        ents.push_back({i + 2, reg, dentry_name(i)});
+    }
+    dir_inode.add_dentries_d(ents);
+    dir_inode.before_write_back();
+    return string((const char*)dir_inode.data(), dir_inode.used_dat_sz + dir_inode.attr_sz);
+}
+
+// directories from 10 to 1M entries, 0 is a regular file's inode, attributes only
+static void dir_sizes(benchmark::internal::Benchmark* b) {
+    b->Arg(0);
+    for(int64_t n = 10; n <= 1000000; n *= 10) {
+        b->Arg(n);
+    }
+}
+
+static void BM_inode_deserialize(benchmark::State& state) {
+    string val = serialized_dir(state.range(0));
+    alloc_meter m;
+    m.start();
+    for(auto _ : state) {
+        inode_t inode(val.data(), val.size());
+        benchmark::DoNotOptimize(inode.data());
+    }
+    m.stop();
+    m.report(state, val.size());
+    state.SetBytesProcessed(state.iterations() * val.size());
+}
+BENCHMARK(BM_inode_deserialize)->Apply(dir_sizes);
+
+static void BM_before_write_back(benchmark::State& state) {
+    string val = serialized_dir(state.range(0));
+    inode_t inode(val.data(), val.size());
+    alloc_meter m;
+    m.start();
+    for(auto _ : state) {
+        inode.before_write_back();
+        benchmark::ClobberMemory();
+    }
+    m.stop();
+    m.report(state, attr_sz());
+}
+BENCHMARK(BM_before_write_back)->Apply(dir_sizes);
+
+static void BM_find_dentry_d(benchmark::State& state) {
+    size_t n = state.range(0);
+    string val = serialized_dir(n);
+    inode_t inode(val.data(), val.size());
+    string name = dentry_name(n ? n - 1 : 0);
+    alloc_meter m;
+    m.start();
+    for(auto _ : state) {
+        benchmark::DoNotOptimize(inode.find_dentry_d(name));
+    }
+    m.stop();
+    m.report(state);
+}
+BENCHMARK(BM_find_dentry_d)->Apply(dir_sizes);
+
+// a name the directory doesn't hold, as mknod looks up before adding
+static void BM_find_dentry_d_miss(benchmark::State& state) {
+    string val = serialized_dir(state.range(0));
+    inode_t inode(val.data(), val.size());
+    string name = dentry_name(state.range(0));
+    alloc_meter m;
+    m.start();
+    for(auto _ : state) {
+        benchmark::DoNotOptimize(inode.find_dentry_d(name));
+    }
+    m.stop();
+    m.report(state);
+}
+BENCHMARK(BM_find_dentry_d_miss)->Apply(dir_sizes);
+
+// mknod into a directory read from db, its data area is full so adding grows it
+static void BM_add_dentry_d(benchmark::State& state) {
+    size_t n = state.range(0);
+    string val = serialized_dir(n);
+    string name = dentry_name(n);
+    alloc_meter m;
+    for(auto _ : state) {
+        state.PauseTiming();
+        auto inode = make_unique<inode_t>(val.data(), val.size());
+        state.ResumeTiming();
+        m.start();
+        inode->add_dentry_d(n + 2, reg, name);
+        m.stop();
+        state.PauseTiming();
+        inode.reset();
+        state.ResumeTiming();
+    }
+    // the grown data area is copied, then the slots move past the new entry
+    m.report(state, val.size() - attr_sz() + n * sizeof(rfs_dslot_d));
+}
+BENCHMARK(BM_add_dentry_d)->Apply(dir_sizes);
+
+// unlink of the first entry stored, every entry after it and the slots move down
+static void BM_drop_dentry_d(benchmark::State& state) {
+    size_t n = std::max((size_t)state.range(0), (size_t)1);
+    string val = serialized_dir(n);
+    alloc_meter m;
+    for(auto _ : state) {
+        state.PauseTiming();
+        auto inode = make_unique<inode_t>(val.data(), val.size());
+        state.ResumeTiming();
+        m.start();
+        inode->drop_dentry_d(inode->dentry_at(0));
+        m.stop();
+        state.PauseTiming();
+        inode.reset();
+        state.ResumeTiming();
+    }
+    m.report(state, val.size() - attr_sz() - sizeof(rfs_dir_d));
+}
+BENCHMARK(BM_drop_dentry_d)->Apply(dir_sizes);
+
+// write into blocks already dirty in the cache, the steady state of a streaming writer
+static void BM_write_data(benchmark::State& state) {
+    size_t sz = state.range(0);
+    string buf(sz, 'x');
+    inode_t inode;
+    inode.write_data(buf.data(), sz, 0);
+    alloc_meter m;
+    m.start();
+    for(auto _ : state) {
+        inode.write_data(buf.data(), sz, 0);
+        benchmark::ClobberMemory();
+    }
+    m.stop();
+    m.report(state, sz);
+    state.SetBytesProcessed(state.iterations() * sz);
+}
+BENCHMARK(BM_write_data)->Arg(64)->Arg(BLOCK_SZ)->Arg(64 << 10)->Arg(1 << 20);
+
+// write into a fresh inode, every block is allocated and counted dirty
+static void BM_write_data_cold(benchmark::State& state) {
+    size_t sz = state.range(0);
+    string buf(sz, 'x');
+    alloc_meter m;
+    for(auto _ : state) {
+        state.PauseTiming();
+        auto inode = make_unique<inode_t>();
+        state.ResumeTiming();
+        m.start();
+        inode->write_data(buf.data(), sz, 0);
+        m.stop();
+        state.PauseTiming();
+        inode.reset();
+        state.ResumeTiming();
+    }
+    m.report(state, sz);
+    state.SetBytesProcessed(state.iterations() * sz);
+}
+BENCHMARK(BM_write_data_cold)->Arg(64)->Arg(BLOCK_SZ)->Arg(64 << 10)->Arg(1 << 20);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,318 @@
+//
+// Created by aln0 on 4/12/23.
+//
+
+#include "rocksdb_fs.h"
+#include "bench_allocs.h"
+#include <unistd.h>
+#include <chrono>
+#include <random>
+#include <thread>
+
+static rocksdb_fs fs;
+static fuse_file_info file_fi, dir_fi;
+static const char* bench_file = "/bench";
+
+// an op on a warm cache must leave the allocation count unchanged
+static void check_allocs(benchmark::State& state, size_t before) {
+    size_t n = alloc_cnt.load(std::memory_order_relaxed) - before;
+    state.counters["allocs"] = benchmark::Counter(n, benchmark::Counter::kAvgIterations);
+    if(n != 0) {
+        state.SkipWithError("heap allocation on a warm cache");
+    }
+}
+
+static void BM_getattr(benchmark::State& state) {
+    struct stat st = {};
+    fs.getattr(bench_file, &st);
+    size_t before = alloc_cnt.load(std::memory_order_relaxed);
+    for(auto _ : state) {
+        benchmark::DoNotOptimize(fs.getattr(bench_file, &st));
+    }
+    check_allocs(state, before);
+}
+BENCHMARK(BM_getattr);
+
+static void BM_read(benchmark::State& state) {
+    char buf[BLOCK_SZ];
+    fs.read(bench_file, buf, state.range(0), 0, &file_fi);
+    size_t before = alloc_cnt.load(std::memory_order_relaxed);
+    for(auto _ : state) {
+        benchmark::DoNotOptimize(fs.read(bench_file, buf, state.range(0), 0, &file_fi));
+    }
+    check_allocs(state, before);
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_read)->Arg(64)->Arg(BLOCK_SZ);
+
+static void BM_write(benchmark::State& state) {
+    char buf[BLOCK_SZ] = {};
+    fs.write(bench_file, buf, state.range(0), 0, &file_fi);
+    size_t before = alloc_cnt.load(std::memory_order_relaxed);
+    for(auto _ : state) {
+        benchmark::DoNotOptimize(fs.write(bench_file, buf, state.range(0), 0, &file_fi));
+    }
+    check_allocs(state, before);
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_write)->Arg(64)->Arg(BLOCK_SZ);
+
+// open-read-close, the path lookup reads its inodes from the inode cache once warm
+static void BM_open_read_close(benchmark::State& state) {
+    char buf[BLOCK_SZ];
+    for(auto _ : state) {
+        fuse_file_info fi = {};
+        fs.open(bench_file, &fi);
+        benchmark::DoNotOptimize(fs.read(bench_file, buf, sizeof(buf), 0, &fi));
+        fs.release(&fi);
+    }
+}
+BENCHMARK(BM_open_read_close);
+
+static const char* ns_dir = "/ns";
+
+// create and unlink in a directory that isn't open, each writes the directory back at once. with shards
+// the new inode and its directory are mostly apart, the writes go through an intent
+static void BM_create_unlink(benchmark::State& state) {
+    string path = string(ns_dir) + "/f";
+    for(auto _ : state) {
+        fs.mknod(path.c_str(), S_IFREG | 0644, getuid(), getgid());
+        fs.unlink(path.c_str());
+    }
+}
+BENCHMARK(BM_create_unlink);
+
+static const char* cold_file = "/cold";
+static const char* churn_file = "/churn";
+static const size_t cold_sz = 64 << 20;
+static const size_t churn_sz = 256 << 20;
+
+/**
+ * 4KiB reads at random offsets of a file whose blocks are only in db, while a writer keeps rewriting another
+ * file with O_DIRECT, each write its own db write. the flushes and compactions it causes compete with the reads,
+ * run it with and without RFS_BENCH_BG_IO_LIMIT to compare the tails
+ */
+static void BM_read_under_compaction(benchmark::State& state) {
+    std::atomic<bool> stop{false};
+    std::thread writer([&stop]() {
+        fuse_file_info fi = {};
+        fi.flags = O_RDWR | O_DIRECT;
+        vector<char> buf(1 << 20, 'c');
+        for(size_t off = 0;!stop.load(std::memory_order_relaxed);off = (off + buf.size()) % churn_sz) {
+            fs.write(churn_file, buf.data(), buf.size(), off, &fi);
+        }
+    });
+
+    fuse_file_info fi = {};
+    fs.open(cold_file, &fi);
+    std::mt19937_64 rng(1);
+    vector<uint64_t> lat;
+    char buf[BLOCK_SZ];
+    for(auto _ : state) {
+        off_t off = rng() % (cold_sz / BLOCK_SZ) * BLOCK_SZ;
+        auto beg = std::chrono::steady_clock::now();
+        benchmark::DoNotOptimize(fs.read(cold_file, buf, BLOCK_SZ, off, &fi));
+        lat.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - beg).count());
+    }
+    stop = true;
+    writer.join();
+    fs.release(&fi);
+
+    std::sort(lat.begin(), lat.end());
+    for(auto p : {std::make_pair("p50_us", 0.5), std::make_pair("p99_us", 0.99), std::make_pair("p999_us", 0.999)}) {
+        state.counters[p.first] = lat[std::min(lat.size() - 1, (size_t)(p.second * lat.size()))] / 1e3;
+    }
+}
+BENCHMARK(BM_read_under_compaction)->UseRealTime()->MinTime(10);
+
+/**
+ * a counter of the user.rfs.stats report
+ */
+static double cache_stat(const char* name) {
+    char report[1024];
+    int len = fs.getxattr("/", RFS_XATTR_STATS, report, sizeof(report) - 1);
+    if(len < 0) return 0;
+    report[len] = '\0';
+    const char* p = strstr(report, ("\n" + string(name) + " ").c_str());
+    return p ? atof(p + strlen(name) + 2) : 0;
+}
+
+/**
+ * 4KiB reads at random offsets of the cold file, a working set larger than a small block cache. run it with
+ * RFS_BENCH_BLOCK_CACHE=16 alone and with RFS_BENCH_SECONDARY_CACHE=48 to see how much the compressed tier holds
+ */
+static void BM_read_working_set(benchmark::State& state) {
+    fuse_file_info fi = {};
+    fs.open(cold_file, &fi);
+    std::mt19937_64 rng(2);
+    char buf[BLOCK_SZ];
+    double hit = cache_stat("block_cache.hit"), secondary_hit = cache_stat("secondary_cache.hit");
+    double miss = cache_stat("block_cache.miss") - secondary_hit;
+    for(auto _ : state) {
+        off_t off = rng() % (cold_sz / BLOCK_SZ) * BLOCK_SZ;
+        benchmark::DoNotOptimize(fs.read(cold_file, buf, BLOCK_SZ, off, &fi));
+    }
+    fs.release(&fi);
+
+    hit = cache_stat("block_cache.hit") - hit;
+    secondary_hit = cache_stat("secondary_cache.hit") - secondary_hit;
+    miss = cache_stat("block_cache.miss") - cache_stat("secondary_cache.hit") - miss;
+    double total = std::max(hit + secondary_hit + miss, 1.0);
+    state.counters["hit_ratio"] = hit / total;
+    state.counters["secondary_hit_ratio"] = secondary_hit / total;
+    state.counters["block_cache_mb"] = cache_stat("block_cache.usage") / (1 << 20);
+}
+BENCHMARK(BM_read_working_set)->MinTime(5);
+
+/**
+ * write the cold file once, a db reused from an earlier run already has it
+ */
+static int make_cold_file() {
+    int ret = fs.mknod(churn_file, S_IFREG | 0644, getuid(), getgid());
+    if(ret != 0 && ret != -EEXIST) return ret;
+
+    fuse_file_info fi = {};
+    fi.flags = O_RDWR;
+    ret = fs.create(cold_file, S_IFREG | 0644, getuid(), getgid(), &fi);
+    if(ret == -EEXIST) return 0;
+    if(ret != 0) return ret;
+    vector<char> buf(1 << 20, 'x');
+    for(size_t off = 0;off < cold_sz;off += buf.size()) {
+        fs.write(cold_file, buf.data(), buf.size(), off, &fi);
+    }
+    return fs.release(&fi);
+}
+
+// directories the path lookup walks into, 1M entries would take too long to create through mknod
+static const int64_t lookup_dir_sizes[] = {10, 100, 1000, 10000};
+
+static string lookup_path(int64_t n, const char* fname) {
+    return "/lookup_" + std::to_string(n) + (fname ? string("/") + fname : "");
+}
+
+// stat of the last entry of a directory that isn't open, its inode comes from the inode cache
+static void BM_lookup(benchmark::State& state) {
+    int64_t n = state.range(0);
+    string path = lookup_path(n, ("file_" + std::to_string(n - 1)).c_str());
+    struct stat st = {};
+    alloc_meter m;
+    m.start();
+    for(auto _ : state) {
+        benchmark::DoNotOptimize(fs.getattr(path.c_str(), &st));
+    }
+    m.stop();
+    m.report(state);
+}
+BENCHMARK(BM_lookup)->Apply([](benchmark::internal::Benchmark* b) {
+    for(int64_t n : lookup_dir_sizes) b->Arg(n);
+});
+
+/**
+ * stat of random entries of the largest lookup directory, each inode read from db with RFS_BENCH_INODE_CACHE=0.
+ * compare the block based tables with RFS_BENCH_META_IN_MEMORY=1 on a reused db, where the inodes are flushed
+ */
+static void BM_stat_random(benchmark::State& state) {
+    int64_t n = lookup_dir_sizes[std::size(lookup_dir_sizes) - 1];
+    vector<string> paths;
+    for(int64_t i = 0;i < n;i++) {
+        paths.push_back(lookup_path(n, ("file_" + std::to_string(i)).c_str()));
+    }
+    std::mt19937_64 rng(3);
+    struct stat st = {};
+    for(auto _ : state) {
+        benchmark::DoNotOptimize(fs.getattr(paths[rng() % n].c_str(), &st));
+    }
+}
+BENCHMARK(BM_stat_random);
+
+/**
+ * fill the lookup directories once, a db reused from an earlier run already has them
+ */
+static int make_lookup_dirs() {
+    for(int64_t n : lookup_dir_sizes) {
+        string dir = lookup_path(n, nullptr);
+        int ret = fs.mkdir(dir.c_str(), 0755, getuid(), getgid());
+        if(ret == -EEXIST) continue;
+        if(ret != 0) return ret;
+
+        fuse_file_info fi = {};
+        fs.opendir(dir.c_str(), &fi);
+        for(int64_t i = 0; i < n && ret == 0; i++) {
+            ret = fs.mknod((dir + "/file_" + std::to_string(i)).c_str(), S_IFREG | 0644, getuid(), getgid());
+        }
+        fs.releasedir(dir.c_str(), &fi);
+        if(ret != 0) return ret;
+    }
+    return 0;
+}
+
+/**
+ * the benchmarks run against a mounted rocksdb_fs without fuse, the file and its parent directory stay open
+ * so that ops hit the inode and directory caches. RFS_BENCH_DB overrides the db path (default: ./bench_db),
+ * a comma separated list of paths shards the fs. RFS_BENCH_BG_IO_LIMIT sets --bg_io_limit in MiB/s,
+ * RFS_BENCH_BLOCK_CACHE, RFS_BENCH_SECONDARY_CACHE and RFS_BENCH_INODE_CACHE the cache sizes in MiB,
+ * RFS_BENCH_META_IN_MEMORY=1 puts the inodes in plain tables
+ */
+int main(int argc, char** argv) {
+    benchmark::Initialize(&argc, argv);
+    if(benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+
+    const char* env = getenv("RFS_BENCH_DB");
+    string list = env ? env : "./bench_db";
+    vector<string> dbpaths;
+    for(size_t beg = 0, end;beg <= list.size();beg = end + 1) {
+        end = std::min(list.find(',', beg), list.size());
+        dbpaths.push_back(list.substr(beg, end - beg));
+    }
+    rfs_config conf;
+    if(const char* limit = getenv("RFS_BENCH_BG_IO_LIMIT")) {
+        conf.bg_io_limit = strtoull(limit, nullptr, 10) << 20;
+    }
+    if(const char* sz = getenv("RFS_BENCH_BLOCK_CACHE")) {
+        conf.block_cache_sz = strtoull(sz, nullptr, 10) << 20;
+    }
+    if(const char* sz = getenv("RFS_BENCH_SECONDARY_CACHE")) {
+        conf.secondary_cache_sz = strtoull(sz, nullptr, 10) << 20;
+    }
+    if(const char* sz = getenv("RFS_BENCH_INODE_CACHE")) {
+        conf.inode_cache_sz = strtoull(sz, nullptr, 10) << 20;
+    }
+    if(const char* meta = getenv("RFS_BENCH_META_IN_MEMORY")) {
+        conf.meta_in_memory = strcmp(meta, "1") == 0;
+    }
+    if(fs.connect(dbpaths, conf) != 0 || fs.mount() != 0) {
+        fprintf(stderr, "failed to open db\n");
+        return 1;
+    }
+    // created before the root is held open, lookup reads the root's dentries from db
+    int ret = fs.mkdir(ns_dir, 0755, getuid(), getgid());
+    if((ret != 0 && ret != -EEXIST) || make_lookup_dirs() != 0 || make_cold_file() != 0) {
+        fprintf(stderr, "failed to create the bench files\n");
+        return 1;
+    }
+    file_fi.flags = O_RDWR;
+    if(fs.opendir("/", &dir_fi) != 0) {
+        return 1;
+    }
+    ret = fs.create(bench_file, S_IFREG | 0644, getuid(), getgid(), &file_fi);
+    if(ret == -EEXIST) {
+        ret = fs.open(bench_file, &file_fi);
+    }
+    if(ret != 0) {
+        fprintf(stderr, "failed to open %s\n", bench_file);
+        return 1;
+    }
+    // a block held by the cached inode
+    char blk[BLOCK_SZ] = {};
+    fs.write(bench_file, blk, BLOCK_SZ, 0, &file_fi);
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+
+    fs.release(&file_fi);
+    fs.releasedir("/", &dir_fi);
+    fs.close();
+    return 0;
+}
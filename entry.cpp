@@ -3,17 +3,63 @@
 //
 
 #include "rocksdb_fs.h"
+#include "rfs_lowlevel.h"
+#include <sched.h>
+#include <fcntl.h>
 
 struct fuse_options {
-     const char *dbpath;
+     int clone;
+     int dedup;
+     int threads;
+     int async;
+     int inode_cache;
+     int bg_io_limit;
+     int bg_jobs;
+     int block_cache;
+     int hyper_clock;
+     int secondary_cache;
+     int meta_in_memory;
+     int index;
+     int change_log;
+     const char *cold_path;
+     int hot_size;
+     int inline_size;
+     int hot_set;
+     int no_writeback_cache;
+     const char *cpus;
+     const char *trace;
      int show_help;
 //     int attr_timeout;
 //     int entry_timeout;
 } fuse_opts;
 
+// every --dbpath given is a shard
+static vector<string> dbpaths;
+enum { KEY_DBPATH };
+
 #define OPTION(t, p) {t, offsetof(fuse_options, p), 1}
 static const fuse_opt option_spec[] = {
-        OPTION("--dbpath=%s", dbpath),
+        FUSE_OPT_KEY("--dbpath=", KEY_DBPATH),
+        OPTION("--clone", clone),
+        OPTION("--dedup", dedup),
+        OPTION("--threads=%d", threads),
+        OPTION("--async=%d", async),
+        OPTION("--inode_cache=%d", inode_cache),
+        OPTION("--bg_io_limit=%d", bg_io_limit),
+        OPTION("--bg_jobs=%d", bg_jobs),
+        OPTION("--block_cache=%d", block_cache),
+        OPTION("--hyper_clock", hyper_clock),
+        OPTION("--secondary_cache=%d", secondary_cache),
+        OPTION("--meta_in_memory", meta_in_memory),
+        OPTION("--index", index),
+        OPTION("--change_log=%d", change_log),
+        OPTION("--cold_path=%s", cold_path),
+        OPTION("--hot_size=%d", hot_size),
+        OPTION("--inline_size=%d", inline_size),
+        OPTION("--hot_set=%d", hot_set),
+        OPTION("--no_writeback_cache", no_writeback_cache),
+        OPTION("--cpus=%s", cpus),
+        OPTION("--trace=%s", trace),
 //        OPTION("--attr_timeout=%d", attr_timeout),
 //        OPTION("--entry_timeout=%d", entry_timeout),
         OPTION("--help", show_help),
@@ -21,32 +67,175 @@ static const fuse_opt option_spec[] = {
 };
 
 static rocksdb_fs fs;
+static rfs_tracer* tracer = nullptr; // set while ops are traced
 
-void* rfs_init(fuse_conn_info* conn_info, fuse_config *cfg) {
-    int ret = fs.connect(fuse_opts.dbpath);
-    if(ret != 0) goto err;
+/**
+ * connect and mount the fs with the options given, the same for either session
+ * @return -1 if the session has to end
+ */
+static int rfs_start(fuse_conn_info* conn_info) {
+    rfs_config conf;
+    conf.clone = fuse_opts.clone;
+    conf.dedup = fuse_opts.dedup;
+    if(fuse_opts.inode_cache >= 0) {
+        conf.inode_cache_sz = (size_t)fuse_opts.inode_cache << 20;
+    }
+    if(fuse_opts.bg_io_limit > 0) {
+        conf.bg_io_limit = (size_t)fuse_opts.bg_io_limit << 20;
+    }
+    if(fuse_opts.bg_jobs > 0) {
+        conf.bg_jobs = fuse_opts.bg_jobs;
+    }
+    if(fuse_opts.block_cache >= 0) {
+        conf.block_cache_sz = (size_t)fuse_opts.block_cache << 20;
+    }
+    conf.hyper_clock = fuse_opts.hyper_clock;
+    conf.meta_in_memory = fuse_opts.meta_in_memory;
+    conf.index = fuse_opts.index;
+    if(fuse_opts.change_log > 0) {
+        conf.change_log_ttl = (uint64_t)fuse_opts.change_log * 3600;
+    }
+    if(fuse_opts.cold_path != nullptr) {
+        conf.cold_path = fuse_opts.cold_path;
+    }
+    if(fuse_opts.hot_size > 0) {
+        conf.hot_sz = (uint64_t)fuse_opts.hot_size << 20;
+    }
+    if(fuse_opts.inline_size > 0) {
+        conf.inline_sz = std::min((size_t)fuse_opts.inline_size, (size_t)BLOCK_SZ);
+    }
+    if(fuse_opts.hot_set > 0) {
+        conf.hot_set_sz = fuse_opts.hot_set;
+    }
+    if(fuse_opts.secondary_cache > 0) {
+        conf.secondary_cache_sz = (size_t)fuse_opts.secondary_cache << 20;
+    }
+    if(fuse_opts.async > 0) {
+        conf.async_threads = fuse_opts.async;
+    }
 
-    ret = fs.mount();
-    if(ret != 0) goto err;
-    goto ok;
+    // every change goes through this mount, so the kernel may hold on to dirty pages and send them as large
+    // writes later, and keep a file's pages across opens. read replies are spliced into /dev/fuse, requests
+    // are still read into memory as write takes a buffer. max_write is left to libfuse, which allows the most
+    // its buffer holds, 1MiB on kernels that take max_pages. max_readahead can only be lowered from the
+    // kernel's, raise read_ahead_kb of the mount's bdi for more
+    if(!fuse_opts.no_writeback_cache) {
+        conn_info->want |= conn_info->capable & FUSE_CAP_WRITEBACK_CACHE;
+    }
+    conn_info->want |= conn_info->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+    // readahead and writeback of many files at once, unless -o max_background is given
+    if(conn_info->max_background == 0) {
+        conn_info->max_background = 64;
+        conn_info->congestion_threshold = 48;
+    }
+
+    if(fs.connect(dbpaths, conf) != 0 || fs.mount() != 0) {
+        return -1;
+    }
 
-    err: fuse_exit(fuse_get_context()->fuse);
-    ok: return nullptr;
+    // opened here like the db, after daemonizing
+    if(fuse_opts.trace != nullptr) {
+        static rfs_tracer t;
+        if(t.open(fuse_opts.trace) != 0) {
+            fprintf(stderr, "failed to open trace file %s\n", fuse_opts.trace);
+            return -1;
+        }
+        tracer = &t;
+    }
+    return 0;
 }
 
-void rfs_destroy(void* p) {
+static void rfs_stop() {
+    if(tracer != nullptr) {
+        tracer->close();
+        tracer = nullptr;
+    }
     fs.close();
+}
+
+void* rfs_init(fuse_conn_info* conn_info, fuse_config *cfg) {
+    if(rfs_start(conn_info) != 0) {
+        fuse_exit(fuse_get_context()->fuse);
+    }
+    return nullptr;
+}
+
+void rfs_destroy(void* p) {
+    rfs_stop();
     fuse_exit(fuse_get_context()->fuse);
 }
 
+/**
+ * the pages of a file opened stay cached after it's closed, nothing but this mount changes it
+ */
+static int keep_cache(int ret, fuse_file_info* fi) {
+    if(ret == 0 && !fuse_opts.no_writeback_cache && (fi->flags & O_DIRECT) == 0) {
+        fi->keep_cache = 1;
+    }
+    return ret;
+}
+
 int rfs_mknod(const char* path, mode_t mode, dev_t dev) {
-    int ret = fs.mknod(path, mode);
-    return ret < 0 ? ret : 0;
+    rfs_trace_scope t(tracer, op_mknod, path, nullptr, 0, 0, mode);
+    fuse_context* ctx = fuse_get_context();
+    int ret = fs.mknod(path, mode, ctx->uid, ctx->gid);
+    return t.done(ret < 0 ? ret : 0);
+}
+
+/**
+ * RFS_IOC_BATCH on a directory is the only ioctl, data holds the batch in and the results out
+ */
+int rfs_ioctl(const char* path, rfs_ioctl_cmd cmd, void* arg, fuse_file_info* fi, unsigned int flags, void* data) {
+    if(flags & FUSE_IOCTL_COMPAT) {
+        return -ENOSYS;
+    }
+    if((unsigned int)cmd != RFS_IOC_BATCH || (flags & FUSE_IOCTL_DIR) == 0) {
+        return -ENOTTY;
+    }
+    fuse_context* ctx = fuse_get_context();
+    return fs.batch(path, fi, (rfs_batch_d*)data, ctx->uid, ctx->gid);
 }
 
 void show_help() {
     printf("File-system specific options:\n"
-           "    --dbpath=<s>        Path to save rocksdb's persistent file (default: \".//db\")"
+           "    --dbpath=<s>        Path to save rocksdb's persistent file (default: \".//db\"), given more than once\n"
+           "                        each path holds a shard of the fs, best on a device of its own\n"
+           "    --clone             copy_file_range of a whole file shares its data copy-on-write\n"
+           "    --dedup             files created store identical blocks once\n"
+           "    --inode_cache=<n>   MiB of inodes kept in memory after close, 0 disables (default: 32)\n"
+           "    --bg_io_limit=<n>   MiB/s flushes and compactions of a shard may use at most, tuned down while\n"
+           "                        they have little to do, compactions run at low io priority (default: no limit)\n"
+           "    --bg_jobs=<n>       Flushes and compactions a shard runs at once (default: 16)\n"
+           "    --block_cache=<n>   MiB of uncompressed blocks cached for all shards, 0 disables (default: 32)\n"
+           "    --hyper_clock       Lock free HyperClockCache as block cache instead of LRU, for many threads\n"
+           "    --secondary_cache=<n>  MiB of blocks evicted from the block cache kept compressed (default: 0)\n"
+           "                        cache sizes and hit ratios are in the user.rfs.stats xattr of the root\n"
+           "    --meta_in_memory    Inodes in a column family of plain tables read through mmap, for volumes whose\n"
+           "                        metadata fits in memory. kept once chosen, inodes already there are moved\n"
+           "    --index             Index inodes by mtime, size and name, cat /.rfs_find/<query> lists the paths\n"
+           "                        matching, e.g. mtime>1700000000,size>1M,name=*.log. kept once chosen\n"
+           "    --change_log=<n>    Hours the WAL is kept for rfs_changes to read what changed since a backup\n"
+           "                        (default: 0, not kept)\n"
+           "    --cold_path=<s>     Slower device file data moves to past --hot_size, a directory per shard is made\n"
+           "                        in it. inodes stay on the dbpath, tier sizes and reads are in user.rfs.stats.\n"
+           "                        kept once chosen, a mount without it uses the one the shards were made with\n"
+           "    --hot_size=<n>      MiB of file data a shard keeps on its dbpath with --cold_path (default: 16384)\n"
+           "    --inline_size=<n>   Files up to n bytes are kept in their inode, read with one lookup (default: 0, max: 4096)\n"
+           "    --hot_set=<n>       Save the n inodes read most every few minutes and at unmount, the next mount\n"
+           "                        prefetches them and the start of the files among them in the background (default: 0)\n"
+           "    --no_writeback_cache  Send writes to the fs as they are made and drop a file's pages when it's opened\n"
+           "                        again, for comparison (default: the kernel caches both)\n"
+           "    --threads=<n>       Max worker threads of the session loop (libfuse >= 3.12, default: libfuse's).\n"
+           "                        a request holds its worker until it's replied to, they bound the requests in\n"
+           "                        flight. read and readdir issue the reads of a request together\n"
+           "    --async=<n>         Run a low level session whose getattr, lookup and read are deferred to n threads,\n"
+           "                        which issue the reads of all the ones waiting together and reply to them. a\n"
+           "                        worker takes the next request once one is deferred, so a few keep many in\n"
+           "                        flight (default: 0, the high level session)\n"
+           "    --cpus=<list>       Pin the daemon to cpus, e.g. 0-3,8 (default: no pinning)\n"
+           "    --trace=<file>      Record every op to file for rfs_replay (default: off)\n"
+           "    -o clone_fd         Give each worker thread its own /dev/fuse channel\n"
+           "    -o max_idle_threads=<n>  Idle worker threads kept by the session loop (default: 10)\n"
 //           "    --attr_timeout      Timeout of file's attributes in seconds (default: 60)"
 //           "    --entry_timeout     Timeout of directory's entry in seconds (default: 60)"
            "\n");
@@ -54,46 +243,266 @@ void show_help() {
 
 
 static const fuse_operations rfs_oper = {
-        .getattr = [](const char* path, struct stat* stat, fuse_file_info *fi) { return fs.getattr(path, stat); },
+        .getattr = [](const char* path, struct stat* stat, fuse_file_info *fi) {
+            rfs_trace_scope t(tracer, op_getattr, path);
+            return t.done(fs.getattr(path, stat));
+        },
         .mknod = rfs_mknod,
-        .mkdir = [](const char* path, mode_t mode) { return fs.mkdir(path, mode);},
-        .unlink = [](const char* path) { return fs.unlink(path); },
-        .rmdir = [](const char* path) { return fs.rmdir(path); },
-        .rename = [](const char* from, const char* to, unsigned int flags){ return fs.rename(from, to); },
-        .truncate = [](const char* path, off_t size, struct fuse_file_info *fi) { return fs.truncate(path, size, fi); },
-        .open = [](const char* path, fuse_file_info* fi) { return fs.open(path, fi); },
-        .read = [](const char* path, char* buf, size_t size, off_t offset, fuse_file_info * fi) { return fs.read(path, buf, size, offset, fi); },
-        .write = [](const char* path, const char* buf, size_t size, off_t offset, fuse_file_info* fi) { return fs.write(path, buf, size, offset, fi); },
-        .release = [](const char* path, fuse_file_info* fi){ return fs.release(fi); },
-        .fsync = [](const char* path, int, fuse_file_info* fi) { return fs.fsync(fi); },
-        .opendir = [](const char* path, struct fuse_file_info* fi) { return fs.opendir(path, fi); },
+        .mkdir = [](const char* path, mode_t mode) {
+            rfs_trace_scope t(tracer, op_mkdir, path, nullptr, 0, 0, mode);
+            return t.done(fs.mkdir(path, mode, fuse_get_context()->uid, fuse_get_context()->gid));
+        },
+        .unlink = [](const char* path) {
+            rfs_trace_scope t(tracer, op_unlink, path);
+            return t.done(fs.unlink(path));
+        },
+        .rmdir = [](const char* path) {
+            rfs_trace_scope t(tracer, op_rmdir, path);
+            return t.done(fs.rmdir(path));
+        },
+        .rename = [](const char* from, const char* to, unsigned int flags) {
+            rfs_trace_scope t(tracer, op_rename, from);
+            t.second(to);
+            return t.done(fs.rename(from, to));
+        },
+        .chmod = [](const char* path, mode_t mode, fuse_file_info* fi) {
+            rfs_trace_scope t(tracer, op_chmod, path, nullptr, 0, 0, mode);
+            return t.done(fs.chmod(path, mode));
+        },
+        .chown = [](const char* path, uid_t uid, gid_t gid, fuse_file_info* fi) {
+            rfs_trace_scope t(tracer, op_chown, path, nullptr, 0, gid, uid);
+            return t.done(fs.chown(path, uid, gid));
+        },
+        .truncate = [](const char* path, off_t size, struct fuse_file_info *fi) {
+            rfs_trace_scope t(tracer, op_truncate, path, fi, 0, size);
+            return t.done(fs.truncate(path, size, fi));
+        },
+        .open = [](const char* path, fuse_file_info* fi) {
+            rfs_trace_scope t(tracer, op_open, path, fi);
+            return t.done(keep_cache(fs.open(path, fi), fi));
+        },
+        .read = [](const char* path, char* buf, size_t size, off_t offset, fuse_file_info * fi) {
+            rfs_trace_scope t(tracer, op_read, path, fi, offset, size);
+            return t.done(fs.read(path, buf, size, offset, fi));
+        },
+        .write = [](const char* path, const char* buf, size_t size, off_t offset, fuse_file_info* fi) {
+            rfs_trace_scope t(tracer, op_write, path, fi, offset, size);
+            return t.done(fs.write(path, buf, size, offset, fi));
+        },
+        .statfs = [](const char* path, struct statvfs* st) {
+            return fs.statfs(path, st);
+        },
+        .release = [](const char* path, fuse_file_info* fi) {
+            rfs_trace_scope t(tracer, op_release, path, fi);
+            return t.done(fs.release(fi));
+        },
+        .fsync = [](const char* path, int, fuse_file_info* fi) {
+            rfs_trace_scope t(tracer, op_fsync, path, fi);
+            return t.done(fs.fsync(fi));
+        },
+        .getxattr = [](const char* path, const char* name, char* value, size_t size) {
+            rfs_trace_scope t(tracer, op_getxattr, path, nullptr, 0, size);
+            t.second(name);
+            return t.done(fs.getxattr(path, name, value, size));
+        },
+        .listxattr = [](const char* path, char* list, size_t size) {
+            rfs_trace_scope t(tracer, op_listxattr, path, nullptr, 0, size);
+            return t.done(fs.listxattr(path, list, size));
+        },
+        .opendir = [](const char* path, struct fuse_file_info* fi) {
+            rfs_trace_scope t(tracer, op_opendir, path, fi);
+            return t.done(fs.opendir(path, fi));
+        },
         .readdir = [](const char* path, void* buf, fuse_fill_dir_t filter,
-                      off_t off, struct fuse_file_info* fi, fuse_readdir_flags flags) { return fs.readdir(path, buf, filter, off, fi, flags); },
-        .releasedir = [](const char* path, struct fuse_file_info* fi) { return fs.releasedir(path, fi); },
+                      off_t off, struct fuse_file_info* fi, fuse_readdir_flags flags) {
+            rfs_trace_scope t(tracer, op_readdir, path, fi, off, 0, flags);
+            return t.done(fs.readdir(path, buf, filter, off, fi, flags));
+        },
+        .releasedir = [](const char* path, struct fuse_file_info* fi) {
+            rfs_trace_scope t(tracer, op_releasedir, path, fi);
+            return t.done(fs.releasedir(path, fi));
+        },
         .init = rfs_init,
         .destroy = rfs_destroy,
-        .create = [](const char* path, mode_t mode, fuse_file_info* fi){ return fs.create(path, mode, fi); },
-        .utimens = [](const char* path, const timespec tv[2], fuse_file_info* fi){ return 0; },
+        .create = [](const char* path, mode_t mode, fuse_file_info* fi) {
+            rfs_trace_scope t(tracer, op_create, path, fi, 0, 0, mode);
+            return t.done(keep_cache(fs.create(path, mode, fuse_get_context()->uid, fuse_get_context()->gid, fi), fi));
+        },
+        .utimens = [](const char* path, const timespec tv[2], fuse_file_info* fi) {
+            rfs_trace_scope t(tracer, op_utimens, path, nullptr, rfs_utime_ns(tv[0]), rfs_utime_ns(tv[1]),
+                              rfs_utime_bits(tv[0]) | rfs_utime_bits(tv[1]) << 2);
+            return t.done(fs.utimens(path, tv));
+        },
+        .ioctl = rfs_ioctl,
+        .fallocate = [](const char* path, int mode, off_t offset, off_t len, fuse_file_info* fi) {
+            rfs_trace_scope t(tracer, op_fallocate, path, fi, offset, len, mode);
+            return t.done(fs.fallocate(path, mode, offset, len, fi));
+        },
+        .copy_file_range = [](const char* path_in, fuse_file_info* fi_in, off_t off_in, const char* path_out,
+                              fuse_file_info* fi_out, off_t off_out, size_t size, int flags) {
+            rfs_trace_scope t(tracer, op_copy_file_range, path_in, fi_in, off_in, size, flags);
+            t.second(path_out, fi_out, off_out);
+            return t.done(fs.copy_file_range(path_in, fi_in, off_in, path_out, fi_out, off_out, size, flags));
+        },
+        .lseek = [](const char* path, off_t off, int whence, fuse_file_info* fi) {
+            rfs_trace_scope t(tracer, op_lseek, path, fi, off, 0, whence);
+            return t.done(fs.lseek(path, off, whence, fi));
+        },
 };
 
+/**
+ * parse a cpu list like "0-3,8" into set
+ * @return -1 if the list is malformed
+ */
+static int parse_cpus(const char* list, cpu_set_t* set) {
+    CPU_ZERO(set);
+    char* p = (char*)list;
+    while(*p != '\0') {
+        char* end;
+        long from = strtol(p, &end, 10), to = from;
+        if(end == p) return -1;
+        if(*end == '-') {
+            p = end + 1;
+            to = strtol(p, &end, 10);
+            if(end == p) return -1;
+        }
+        if(from < 0 || to < from || to >= CPU_SETSIZE) return -1;
+        for(long cpu = from;cpu <= to;cpu++) {
+            CPU_SET(cpu, set);
+        }
+        if(*end == ',') end++;
+        else if(*end != '\0') return -1;
+        p = end;
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+static int opt_proc(void* data, const char* arg, int key, fuse_args* outargs) {
+    if(key == KEY_DBPATH) {
+        dbpaths.emplace_back(arg + strlen("--dbpath="));
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * run the loop of the high level session f or of the low level one se, multithreaded unless -s is given
+ */
+static int run_loop(fuse* f, fuse_session* se, const fuse_cmdline_opts& opts) {
+    if(opts.singlethread) {
+        return f != nullptr ? fuse_loop(f) : fuse_session_loop(se);
+    }
+
+#if FUSE_USE_VERSION >= FUSE_MAKE_VERSION(3, 12)
+    fuse_loop_config* config = fuse_loop_cfg_create();
+    fuse_loop_cfg_set_clone_fd(config, opts.clone_fd);
+    fuse_loop_cfg_set_idle_threads(config, opts.max_idle_threads);
+    if(fuse_opts.threads > 0) {
+        fuse_loop_cfg_set_max_threads(config, fuse_opts.threads);
+    }
+    int ret = f != nullptr ? fuse_loop_mt(f, config) : fuse_session_loop_mt(se, config);
+    fuse_loop_cfg_destroy(config);
+    return ret;
+#else
+    if(fuse_opts.threads > 0) {
+        fprintf(stderr, "--threads needs libfuse >= 3.12, workers are spawned on demand\n");
+    }
+    fuse_loop_config config = {};
+    config.clone_fd = opts.clone_fd;
+    config.max_idle_threads = opts.max_idle_threads;
+    return f != nullptr ? fuse_loop_mt(f, &config) : fuse_session_loop_mt(se, &config);
+#endif
+}
+
+/**
+ * mount with the low level session of --async
+ */
+static int run_async(fuse_args* args, const fuse_cmdline_opts& opts, const cpu_set_t* cpus) {
+    int ret = 1;
+    rfs_session_conf conf = {&fs, &tracer, !fuse_opts.no_writeback_cache, rfs_start, rfs_stop};
+    fuse_session* se = rfs_session_new(args, conf);
+    if(se == nullptr) return 1;
+    if(fuse_session_mount(se, opts.mountpoint) != 0) goto destroy;
+    if(fuse_daemonize(opts.foreground) != 0 || fuse_set_signal_handlers(se) != 0) goto unmount;
+
+    if(cpus != nullptr && sched_setaffinity(0, sizeof(*cpus), cpus) != 0) {
+        perror("sched_setaffinity");
+    }
+
+    ret = run_loop(nullptr, se, opts) == 0 ? 0 : 1;
+    fuse_remove_signal_handlers(se);
+
+    unmount: fuse_session_unmount(se);
+    destroy: fuse_session_destroy(se);
+    return ret;
+}
+
 int main(int argc, char *argv[])
 {
 
     fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
-    fuse_opts.dbpath = strdup("./db");
-    if(fuse_opt_parse(&args, &fuse_opts, option_spec, NULL) == -1) {
+    fuse_opts.inode_cache = -1;
+    fuse_opts.block_cache = -1;
+    if(fuse_opt_parse(&args, &fuse_opts, option_spec, opt_proc) == -1) {
         return 1;
     }
+    if(dbpaths.empty()) {
+        dbpaths.emplace_back("./db");
+    }
 
-    if(fuse_opts.show_help) {
+    fuse_cmdline_opts opts = {};
+    if(fuse_parse_cmdline(&args, &opts) != 0) {
+        return 1;
+    }
+
+    int ret = 1;
+    fuse* f = nullptr;
+    cpu_set_t cpus;
+    if(fuse_opts.show_help || opts.show_help) {
+        printf("usage: %s [options] <mountpoint>\n\n", argv[0]);
+        fuse_cmdline_help();
+        fuse_lib_help(&args);
         show_help();
-        args.argv[0][0] = '\0';
+        ret = 0;
+        goto out;
+    }
+    if(opts.show_version) {
+        printf("FUSE library version %s\n", fuse_pkgversion());
+        ret = 0;
+        goto out;
+    }
+    if(opts.mountpoint == nullptr) {
+        fprintf(stderr, "no mountpoint specified\n");
+        goto out;
+    }
+    if(fuse_opts.cpus != nullptr && parse_cpus(fuse_opts.cpus, &cpus) != 0) {
+        fprintf(stderr, "invalid cpu list: %s\n", fuse_opts.cpus);
+        goto out;
     }
 
-    int ret = fuse_main(args.argc, args.argv, &rfs_oper, NULL);
-    fuse_opt_free_args(&args);
+    if(fuse_opts.async > 0) {
+        ret = run_async(&args, opts, fuse_opts.cpus != nullptr ? &cpus : nullptr);
+        goto out;
+    }
+
+    f = fuse_new(&args, &rfs_oper, sizeof(rfs_oper), NULL);
+    if(f == nullptr) goto out;
+    if(fuse_mount(f, opts.mountpoint) != 0) goto destroy;
+    if(fuse_daemonize(opts.foreground) != 0 || fuse_set_signal_handlers(fuse_get_session(f)) != 0) goto unmount;
 
+    // worker threads and rocksdb's background threads inherit the affinity of the thread creating them
+    if(fuse_opts.cpus != nullptr && sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+        perror("sched_setaffinity");
+    }
+
+    ret = run_loop(f, nullptr, opts) == 0 ? 0 : 1;
+    fuse_remove_signal_handlers(fuse_get_session(f));
 
+    unmount: fuse_unmount(f);
+    destroy: fuse_destroy(f);
+    out:
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
     return ret;
-}
\ No newline at end of file
+}
@@ -4,21 +4,33 @@
 
 #include "types.h"
 #include <cstddef>
+#include <algorithm>
+#include <sys/stat.h>
 
 /**
  * |------------------size-----------------|
  * |---------data_size----------||-attr_sz-|
  * |--used_dat_sz--||---nused---||-attr_sz-|
+ * the attributes are the members past used_dat_sz followed by an rfs_attr_tag
  */
 
+// the attributes as they are in memory, from after used_dat_sz to the end
+static const size_t MEM_ATTR_SZ = sizeof(inode_t) - offsetof(inode_t, used_dat_sz) - sizeof(size_t);
+
 /**
  * empty inode
  */
 inode_t::inode_t() {
     this->used_dat_sz = 0;
-    this->attr_sz = sizeof(inode_t) - offsetof(inode_t, used_dat_sz) - sizeof(size_t);
+    this->dirty_sz = 0;
+    this->attr_dirty = false;
+    this->written = false;
+    this->written_sz = 0;
+    this->written_mtime = 0;
+    this->attr_sz = MEM_ATTR_SZ + sizeof(rfs_attr_tag);
     this->size = this->attr_sz;
     this->_data = new uint8_t[this->size + this->attr_sz];
+    memset(&this->used_dat_sz + 1, 0, MEM_ATTR_SZ);
 }
 
 /**
@@ -27,108 +39,521 @@ inode_t::inode_t() {
  * @param size the size of the whole inode
  */
 inode_t::inode_t(const char* data, size_t size) {
-    this->size = size;
+    this->dirty_sz = 0;
+    this->attr_dirty = false;
+    this->written = true;
     // currently all attributes above used_dat_sz and used_dat_sz itself will not be persistent
-    this->attr_sz = sizeof(inode_t) - offsetof(inode_t, used_dat_sz) - sizeof(size_t);
-    this->used_dat_sz = size - attr_sz;
+    this->attr_sz = MEM_ATTR_SZ + sizeof(rfs_attr_tag);
+    memset(&this->used_dat_sz + 1, 0, MEM_ATTR_SZ);
+    // the tag tells how many bytes of attributes the record has, one without it is of the untagged layout
+    size_t stored = INODE_ATTR_UNTAGGED_SZ, tail = 0;
+    rfs_attr_tag tag;
+    if(size >= sizeof(tag)) {
+        memcpy(&tag, data + size - sizeof(tag), sizeof(tag));
+        if(tag.magic == INODE_ATTR_MAGIC && tag.attr_sz + sizeof(tag) <= size) {
+            stored = tag.attr_sz;
+            tail = sizeof(tag);
+        }
+    }
+    if(size < stored + tail) {
+        // written without attributes, treat as empty
+        this->used_dat_sz = 0;
+        this->size = this->attr_sz;
+        this->_data = new uint8_t[this->size];
+        this->written_sz = 0;
+        this->written_mtime = 0;
+        return;
+    }
+    this->used_dat_sz = size - stored - tail;
+    this->size = this->used_dat_sz + this->attr_sz;
     this->_data = new uint8_t[this->size];
 
     memcpy(this->_data, data, this->used_dat_sz);
-    memcpy(&this->used_dat_sz + 1, data + this->used_dat_sz, this->attr_sz); // copy attributes
+    // attributes only ever get appended, those an older record lacks stay zero and a newer one's extra are left
+    memcpy(&this->used_dat_sz + 1, data + this->used_dat_sz, std::min(stored, MEM_ATTR_SZ));
+    this->written_sz = this->file_sz;
+    this->written_mtime = this->mtime.tv_sec;
+    // inodes from before modes were kept have no type, only directories had data then
+    if(S_ISDIR(this->mode) || this->mode == 0) {
+        load_dir();
+    }
+}
+
+/**
+ * read a record of format 0, which is the data alone: a directory's entries in the old format or a regular
+ * file's bytes. the bytes become dirty blocks of the file, the inode is new to the layout until written back
+ */
+inode_t::inode_t(const char* data, size_t size, file_type ftype) : inode_t() {
+    this->mode = (ftype == dir ? S_IFDIR : S_IFREG) | 0777;
+    if(ftype == dir) {
+        reserve(size);
+        memcpy(this->_data, data, size);
+        this->used_dat_sz = size;
+        load_dir();
+    } else {
+        write_data(data, size, 0);
+    }
+    this->attr_dirty = true;
 }
 
 const uint8_t *inode_t::data() const {
     return _data;
 }
 
+/**
+ * @return the ino the blocks of this file are stored under
+ */
+uint64_t inode_t::blk_ino(uint64_t ino) const {
+    return this->data_ino ? this->data_ino : ino;
+}
+
+/**
+ * set the timestamps in which, a mask of RFS_ATIME, RFS_MTIME and RFS_CTIME, to now.
+ * the change stays in memory until the inode is written back
+ */
+void inode_t::touch(int which) {
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if(which & RFS_ATIME) this->atime = now;
+    if(which & RFS_MTIME) this->mtime = now;
+    if(which & RFS_CTIME) this->ctime = now;
+    this->attr_dirty = true;
+}
+
+static bool ts_before(const timespec& a, const timespec& b) {
+    return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec <= b.tv_nsec);
+}
+
+/**
+ * @return whether a read should refresh atime
+ */
+bool inode_t::atime_stale() const {
+    if(ts_before(this->atime, this->mtime) || ts_before(this->atime, this->ctime)) {
+        return true;
+    }
+    return time(nullptr) - this->atime.tv_sec >= RELATIME_INTERVAL;
+}
+
 /**
  * adjust the attributes to data before write back to db
  */
 void inode_t::before_write_back() {
-    memcpy(this->_data + this->used_dat_sz, &this->used_dat_sz + 1, this->attr_sz);
+    memcpy(this->_data + this->used_dat_sz, &this->used_dat_sz + 1, MEM_ATTR_SZ);
+    rfs_attr_tag tag = {(uint16_t)MEM_ATTR_SZ, INODE_ATTR_MAGIC};
+    memcpy(this->_data + this->used_dat_sz + MEM_ATTR_SZ, &tag, sizeof(tag));
 }
 
 /**
- * append one dentry to the end of data
+ * 32 bit FNV-1a of a name, the slots are sorted by it
  */
-void inode_t::append_dentry_d(rfs_dentry_d *d) {
-    size_t dat_sz = this->size - this->attr_sz;
-    if(this->used_dat_sz + sizeof(rfs_dentry_d) > dat_sz) {
-        this->size = this->used_dat_sz + sizeof(rfs_dentry_d) + this->attr_sz;
-        auto tmp_dt = new uint8_t[this->size];
-        memcpy(tmp_dt, this->_data, this->used_dat_sz);
-        memcpy(tmp_dt + this->used_dat_sz, d, sizeof(rfs_dentry_d));
+static uint32_t dentry_hash(string_view name) {
+    uint32_t h = 0x811c9dc5;
+    for(unsigned char c : name) {
+        h ^= c;
+        h *= 0x01000193;
+    }
+    return h;
+}
 
-        delete[] this->_data;
-        this->_data = tmp_dt;
-    } else {
-        memcpy(this->_data + this->used_dat_sz, d, sizeof(rfs_dentry_d));
+/**
+ * bytes an entry takes, padded so that the next one and the slots stay aligned
+ */
+static size_t dentry_sz(size_t name_len) {
+    return (offsetof(rfs_dentry_d, name) + name_len + 1 + 3) & ~(size_t)3;
+}
+
+// a directory entry as written before the sorted format
+struct rfs_dentry_d_v1 {
+    uint64_t ino;
+    file_type ftype;
+    char name[55];
+};
+
+/**
+ * @return the header of the directory, nullptr if it has no entry
+ */
+rfs_dir_d* inode_t::dir_d() {
+    auto* d = (rfs_dir_d*)this->_data;
+    if(this->used_dat_sz >= sizeof(rfs_dir_d) && d->magic == DIR_MAGIC
+       && this->used_dat_sz == sizeof(rfs_dir_d) + d->dents_sz + (size_t)d->cnt * sizeof(rfs_dslot_d)) {
+        return d;
+    }
+    return nullptr;
+}
+
+/**
+ * convert a directory in the old format as it's read, before the inode is shared. the new one is written back
+ * with its next change
+ */
+void inode_t::load_dir() {
+    if(this->used_dat_sz == 0 || dir_d() != nullptr) {
+        return;
+    }
+    std::vector<rfs_dirent> ents;
+    auto* old = (const rfs_dentry_d_v1*)this->_data;
+    for(size_t i = 0;i < this->used_dat_sz / sizeof(rfs_dentry_d_v1);i++, old++) {
+        ents.push_back({old->ino, old->ftype, string(old->name, strnlen(old->name, sizeof(old->name)))});
+    }
+    this->used_dat_sz = 0;
+    build_dir(ents);
+}
+
+rfs_dslot_d* inode_t::dslots(rfs_dir_d* d) {
+    return (rfs_dslot_d*)(this->_data + sizeof(rfs_dir_d) + d->dents_sz);
+}
+
+char* inode_t::dents(rfs_dir_d* d) {
+    return (char*)this->_data + sizeof(rfs_dir_d);
+}
+
+/**
+ * @return the first slot not ordered before (hash, name)
+ */
+size_t inode_t::find_dslot(rfs_dir_d* d, uint32_t hash, string_view name) {
+    rfs_dslot_d* slots = dslots(d);
+    char* ents = dents(d);
+    size_t lo = 0, hi = d->cnt;
+    while(lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        // names are only compared once the hashes are equal
+        if(slots[mid].hash < hash || (slots[mid].hash == hash && ((rfs_dentry_d*)(ents + slots[mid].off))->get_name() < name)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
     }
+    return lo;
+}
 
-    this->used_dat_sz += sizeof(rfs_dentry_d);
+/**
+ * make room for dat_sz bytes of data, the room grows by doubling so that adding entries one by one
+ * copies the directory a logarithmic number of times
+ */
+void inode_t::reserve(size_t dat_sz) {
+    size_t cap = this->size - this->attr_sz;
+    if(dat_sz <= cap) {
+        return;
+    }
+    cap = std::max(dat_sz, cap * 2);
+    auto tmp_dt = new uint8_t[cap + this->attr_sz];
+    memcpy(tmp_dt, this->_data, this->used_dat_sz);
+    delete[] this->_data;
+    this->_data = tmp_dt;
+    this->size = cap + this->attr_sz;
 }
 
 /**
- * drop dentry of a directory's inode
+ * replace the entries of an empty directory with ents, which are sorted on the way
  */
-void inode_t::drop_dentry_d(rfs_dentry_d *d) {
-    size_t dir_cnt = this->used_dat_sz / sizeof(rfs_dentry_d);
-    size_t post_cnt = (dir_cnt - 1 - (d - (rfs_dentry_d*) this->_data));
+void inode_t::build_dir(std::vector<rfs_dirent>& ents) {
+    if(ents.empty()) {
+        return;
+    }
+    std::vector<std::pair<uint32_t, rfs_dirent*>> order;
+    size_t dents_sz = 0;
+    for(auto& e : ents) {
+        order.emplace_back(dentry_hash(e.name), &e);
+        dents_sz += dentry_sz(e.name.size());
+    }
+    std::sort(order.begin(), order.end(), [](const std::pair<uint32_t, rfs_dirent*>& a, const std::pair<uint32_t, rfs_dirent*>& b) {
+        return a.first < b.first || (a.first == b.first && a.second->name < b.second->name);
+    });
 
-    d++;
-    for(size_t i = 0;i < post_cnt;i++, d++) {
-        memcpy(d - 1, d, sizeof(rfs_dentry_d));
+    reserve(sizeof(rfs_dir_d) + dents_sz + ents.size() * sizeof(rfs_dslot_d));
+    auto* d = (rfs_dir_d*)this->_data;
+    d->magic = DIR_MAGIC;
+    d->cnt = ents.size();
+    d->dents_sz = dents_sz;
+    char* cursor = dents(d);
+    rfs_dslot_d* slots = dslots(d);
+    for(size_t i = 0;i < order.size();i++) {
+        rfs_dirent* e = order[i].second;
+        auto* ent = (rfs_dentry_d*)cursor;
+        ent->ino = e->ino;
+        ent->ftype = e->ftype;
+        ent->name_len = e->name.size();
+        memcpy(ent->name, e->name.data(), e->name.size());
+        ent->name[e->name.size()] = '\0';
+        slots[i] = {order[i].first, (uint32_t)(cursor - dents(d))};
+        cursor += dentry_sz(e->name.size());
     }
+    this->used_dat_sz = sizeof(rfs_dir_d) + dents_sz + ents.size() * sizeof(rfs_dslot_d);
+}
 
-    this->used_dat_sz -= sizeof(rfs_dentry_d);
+size_t inode_t::dentry_cnt() {
+    rfs_dir_d* d = dir_d();
+    return d ? d->cnt : 0;
 }
 
 /**
- * overwrite the dst dentry of inode with src
+ * @return the i-th entry in hash order
+ */
+rfs_dentry_d* inode_t::dentry_at(size_t i) {
+    rfs_dir_d* d = dir_d();
+    return (rfs_dentry_d*)(dents(d) + dslots(d)[i].off);
+}
+
+/**
+ * find a directory entry by file name, the entry stays valid until the directory changes
+ * @return nullptr if not found
+ */
+rfs_dentry_d* inode_t::find_dentry_d(string_view name) {
+    rfs_dir_d* d = dir_d();
+    if(d == nullptr) {
+        return nullptr;
+    }
+    uint32_t hash = dentry_hash(name);
+    size_t i = find_dslot(d, hash, name);
+    rfs_dslot_d* slots = dslots(d);
+    if(i == d->cnt || slots[i].hash != hash) {
+        return nullptr;
+    }
+    auto* ent = (rfs_dentry_d*)(dents(d) + slots[i].off);
+    return ent->get_name() == name ? ent : nullptr;
+}
+
+/**
+ * add an entry the directory doesn't hold yet, name is at most MAX_FILE_NAME_LEN bytes.
+ * the entry is appended and the slots after its one move up
+ */
+rfs_dentry_d* inode_t::add_dentry_d(uint64_t ino, file_type ftype, string_view name) {
+    rfs_dir_d* d = dir_d();
+    if(d == nullptr) {
+        reserve(sizeof(rfs_dir_d));
+        d = (rfs_dir_d*)this->_data;
+        *d = {DIR_MAGIC, 0, 0};
+        this->used_dat_sz = sizeof(rfs_dir_d);
+    }
+    uint32_t hash = dentry_hash(name);
+    size_t pos = find_dslot(d, hash, name);
+    size_t ent_sz = dentry_sz(name.size());
+    reserve(this->used_dat_sz + ent_sz + sizeof(rfs_dslot_d));
+    d = (rfs_dir_d*)this->_data;
+
+    // the slots move past the new entry, then open a gap at pos
+    auto* slots = (char*)dslots(d);
+    memmove(slots + ent_sz, slots, d->cnt * sizeof(rfs_dslot_d));
+    auto* ent = (rfs_dentry_d*)slots;
+    auto* new_slots = (rfs_dslot_d*)(slots + ent_sz);
+    memmove(new_slots + pos + 1, new_slots + pos, (d->cnt - pos) * sizeof(rfs_dslot_d));
+    new_slots[pos] = {hash, d->dents_sz};
+
+    ent->ino = ino;
+    ent->ftype = ftype;
+    ent->name_len = name.size();
+    memcpy(ent->name, name.data(), name.size());
+    ent->name[name.size()] = '\0';
+
+    d->cnt++;
+    d->dents_sz += ent_sz;
+    this->used_dat_sz += ent_sz + sizeof(rfs_dslot_d);
+    this->attr_dirty = true;
+    return ent;
+}
+
+/**
+ * add entries the directory doesn't hold yet in one pass, the entries already there are sorted in with them
+ */
+void inode_t::add_dentries_d(std::vector<rfs_dirent>& ents) {
+    rfs_dir_d* d = dir_d();
+    if(d != nullptr) {
+        for(size_t i = 0;i < d->cnt;i++) {
+            rfs_dentry_d* ent = dentry_at(i);
+            ents.push_back({ent->ino, ent->ftype, string(ent->get_name())});
+        }
+    }
+    this->used_dat_sz = 0;
+    build_dir(ents);
+    this->attr_dirty = true;
+}
+
+/**
+ * drop an entry of a directory, the entries after it and the slots move down
+ */
+void inode_t::drop_dentry_d(rfs_dentry_d *ent) {
+    rfs_dir_d* d = dir_d();
+    string_view name = ent->get_name();
+    size_t pos = find_dslot(d, dentry_hash(name), name);
+    uint32_t off = (char*)ent - dents(d);
+    size_t ent_sz = dentry_sz(ent->name_len);
+
+    char* end = (char*)dslots(d) + d->cnt * sizeof(rfs_dslot_d);
+    memmove((char*)ent, (char*)ent + ent_sz, end - ((char*)ent + ent_sz));
+    d->dents_sz -= ent_sz;
+    d->cnt--;
+    rfs_dslot_d* slots = dslots(d);
+    memmove(slots + pos, slots + pos + 1, (d->cnt - pos) * sizeof(rfs_dslot_d));
+    for(size_t i = 0;i < d->cnt;i++) {
+        if(slots[i].off > off) slots[i].off -= ent_sz;
+    }
+
+    this->used_dat_sz -= ent_sz + sizeof(rfs_dslot_d);
+    this->attr_dirty = true;
+}
+
+/**
+ * point the dst entry of inode at the file of src, dst keeps its name
  */
 void inode_t::overwrite_dentry_d(rfs_dentry_d *src, rfs_dentry_d* dst) {
-    memcpy(dst, src, sizeof(rfs_dentry_d));
+    dst->ino = src->ino;
+    dst->ftype = src->ftype;
+    this->attr_dirty = true;
+}
+
+/**
+ * the readdir offset of the i-th entry, it stays the same while other entries come and go:
+ * the hash of the name and the entry's rank among the ones sharing it, plus one as 0 starts the listing
+ */
+uint64_t inode_t::dentry_off(size_t i) {
+    rfs_dslot_d* slots = dslots(dir_d());
+    size_t rank = 0;
+    while(rank < i && rank < 0xffff && slots[i - rank - 1].hash == slots[i].hash) {
+        rank++;
+    }
+    return ((uint64_t)slots[i].hash << 16 | rank) + 1;
+}
+
+/**
+ * @return the index of the first entry after readdir offset off
+ */
+size_t inode_t::seek_dentry_d(uint64_t off) {
+    rfs_dir_d* d = dir_d();
+    if(d == nullptr) {
+        return 0;
+    }
+    uint32_t hash = off >> 16;
+    size_t rank = off & 0xffff;
+    rfs_dslot_d* slots = dslots(d);
+    size_t i = std::lower_bound(slots, slots + d->cnt, hash, [](const rfs_dslot_d& s, uint32_t h) { return s.hash < h; }) - slots;
+    for(;rank > 0 && i < d->cnt && slots[i].hash == hash;rank--) {
+        i++;
+    }
+    return i;
 }
 
+/**
+ * write into the cached blocks of a regular file, blocks partially covered by the write must have been loaded
+ */
 void inode_t::write_data(const char *buf, size_t size, off_t offset) {
-    size_t new_dat_sz = offset + size;
-    size_t dat_sz = this->size - this->attr_sz;
-    if(new_dat_sz <= dat_sz) {
-        memcpy(this->_data, buf, size);
-        if(new_dat_sz > this->used_dat_sz) {
-            this->used_dat_sz = new_dat_sz;
+    uint64_t blk = offset / BLOCK_SZ;
+    size_t blk_off = offset % BLOCK_SZ;
+    size_t end = offset + size;
+
+    while(size > 0) {
+        size_t n = std::min(size, BLOCK_SZ - blk_off);
+        rfs_block& b = this->blocks[blk];
+        if(b.data.size() < blk_off + n) {
+            b.data.resize(blk_off + n); // a gap before blk_off is zero filled
+        }
+        memcpy(&b.data[blk_off], buf, n);
+        this->attr_dirty = true;
+        if(!b.dirty) {
+            // rewriting a dirty block holds no more bytes
+            b.dirty = true;
+            this->dirty_sz += BLOCK_SZ;
         }
-    } else {
-        this->size = new_dat_sz + this->attr_sz;
-        auto tmp_dt = new uint8_t[this->size];
-        memcpy(tmp_dt, this->_data, dat_sz);
-        memcpy(tmp_dt + offset, buf, size);
 
-        delete[] this->_data;
-        this->_data = tmp_dt;
-        this->used_dat_sz = new_dat_sz;
+        buf += n;
+        size -= n;
+        blk++;
+        blk_off = 0;
     }
 
-
+    if(end > this->file_sz) {
+        this->file_sz = end;
+    }
 }
 
-void inode_t::truncate(size_t size) {
-    size_t dat_sz = this->size - this->attr_sz;
-    if(size > dat_sz) {
-        // need to adjust the data
-        this->size = size + this->attr_sz;
-        auto tmp_dt = new uint8_t[this->size];
-        memcpy(tmp_dt, this->_data, this->used_dat_sz);
+/**
+ * growing only moves the end of file, the gap is a hole. when shrinking, the new last block must have been loaded
+ * @return the first block to be dropped from db, UINT64_MAX if none
+ */
+uint64_t inode_t::truncate(size_t size) {
+    uint64_t drop_blk = UINT64_MAX;
+    this->attr_dirty = true;
+    if(size < this->file_sz) {
+        drop_blk = (size + BLOCK_SZ - 1) / BLOCK_SZ;
+        this->blocks.erase(this->blocks.lower_bound(drop_blk), this->blocks.end());
 
-        delete[] this->_data;
-        this->_data = tmp_dt;
-    } else {
-        if(size < this->used_dat_sz) {
+        if(this->inlined && size < this->used_dat_sz) {
             this->used_dat_sz = size;
         }
+        auto last = this->blocks.find(size / BLOCK_SZ);
+        if(size % BLOCK_SZ != 0 && last != this->blocks.end() && last->second.data.size() > size % BLOCK_SZ) {
+            last->second.data.resize(size % BLOCK_SZ);
+            last->second.dirty = true;
+        }
+    }
+    this->file_sz = size;
+    return drop_blk;
+}
+
+/**
+ * zero the range [offset, offset + len) without changing the size. the blocks partially covered must have been loaded
+ * @param from_blk first block entirely inside the hole
+ * @param to_blk block after the last one entirely inside the hole, blocks in [from_blk, to_blk) are to be dropped from db
+ */
+void inode_t::punch_hole(off_t offset, size_t len, uint64_t& from_blk, uint64_t& to_blk) {
+    size_t end = std::min((size_t)(offset + len), (size_t)this->file_sz);
+    from_blk = to_blk = 0;
+    if(end <= (size_t)offset) {
+        return;
+    }
+
+    from_blk = (offset + BLOCK_SZ - 1) / BLOCK_SZ;
+    to_blk = end / BLOCK_SZ;
+    if(end == this->file_sz) {
+        to_blk = (end + BLOCK_SZ - 1) / BLOCK_SZ;
+    }
+    if(to_blk < from_blk) {
+        // the hole lies within one block
+        to_blk = from_blk;
+    }
+    this->blocks.erase(this->blocks.lower_bound(from_blk), this->blocks.lower_bound(to_blk));
+    if(this->inlined && from_blk == 0 && to_blk > 0) {
+        // the inlined bytes are block 0
+        this->used_dat_sz = 0;
+    }
+    this->attr_dirty = true;
+
+    // zero the partially covered blocks at both ends
+    for(uint64_t blk : {(uint64_t)(offset / BLOCK_SZ), (uint64_t)(end / BLOCK_SZ)}) {
+        if(blk >= from_blk && blk < to_blk) continue;
+        auto b = this->blocks.find(blk);
+        if(b == this->blocks.end()) continue;
+        size_t beg = std::max((size_t)offset, blk * BLOCK_SZ) - blk * BLOCK_SZ;
+        size_t stop = std::min(end, (blk + 1) * BLOCK_SZ) - blk * BLOCK_SZ;
+        if(beg < b->second.data.size()) {
+            memset(&b->second.data[beg], 0, std::min(stop, b->second.data.size()) - beg);
+            b->second.dirty = true;
+        }
     }
 }
 
+/**
+ * the bytes of an inlined file, the ones past them up to file_sz read as zeros
+ */
+string_view inode_t::inline_data() const {
+    return string_view((const char*)this->_data, this->used_dat_sz);
+}
+
+/**
+ * keep the bytes of a regular file in the data area, they're written back and read with the attributes
+ */
+void inode_t::set_inline(string_view bytes) {
+    reserve(bytes.size());
+    memcpy(this->_data, bytes.data(), bytes.size());
+    this->used_dat_sz = bytes.size();
+    this->inlined = 1;
+    this->attr_dirty = true;
+}
+
+void inode_t::clear_inline() {
+    this->used_dat_sz = 0;
+    this->inlined = 0;
+    this->attr_dirty = true;
+}
+
 inode_t::~inode_t() {
     delete[] _data;
 }
@@ -0,0 +1,349 @@
+//
+// Created by aln0 on 5/6/23.
+//
+
+#include "rocksdb_fs.h"
+#include "types.h"
+#include <fcntl.h>
+#include <algorithm>
+
+using rocksdb::PinnableSlice;
+
+/**
+ * the file type of an inode found by its ino, without the entry linking it
+ */
+static file_type ftype_of(const inode_t* inode) {
+    return (inode->mode & S_IFMT) == S_IFDIR ? dir : reg;
+}
+
+/**
+ * the attributes of an open file, its cached inode is newer than the one in db
+ * @return false if it isn't open
+ */
+bool rocksdb_fs::open_stat(uint64_t ino, struct stat* stat) {
+    cache_lock.lock_shared();
+    auto c = cache.find(ino);
+    bool open = c != cache.end();
+    if(open) {
+        fill_stat(ftype_of(c->second.i.get()), c->second.i.get(), stat);
+    }
+    cache_lock.unlock_shared();
+    stat->st_ino = ino;
+    return open;
+}
+
+/**
+ * find the entry of a lookup in its parent, the op goes on with the inode it links to
+ */
+void rocksdb_fs::resolve(rfs_async_op& op, inode_t* parent) {
+    if(ftype_of(parent) != dir) {
+        op.err = -ENOTDIR;
+        return;
+    }
+    rfs_dentry_d* d = find_dentry_d(parent, op.name);
+    if(d == nullptr) {
+        op.err = -ENOENT;
+        return;
+    }
+    op.ino = d->ino;
+    op.name.clear();
+    op.inode.reset();
+}
+
+void rocksdb_fs::getattr_async(uint64_t ino, rfs_stat_done done) {
+    struct stat stat = {};
+    if(open_stat(ino, &stat)) {
+        done(0, &stat);
+        return;
+    }
+    rfs_async_op op;
+    op.ino = ino;
+    op.stat_done = std::move(done);
+    op.inode.reset(inode_lru->get(ino));
+    defer(std::move(op));
+}
+
+/**
+ * the attributes of the entry name of parent, with st_ino set to the inode it links to
+ */
+void rocksdb_fs::lookup_async(uint64_t parent, string_view name, rfs_stat_done done) {
+    rfs_async_op op;
+    op.ino = parent;
+    op.name = name;
+    op.stat_done = std::move(done);
+    // an open directory's entries are newer than its inode in db
+    cache_lock.lock_shared();
+    auto c = cache.find(parent);
+    if(c != cache.end()) {
+        resolve(op, c->second.i.get());
+    }
+    cache_lock.unlock_shared();
+    if(op.err == 0 && !op.name.empty()) {
+        op.inode.reset(inode_lru->get(parent));
+        if(op.inode != nullptr) resolve(op, op.inode.get());
+    }
+    if(op.err == 0 && op.name.empty()) {
+        struct stat stat = {};
+        if(open_stat(op.ino, &stat)) {
+            op.stat_done(0, &stat);
+            return;
+        }
+        op.inode.reset(inode_lru->get(op.ino));
+    }
+    defer(std::move(op));
+}
+
+/**
+ * read like read, the blocks of an open file loaded are copied before this returns, the others are fetched
+ * once the op is taken
+ */
+void rocksdb_fs::read_async(size_t size, off_t offset, fuse_file_info* fi, rfs_read_done done) {
+    if(fi->fh & RFS_FIND_FH) {
+        string buf(size, '\0');
+        int ret = find_read(buf.data(), size, offset, fi);
+        done(ret, buf.data());
+        return;
+    }
+    rfs_async_op op;
+    op.ino = fi->fh;
+    op.off = offset;
+    op.size = size;
+    op.read_done = std::move(done);
+    bool stale = false;
+    if((fi->flags & O_DIRECT) == 0) {
+        cache_lock.lock_shared();
+        auto c = cache.find(op.ino);
+        if(c != cache.end()) {
+            plan_read(op, c->second.i.get());
+            stale = c->second.i->atime_stale();
+        }
+        cache_lock.unlock_shared();
+    }
+    if(stale) {
+        // an open file's atime is written back with it
+        cache_lock.lock();
+        auto c = cache.find(op.ino);
+        if(c != cache.end()) c->second.i->touch(RFS_ATIME);
+        cache_lock.unlock();
+    }
+    if(!op.planned) {
+        op.inode.reset(inode_lru->get(op.ino));
+        if(op.inode != nullptr) plan_read(op, op.inode.get());
+    }
+    defer(std::move(op));
+}
+
+/**
+ * clamp a read to the file, copy the bytes of the blocks loaded or inlined into its buffer and list the
+ * blocks still to fetch. holes and bytes past what a block stores stay zeros
+ */
+void rocksdb_fs::plan_read(rfs_async_op& op, inode_t* inode) {
+    op.planned = true;
+    if(ftype_of(inode) == dir) {
+        op.err = -EISDIR;
+        return;
+    }
+    op.size = op.off >= (off_t)inode->file_sz ? 0 : std::min(inode->file_sz - op.off, op.size);
+    op.buf.assign(op.size, '\0');
+    op.blk_ino = inode->blk_ino(op.ino);
+    op.dedup = inode->dedup;
+
+    char key[BLOCK_KEY_LEN];
+    uint64_t blk = op.off / BLOCK_SZ;
+    size_t off = op.off % BLOCK_SZ;
+    for(size_t done = 0, len;done < op.size;done += len, blk++, off = 0) {
+        len = std::min(op.size - done, BLOCK_SZ - off);
+        string_view data;
+        auto it = inode->blocks.find(blk);
+        if(it != inode->blocks.end()) {
+            data = it->second.data;
+        } else if(inode->inlined) {
+            // read with the inode, nothing to fetch
+            if(blk == 0) data = inode->inline_data();
+        } else {
+            block_key(key, op.blk_ino, blk);
+            op.pieces.push_back({key, done, off, len});
+            continue;
+        }
+        if(data.size() > off) {
+            memcpy(&op.buf[done], data.data() + off, std::min(data.size() - off, len));
+        }
+    }
+}
+
+/**
+ * copy what a block stores into the read it was fetched for, past skip bytes of header
+ */
+static void place(rfs_async_op* op, const rfs_async_op::piece& p, const Slice& val, size_t skip) {
+    if(val.size() > skip + p.off) {
+        memcpy(&op->buf[p.at], val.data() + skip + p.off, std::min(val.size() - skip - p.off, p.len));
+    }
+}
+
+/**
+ * fetch the blocks of the reads with a MultiGet per shard, the chunks of deduplicated files in a second one
+ */
+void rocksdb_fs::fetch_pieces(vector<rfs_async_op*>& reads) {
+    map<size_t, vector<std::pair<rfs_async_op*, rfs_async_op::piece*>>> by_shard;
+    for(auto op : reads) {
+        for(auto& p : op->pieces) {
+            by_shard[shard_of(op->blk_ino)].emplace_back(op, &p);
+        }
+    }
+
+    ReadOptions opts;
+    opts.async_io = true;
+    opts.optimize_multiget_for_io = true;
+    for(auto& s : by_shard) {
+        auto& ps = s.second;
+        DB* db = shards[s.first];
+        vector<Slice> keys;
+        for(auto& p : ps) {
+            keys.emplace_back(p.second->key);
+        }
+        vector<PinnableSlice> vals(ps.size());
+        vector<Status> statuses(ps.size());
+        db->MultiGet(opts, db->DefaultColumnFamily(), keys.size(), keys.data(), vals.data(), statuses.data());
+
+        vector<string> refs;
+        vector<size_t> ref_at;
+        for(size_t k = 0;k < ps.size();k++) {
+            // a block missing is a hole
+            if(!statuses[k].ok()) continue;
+            if(ps[k].first->dedup) {
+                refs.push_back(vals[k].ToString());
+                ref_at.push_back(k);
+            } else {
+                place(ps[k].first, *ps[k].second, vals[k], 0);
+            }
+        }
+        if(refs.empty()) continue;
+        vector<PinnableSlice> chunks(refs.size());
+        keys.assign(refs.begin(), refs.end());
+        statuses.assign(refs.size(), Status());
+        db->MultiGet(opts, db->DefaultColumnFamily(), refs.size(), keys.data(), chunks.data(), statuses.data());
+        for(size_t k = 0;k < refs.size();k++) {
+            if(statuses[k].ok() && chunks[k].size() >= sizeof(int64_t)) {
+                auto& p = ps[ref_at[k]];
+                place(p.first, *p.second, chunks[k], sizeof(int64_t));
+            }
+        }
+    }
+}
+
+/**
+ * do the reads of ops together and reply to each: the parents of the lookups, then the inodes of all the ops
+ * still without one, then the blocks of the reads
+ */
+void rocksdb_fs::complete(vector<rfs_async_op>& ops) {
+    vector<uint64_t> inos;
+    vector<unique_ptr<inode_t>> inodes;
+    vector<rfs_async_op*> need;
+    for(int round = 0;round < 2;round++) {
+        inos.clear();
+        need.clear();
+        for(auto& op : ops) {
+            if(op.err == 0 && !op.replied && !op.planned && op.inode == nullptr) {
+                need.push_back(&op);
+                inos.push_back(op.ino);
+            }
+        }
+        if(need.empty()) break;
+        read_inodes(inos, inodes);
+        for(size_t i = 0;i < need.size();i++) {
+            rfs_async_op* op = need[i];
+            op->inode = std::move(inodes[i]);
+            if(op->inode == nullptr) {
+                op->err = -ENOENT;
+            } else if(!op->name.empty()) {
+                resolve(*op, op->inode.get());
+                struct stat stat = {};
+                if(op->err == 0 && open_stat(op->ino, &stat)) {
+                    op->stat_done(0, &stat);
+                    op->replied = true;
+                }
+            }
+        }
+    }
+
+    vector<rfs_async_op*> reads;
+    for(auto& op : ops) {
+        if(op.replied) continue;
+        if(op.err == 0 && !op.name.empty()) {
+            op.err = -ENOENT;
+        }
+        if(op.stat_done) {
+            struct stat stat = {};
+            if(op.err == 0) {
+                fill_stat(ftype_of(op.inode.get()), op.inode.get(), &stat);
+                stat.st_ino = op.ino;
+            }
+            op.stat_done(op.err, op.err == 0 ? &stat : nullptr);
+            continue;
+        }
+        if(op.err == 0 && !op.planned) {
+            plan_read(op, op.inode.get());
+        }
+        if(op.err != 0) {
+            op.read_done(op.err, nullptr);
+        } else {
+            reads.push_back(&op);
+        }
+    }
+    fetch_pieces(reads);
+    for(auto op : reads) {
+        op->read_done((int)op->size, op->buf.data());
+    }
+
+    // the atime of a file read while it wasn't open, once replied
+    for(auto op : reads) {
+        if(op->inode == nullptr || !op->inode->atime_stale()) continue;
+        cache_lock.lock();
+        auto c = cache.find(op->ino);
+        if(c != cache.end()) {
+            c->second.i->touch(RFS_ATIME);
+        } else {
+            op->inode->touch(RFS_ATIME);
+            write_inode(op->ino, op->inode.get());
+        }
+        cache_lock.unlock();
+    }
+}
+
+/**
+ * queue an op for the async threads, an op needing no read or one deferred without them is completed here
+ */
+void rocksdb_fs::defer(rfs_async_op&& op) {
+    bool ready = op.err != 0 || (op.name.empty() && (op.planned ? op.pieces.empty() : op.inode != nullptr));
+    if(ready || async_threads.empty()) {
+        vector<rfs_async_op> one;
+        one.push_back(std::move(op));
+        complete(one);
+        return;
+    }
+    {
+        unique_lock<mutex> l(async_lock);
+        async_ops.push_back(std::move(op));
+    }
+    async_cv.notify_one();
+}
+
+/**
+ * take all the ops queued at once, the ones deferred meanwhile go to the next thread free. the queue is drained
+ * before a thread stops
+ */
+void rocksdb_fs::async_loop() {
+    vector<rfs_async_op> ops;
+    unique_lock<mutex> l(async_lock);
+    while(true) {
+        async_cv.wait(l, [this] { return async_stop || !async_ops.empty(); });
+        if(async_ops.empty()) {
+            return;
+        }
+        ops.swap(async_ops);
+        l.unlock();
+        complete(ops);
+        ops.clear();
+        l.lock();
+    }
+}
@@ -0,0 +1,308 @@
+//
+// Created by aln0 on 4/29/23.
+//
+
+#include "rocksdb_fs.h"
+#include "types.h"
+#include <unistd.h>
+
+struct rfs_batch_rec {
+    rfs_batch_rec_d d;
+    string_view name;
+    string_view new_name;
+};
+
+/**
+ * whether uid and gid may access inode for mask, a mask of R_OK, W_OK and X_OK. the kernel checks nothing
+ * for an ioctl, it only takes a handle of the directory. root may do anything
+ */
+static bool may_access(const inode_t* inode, uid_t uid, gid_t gid, int mask) {
+    if(uid == 0) {
+        return true;
+    }
+    // inodes written before modes were kept are open to all, as fill_stat shows them
+    uint32_t mode = inode->mode == 0 ? 0777 : inode->mode;
+    uint32_t bits = uid == inode->uid ? mode >> 6 : gid == inode->gid ? mode >> 3 : mode;
+    return (bits & mask) == (uint32_t)mask;
+}
+
+static bool is_owner(const inode_t* inode, uid_t uid) {
+    return uid == 0 || uid == (inode->mode == 0 ? getuid() : inode->uid);
+}
+
+/**
+ * a name a record may create or rename to
+ */
+static bool valid_name(string_view name) {
+    return !name.empty() && name != "." && name != ".." && name.find('/') == string_view::npos;
+}
+
+/**
+ * apply the records of b to the entries of the directory open as fi, in one commit with one write of the
+ * directory. a record that fails leaves the others be, the result of each replaces the records in b.
+ * the inodes unlinked are dropped once it's committed, like unlink does
+ * @param uid owner of the files created, like gid
+ * @return -EIO if nothing could be committed, the changes in memory stay like rename's
+ */
+int rocksdb_fs::batch(const char *path, fuse_file_info *fi, rfs_batch_d *b, uid_t uid, gid_t gid) {
+    if(fi->fh == RFS_FIND_FH) {
+        return -EPERM;
+    }
+    if(b->recs_sz > RFS_BATCH_SZ) {
+        return -EINVAL;
+    }
+    // the results go over the records
+    string in(b->recs, b->recs_sz);
+    vector<rfs_batch_rec> recs;
+    size_t off = 0;
+    for(uint32_t i = 0;i < b->cnt;i++) {
+        rfs_batch_rec r;
+        if(off + sizeof(r.d) > in.size()) return -EINVAL;
+        memcpy(&r.d, in.data() + off, sizeof(r.d));
+        off += sizeof(r.d);
+        if(off + r.d.name_len + r.d.new_name_len > in.size()) return -EINVAL;
+        r.name = string_view(in.data() + off, r.d.name_len);
+        r.new_name = string_view(in.data() + off + r.d.name_len, r.d.new_name_len);
+        off += r.d.name_len + r.d.new_name_len;
+        recs.push_back(r);
+    }
+
+    // the directory as opened, it's looked up again with O_DIRECT
+    shared_ptr<inode_t> parent;
+    uint64_t parent_ino = fi->fh;
+    cache_lock.lock();
+    auto pc = cache.find(fi->fh);
+    if(pc != cache.end()) {
+        parent = pc->second.i;
+    } else {
+        cache_lock.unlock();
+        bool found;
+        auto dentry = lookup(path, found);
+        if(!found) {
+            return -ENOENT;
+        }
+        if(dentry->ftype != dir) {
+            return -ENOTDIR;
+        }
+        parent = dentry->inode;
+        parent_ino = dentry->ino;
+        cache_lock.lock();
+    }
+
+    rfs_txn txn;
+    // inodes created or changed, the open ones are written back with their data
+    map<uint64_t, unique_ptr<inode_t>> staged;
+    vector<uint64_t> dropped;
+    rfs_usage_d left = {0, 0};
+    char okey[ORPHAN_KEY_LEN];
+
+    auto inode_of = [&](uint64_t ino) -> inode_t* {
+        auto c = cache.find(ino);
+        if(c != cache.end()) return c->second.i.get();
+        auto s = staged.find(ino);
+        if(s != staged.end()) return s->second.get();
+        inode_t* inode = read_inode(ino);
+        if(inode != nullptr) staged[ino] = unique_ptr<inode_t>(inode);
+        return inode;
+    };
+    // a directory unlinked or replaced has to be empty, rm -r goes bottom up
+    auto dir_empty = [&](uint64_t ino) {
+        auto c = cache.find(ino);
+        if(c != cache.end()) return c->second.i->dentry_cnt() == 0;
+        auto s = staged.find(ino);
+        if(s != staged.end()) return s->second->dentry_cnt() == 0;
+        auto inode = unique_ptr<inode_t>(read_inode(ino));
+        return inode == nullptr || inode->dentry_cnt() == 0;
+    };
+    // the entry is marked orphan in the commit and dropped after it
+    auto unlink_entry = [&](uint64_t ino, file_type ftype) {
+        auto s = staged.find(ino);
+        if(s != staged.end() && !s->second->written) {
+            // created by the batch, it's counted in as it's written
+            left.bytes += s->second->file_sz;
+            left.inodes++;
+        } else {
+            rfs_usage_d usage = relink_usage(ino, ftype, {});
+            left.bytes += usage.bytes;
+            left.inodes += usage.inodes;
+        }
+        stage_unindex(txn, ino);
+        orphan_key(okey, ino);
+        txn.batch(shard_of(ino)).Put(okey, Slice());
+        dropped.push_back(ino);
+    };
+
+    // in a sticky directory only the owners of an entry or of the directory may unlink or replace it
+    auto may_drop = [&](uint64_t ino) {
+        if(!(parent->mode & S_ISVTX) || is_owner(parent.get(), uid)) return true;
+        auto c = cache.find(ino);
+        if(c != cache.end()) return is_owner(c->second.i.get(), uid);
+        auto s = staged.find(ino);
+        if(s != staged.end()) return is_owner(s->second.get(), uid);
+        auto inode = unique_ptr<inode_t>(read_inode(ino));
+        return inode == nullptr || is_owner(inode.get(), uid);
+    };
+    bool may_write = may_access(parent.get(), uid, gid, W_OK | X_OK);
+    bool may_search = may_access(parent.get(), uid, gid, X_OK);
+
+    vector<int32_t> res(recs.size(), 0);
+    size_t applied = 0;
+    bool changed = false; // the entries, not only the attributes of some
+    for(size_t i = 0;i < recs.size();i++) {
+        rfs_batch_rec& r = recs[i];
+        if(!valid_name(r.name)) {
+            res[i] = -EINVAL;
+            continue;
+        }
+        if(!(r.d.op == batch_setattr ? may_search : may_write)) {
+            res[i] = -EACCES;
+            continue;
+        }
+        rfs_dentry_d* d = parent->find_dentry_d(r.name);
+        if(r.d.op != batch_create && d == nullptr) {
+            res[i] = -ENOENT;
+            continue;
+        }
+
+        switch(r.d.op) {
+            case batch_create: {
+                if(d != nullptr) {
+                    res[i] = -EEXIST;
+                    break;
+                }
+                file_type ftype = S_ISDIR(r.d.mode) ? dir : reg;
+                uint64_t ino = alloc_ino();
+                auto inode = make_unique<inode_t>();
+                inode->dedup = conf.dedup && ftype == reg;
+                inode->mode = (ftype == reg ? S_IFREG : S_IFDIR) | (r.d.mode & 07777);
+                inode->uid = uid;
+                inode->gid = gid;
+                inode->touch(RFS_ATIME | RFS_MTIME | RFS_CTIME);
+                inode->lineage = parent->lineage;
+                inode->lineage.push_back(ino);
+                // written with the directory, no orphan marker needed
+                parent->add_dentry_d(ino, ftype, r.name);
+                if(!indexes.empty()) stage_entry(txn, ino, parent_ino, r.name);
+                stage_change(txn, change_create, ino, ftype, parent_ino, r.name);
+                staged[ino] = std::move(inode);
+                break;
+            }
+            case batch_unlink: {
+                uint64_t ino = d->ino;
+                file_type ftype = d->ftype;
+                if(!may_drop(ino)) {
+                    res[i] = -EPERM;
+                    break;
+                }
+                if(ftype == dir && !dir_empty(ino)) {
+                    res[i] = -ENOTEMPTY;
+                    break;
+                }
+                unlink_entry(ino, ftype);
+                parent->drop_dentry_d(d);
+                stage_change(txn, change_unlink, ino, ftype, parent_ino, r.name);
+                break;
+            }
+            case batch_rename: {
+                if(!valid_name(r.new_name)) {
+                    res[i] = -EINVAL;
+                    break;
+                }
+                if(r.new_name == r.name) break;
+                uint64_t ino = d->ino;
+                file_type ftype = d->ftype;
+                rfs_dentry_d* dst = parent->find_dentry_d(r.new_name);
+                if(!may_drop(ino) || (dst != nullptr && !may_drop(dst->ino))) {
+                    res[i] = -EPERM;
+                    break;
+                }
+                if(dst == nullptr) {
+                    parent->add_dentry_d(ino, ftype, r.new_name);
+                } else {
+                    if(dst->ftype != ftype) {
+                        res[i] = dst->ftype == dir ? -EISDIR : -ENOTDIR;
+                        break;
+                    }
+                    if(ftype == dir && !dir_empty(dst->ino)) {
+                        res[i] = -ENOTEMPTY;
+                        break;
+                    }
+                    unlink_entry(dst->ino, dst->ftype);
+                    parent->overwrite_dentry_d(d, dst);
+                }
+                // adding moved the entries around
+                parent->drop_dentry_d(parent->find_dentry_d(r.name));
+                if(!indexes.empty()) stage_entry(txn, ino, parent_ino, r.new_name, r.name);
+                stage_change(txn, change_rename, ino, ftype, parent_ino, r.name, parent_ino, r.new_name);
+                break;
+            }
+            case batch_setattr: {
+                inode_t* inode = inode_of(d->ino);
+                if(inode == nullptr) {
+                    res[i] = -EIO;
+                    break;
+                }
+                if(inode->mode == 0) {
+                    inode->mode = (d->ftype == dir ? S_IFDIR : S_IFREG) | 0777;
+                    inode->uid = getuid();
+                    inode->gid = getgid();
+                }
+                // like chown(2) and chmod(2): the owner may change the mode, the times and the group to one of
+                // its own, only root the owner
+                if(!is_owner(inode, uid) || ((r.d.to_set & RFS_BATCH_UID) && r.d.uid != inode->uid && uid != 0)
+                        || ((r.d.to_set & RFS_BATCH_GID) && r.d.gid != inode->gid && r.d.gid != gid && uid != 0)) {
+                    res[i] = -EPERM;
+                    break;
+                }
+                if(r.d.to_set & RFS_BATCH_MODE) {
+                    uint32_t mode = r.d.mode & 07777;
+                    if(uid != 0 && inode->gid != gid) mode &= ~S_ISGID;
+                    inode->mode = (inode->mode & S_IFMT) | mode;
+                }
+                if(r.d.to_set & (RFS_BATCH_UID | RFS_BATCH_GID)) {
+                    if(r.d.to_set & RFS_BATCH_UID) inode->uid = r.d.uid;
+                    if(r.d.to_set & RFS_BATCH_GID) inode->gid = r.d.gid;
+                    // a file changing hands doesn't keep running as its old owner
+                    if(uid != 0) inode->mode &= ~(S_ISUID | S_ISGID);
+                }
+                inode->touch(RFS_CTIME);
+                if(r.d.to_set & RFS_BATCH_ATIME) inode->atime = r.d.atime;
+                if(r.d.to_set & RFS_BATCH_MTIME) inode->mtime = r.d.mtime;
+                break;
+            }
+            default:
+                res[i] = -EINVAL;
+        }
+        if(res[i] == 0) {
+            applied++;
+            changed |= r.d.op != batch_setattr;
+        }
+    }
+
+    int ret = 0;
+    if(applied > 0) {
+        if(changed) parent->touch(RFS_MTIME | RFS_CTIME);
+        for(auto& s : staged) {
+            stage_inode(txn, s.first, s.second.get());
+        }
+        stage_usage(txn, parent->lineage.begin(), parent->lineage.end(), -left.bytes, -left.inodes);
+        stage_inode(txn, parent_ino, parent.get());
+        if(commit(txn) == 0) {
+            for(auto& s : staged) {
+                written_back(s.first, s.second.get());
+            }
+            written_back(parent_ino, parent.get());
+        } else {
+            ret = -EIO;
+        }
+    }
+    cache_lock.unlock();
+
+    if(ret == 0) {
+        for(uint64_t ino : dropped) {
+            drop_inode(ino);
+        }
+    }
+    memcpy(b->recs, res.data(), res.size() * sizeof(int32_t));
+    return ret;
+}
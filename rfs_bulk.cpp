@@ -0,0 +1,449 @@
+//
+// Created by aln0 on 4/29/23.
+//
+// rfs_bulk: unpacks a tar into, or removes trees from, a mounted fs through RFS_IOC_BATCH. The entries of a
+// directory are created or unlinked a batch at a time, one request and one write of the directory for each
+// rather than a lookup, a create and a write of the directory per file. File data still goes through write.
+//
+
+#include "types.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <cerrno>
+#include <filesystem>
+#include <vector>
+
+using std::vector;
+
+// bytes of file data an unpacked directory holds before its files are created and written
+#define PENDING_DATA_THRESHOLD (64 << 20)
+#define TAR_BLOCK 512
+
+/**
+ * the records of a batch on one directory, sent as it fills up
+ */
+class rfs_batcher {
+    int fd;
+    rfs_batch_d b;
+    vector<string> names; // of the records, for the errors
+
+public:
+    explicit rfs_batcher(int dirfd) : fd(dirfd) {
+        b.cnt = 0;
+        b.recs_sz = 0;
+    }
+
+    bool fits(string_view name, string_view new_name = "") const {
+        return b.recs_sz + sizeof(rfs_batch_rec_d) + name.size() + new_name.size() <= RFS_BATCH_SZ;
+    }
+
+    void add(const rfs_batch_rec_d& rec, string_view name, string_view new_name = "") {
+        rfs_batch_rec_d d = rec;
+        d.name_len = name.size();
+        d.new_name_len = new_name.size();
+        memcpy(b.recs + b.recs_sz, &d, sizeof(d));
+        b.recs_sz += sizeof(d);
+        memcpy(b.recs + b.recs_sz, name.data(), name.size());
+        memcpy(b.recs + b.recs_sz + name.size(), new_name.data(), new_name.size());
+        b.recs_sz += name.size() + new_name.size();
+        b.cnt++;
+        names.emplace_back(name);
+    }
+
+    /**
+     * @param res set to the result of each record sent, 0 or -errno
+     * @return -1 if the ioctl failed, errno tells why
+     */
+    int flush(vector<int32_t>& res) {
+        res.clear();
+        if(b.cnt == 0) {
+            return 0;
+        }
+        int ret = ioctl(fd, RFS_IOC_BATCH, &b);
+        if(ret == 0) {
+            res.assign((int32_t*)b.recs, (int32_t*)b.recs + b.cnt);
+        }
+        b.cnt = 0;
+        b.recs_sz = 0;
+        return ret;
+    }
+
+    const string& name(size_t i) const { return names[i]; }
+    void clear_names() { names.clear(); }
+};
+
+struct tar_entry {
+    string name;
+    bool is_dir;
+    uint32_t mode;
+    timespec mtime;
+    string data;
+};
+
+static int errors = 0;
+
+static void report(const string& dir, const string& name, int err) {
+    fprintf(stderr, "rfs_bulk: %s/%s: %s\n", dir.c_str(), name.c_str(), strerror(err));
+    errors++;
+}
+
+/**
+ * a directory unpacked, its mtime is set once everything in it is
+ */
+struct dir_mtime {
+    string path;
+    timespec mtime;
+};
+
+/**
+ * create the entries of a directory, write the files and set their mtimes, a batch of creates and one of
+ * mtimes for as many as fit. a file already there is overwritten, a directory kept. the mtimes of the
+ * directories go to dirs, what's unpacked into them later would touch them again
+ */
+static int flush_dir(int dirfd, const string& dir, vector<tar_entry>& pending, vector<dir_mtime>& dirs) {
+    rfs_batcher batcher(dirfd);
+    vector<int32_t> res;
+    size_t beg = 0;
+    while(beg < pending.size()) {
+        size_t end = beg;
+        for(;end < pending.size() && batcher.fits(pending[end].name);end++) {
+            rfs_batch_rec_d rec = {};
+            rec.op = batch_create;
+            rec.mode = (pending[end].is_dir ? S_IFDIR : S_IFREG) | (pending[end].mode & 07777);
+            batcher.add(rec, pending[end].name);
+        }
+        if(batcher.flush(res) != 0) {
+            report(dir, ".", errno);
+            pending.clear();
+            return -1;
+        }
+        batcher.clear_names();
+
+        for(size_t i = beg;i < end;i++) {
+            tar_entry& e = pending[i];
+            int err = res[i - beg];
+            if(err == -EEXIST) {
+                err = 0;
+            }
+            if(err == 0 && !e.is_dir) {
+                int fd = openat(dirfd, e.name.c_str(), O_WRONLY | O_TRUNC);
+                size_t done = 0;
+                while(fd >= 0 && done < e.data.size()) {
+                    ssize_t n = ::write(fd, e.data.data() + done, e.data.size() - done);
+                    if(n <= 0) break;
+                    done += n;
+                }
+                if(fd < 0 || done < e.data.size()) err = -errno;
+                if(fd >= 0) ::close(fd);
+            }
+            if(err != 0) {
+                report(dir, e.name, -err);
+                e.name.clear();
+            }
+            // the data isn't needed any more
+            string().swap(e.data);
+        }
+
+        // written after the data, which would touch them again
+        for(size_t i = beg;i < end;i++) {
+            if(pending[i].name.empty()) continue;
+            if(pending[i].is_dir) {
+                dirs.push_back({dir.empty() ? pending[i].name : dir + "/" + pending[i].name, pending[i].mtime});
+                continue;
+            }
+            rfs_batch_rec_d rec = {};
+            rec.op = batch_setattr;
+            rec.to_set = RFS_BATCH_MTIME;
+            rec.mtime = pending[i].mtime;
+            batcher.add(rec, pending[i].name);
+        }
+        if(batcher.flush(res) != 0) {
+            report(dir, ".", errno);
+            pending.clear();
+            return -1;
+        }
+        for(size_t i = 0;i < res.size();i++) {
+            if(res[i] != 0) report(dir, batcher.name(i), -res[i]);
+        }
+        batcher.clear_names();
+        beg = end;
+    }
+    pending.clear();
+    return 0;
+}
+
+/**
+ * a numeric field of a tar header, octal or base-256 when its high bit is set
+ */
+static uint64_t tar_num(const char* field, size_t len) {
+    uint64_t v = 0;
+    if((uint8_t)field[0] & 0x80) {
+        v = (uint8_t)field[0] & 0x7f;
+        for(size_t i = 1;i < len;i++) v = v << 8 | (uint8_t)field[i];
+        return v;
+    }
+    for(size_t i = 0;i < len && field[i] != '\0';i++) {
+        if(field[i] >= '0' && field[i] <= '7') v = v << 3 | (field[i] - '0');
+    }
+    return v;
+}
+
+static bool read_full(FILE* in, char* buf, size_t n) {
+    return fread(buf, 1, n, in) == n;
+}
+
+static bool read_data(FILE* in, uint64_t size, string& data) {
+    data.resize(size);
+    if(!read_full(in, data.data(), size)) return false;
+    char pad[TAR_BLOCK];
+    size_t rest = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+    return read_full(in, pad, rest);
+}
+
+/**
+ * a path of the archive relative to the target, without "./", leading or trailing slashes
+ * @return false if it would leave the target
+ */
+static bool clean_path(string& path) {
+    string out;
+    size_t beg = 0;
+    while(beg < path.size()) {
+        size_t end = std::min(path.find('/', beg), path.size());
+        string_view part = string_view(path).substr(beg, end - beg);
+        beg = end + 1;
+        if(part.empty() || part == ".") continue;
+        if(part == "..") return false;
+        if(!out.empty()) out.push_back('/');
+        out.append(part);
+    }
+    path = std::move(out);
+    return true;
+}
+
+/**
+ * unpack a ustar, gnu or pax archive from in under target. entries of other types than files and
+ * directories, symlinks and hard links among them, are skipped and count as failures
+ */
+static int untar(FILE* in, const char* target) {
+    char hdr[TAR_BLOCK];
+    string long_name, dir;
+    int dirfd = -1;
+    vector<tar_entry> pending;
+    vector<dir_mtime> dirs;
+    size_t pending_sz = 0;
+
+    while(read_full(in, hdr, TAR_BLOCK)) {
+        if(hdr[0] == '\0') break;
+        uint64_t size = tar_num(hdr + 124, 12);
+        char type = hdr[156];
+        string data;
+        if(!read_data(in, size, data)) {
+            fprintf(stderr, "rfs_bulk: truncated archive\n");
+            return -1;
+        }
+        if(type == 'L') {
+            long_name.assign(data.c_str());
+            continue;
+        }
+        if(type == 'x') {
+            // "<len> <key>=<value>\n" records, only the path is kept
+            for(size_t off = 0;off < data.size();) {
+                size_t len = strtoul(data.c_str() + off, nullptr, 10);
+                if(len == 0 || off + len > data.size()) break;
+                string_view rec = string_view(data).substr(off, len - 1);
+                size_t key = rec.find(' ');
+                if(key != string_view::npos && rec.substr(key + 1, 5) == "path=") {
+                    long_name.assign(rec.substr(key + 6));
+                }
+                off += len;
+            }
+            continue;
+        }
+
+        string path;
+        if(!long_name.empty()) {
+            path = std::move(long_name);
+            long_name.clear();
+        } else {
+            if(memcmp(hdr + 257, "ustar", 5) == 0 && hdr[345] != '\0') {
+                path.assign(hdr + 345, strnlen(hdr + 345, 155)).push_back('/');
+            }
+            path.append(hdr, strnlen(hdr, 100));
+        }
+        if(type != '0' && type != '\0' && type != '5') {
+            if(type != 'g') {
+                fprintf(stderr, "rfs_bulk: %s: type %c skipped\n", path.c_str(), type);
+                errors++;
+            }
+            continue;
+        }
+        if(!clean_path(path) || path.empty()) {
+            if(!path.empty()) fprintf(stderr, "rfs_bulk: %s: outside of the target, skipped\n", path.c_str());
+            continue;
+        }
+
+        size_t div = path.rfind('/');
+        string parent = div == string::npos ? "" : path.substr(0, div);
+        if(dirfd < 0 || parent != dir || pending_sz > PENDING_DATA_THRESHOLD) {
+            if(dirfd >= 0) {
+                flush_dir(dirfd, dir, pending, dirs);
+                ::close(dirfd);
+            }
+            pending_sz = 0;
+            dir = parent;
+            string full = string(target) + "/" + dir;
+            dirfd = open(full.c_str(), O_RDONLY | O_DIRECTORY);
+            if(dirfd < 0 && errno == ENOENT) {
+                // the archive didn't list it before its entries
+                std::error_code ec;
+                std::filesystem::create_directories(full, ec);
+                dirfd = open(full.c_str(), O_RDONLY | O_DIRECTORY);
+            }
+            if(dirfd < 0) {
+                fprintf(stderr, "rfs_bulk: %s: %s\n", full.c_str(), strerror(errno));
+                return -1;
+            }
+        }
+
+        tar_entry e;
+        e.name = div == string::npos ? path : path.substr(div + 1);
+        e.is_dir = type == '5';
+        e.mode = tar_num(hdr + 100, 8);
+        e.mtime = {(time_t)tar_num(hdr + 136, 12), 0};
+        e.data = std::move(data);
+        pending_sz += e.data.size();
+        pending.push_back(std::move(e));
+    }
+    if(dirfd >= 0) {
+        flush_dir(dirfd, dir, pending, dirs);
+        ::close(dirfd);
+    }
+
+    // setting an mtime changes only the ctime of the directory, never its parent's mtime
+    for(auto& d : dirs) {
+        string full = string(target) + "/" + d.path;
+        timespec times[2] = {{0, UTIME_OMIT}, d.mtime};
+        if(utimensat(AT_FDCWD, full.c_str(), times, 0) != 0) {
+            fprintf(stderr, "rfs_bulk: %s: %s\n", full.c_str(), strerror(errno));
+            errors++;
+        }
+    }
+    return 0;
+}
+
+/**
+ * remove everything in the directory open as dirfd, the directories below first
+ */
+static int rm_dir(int dirfd, const string& path) {
+    DIR* d = fdopendir(dup(dirfd));
+    if(d == nullptr) {
+        report(path, ".", errno);
+        return -1;
+    }
+    // the entries are listed before any goes, removing them would move the offsets around
+    vector<string> names;
+    for(dirent* de = readdir(d);de != nullptr;de = readdir(d)) {
+        if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        bool is_dir = de->d_type == DT_DIR;
+        if(de->d_type == DT_UNKNOWN) {
+            struct stat st;
+            is_dir = fstatat(dirfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+        }
+        if(is_dir) {
+            int sub = openat(dirfd, de->d_name, O_RDONLY | O_DIRECTORY);
+            if(sub < 0) {
+                report(path, de->d_name, errno);
+                continue;
+            }
+            rm_dir(sub, path + "/" + de->d_name);
+            ::close(sub);
+        }
+        names.emplace_back(de->d_name);
+    }
+    closedir(d);
+
+    rfs_batcher batcher(dirfd);
+    vector<int32_t> res;
+    auto flush = [&]() {
+        if(batcher.flush(res) != 0) {
+            report(path, ".", errno);
+            return -1;
+        }
+        for(size_t i = 0;i < res.size();i++) {
+            if(res[i] != 0) report(path, batcher.name(i), -res[i]);
+        }
+        batcher.clear_names();
+        return 0;
+    };
+    rfs_batch_rec_d rec = {};
+    rec.op = batch_unlink;
+    for(auto& name : names) {
+        if(!batcher.fits(name) && flush() != 0) return -1;
+        batcher.add(rec, name);
+    }
+    return flush();
+}
+
+static int rm(const char* path) {
+    struct stat st;
+    if(lstat(path, &st) != 0) {
+        fprintf(stderr, "rfs_bulk: %s: %s\n", path, strerror(errno));
+        errors++;
+        return -1;
+    }
+    if(!S_ISDIR(st.st_mode)) {
+        if(unlink(path) != 0) {
+            fprintf(stderr, "rfs_bulk: %s: %s\n", path, strerror(errno));
+            errors++;
+            return -1;
+        }
+        return 0;
+    }
+    int fd = open(path, O_RDONLY | O_DIRECTORY);
+    if(fd < 0) {
+        fprintf(stderr, "rfs_bulk: %s: %s\n", path, strerror(errno));
+        errors++;
+        return -1;
+    }
+    int ret = rm_dir(fd, path);
+    ::close(fd);
+    if(ret == 0 && rmdir(path) != 0) {
+        fprintf(stderr, "rfs_bulk: %s: %s\n", path, strerror(errno));
+        errors++;
+        return -1;
+    }
+    return ret;
+}
+
+static void show_help(const char* prog) {
+    printf("usage: %s untar <dir> < archive.tar\n"
+           "       %s rm <path>...\n"
+           "    untar               Unpack a tar from stdin into dir of a mounted fs, files and directories with\n"
+           "                        their modes and mtimes, owned by the caller. symlinks, hard links and other\n"
+           "                        types are skipped, each is a failure\n"
+           "    rm                  Remove files and whole trees, like rm -rf\n"
+           "entries the kernel looked up before may still show for the mount's entry_timeout after they're gone.\n"
+           "exits with 1 if anything failed, each failure is printed\n", prog, prog);
+}
+
+int main(int argc, char* argv[]) {
+    if(argc < 3 || (strcmp(argv[1], "untar") == 0 && argc != 3)) {
+        show_help(argv[0]);
+        return 1;
+    }
+    if(strcmp(argv[1], "untar") == 0) {
+        if(untar(stdin, argv[2]) != 0) return 1;
+    } else if(strcmp(argv[1], "rm") == 0) {
+        for(int i = 2;i < argc;i++) {
+            rm(argv[i]);
+        }
+    } else {
+        show_help(argv[0]);
+        return 1;
+    }
+    return errors > 0 ? 1 : 0;
+}
@@ -0,0 +1,421 @@
+//
+// Created by aln0 on 4/26/23.
+//
+// rfs_changes: change feed of the fs for incremental backups and replicas. Reads the WAL of every shard from a
+// sequence on with GetUpdatesSince and decodes each batch back into the ops of the fs, at a cost of what changed
+// since rather than of the volume. The shards are opened as secondary instances, a mount keeps running.
+// The WAL is only kept long enough with the mount's --change_log.
+//
+
+#include "rocksdb/db.h"
+#include "rocksdb/transaction_log.h"
+#include "rfs_layout.h"
+#include "rfs_merge.h"
+#include "types.h"
+
+#include <getopt.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <set>
+#include <vector>
+
+using rocksdb::DB;
+using rocksdb::Status;
+using rocksdb::Slice;
+using rocksdb::ReadOptions;
+using rocksdb::WriteBatch;
+using std::vector;
+
+struct changes_options {
+    vector<string> dbpaths;
+    vector<uint64_t> since; // of each shard, the first sequence not read yet
+    bool latest = false;
+    bool paths = false;
+};
+
+static void show_help(const char* prog) {
+    printf("usage: %s [options]\n"
+           "    --dbpath=<s>        Path of rocksdb's persistent file (default: \"./db\"), once per shard in mount order\n"
+           "    --since=<n>[,<n>]   Print the changes from these sequences of the shards on, the \"next\" line of\n"
+           "                        the last run. exits with 2 if the WAL doesn't go back that far any more\n"
+           "    --latest            Only print the \"next\" line, before a full backup the changes start from\n"
+           "    --paths             End the events of an inode with its path now, the fs has to be mounted with --index\n"
+           "events are a line each, \"<shard> <seq> <op> <ino> ...\", names escaped as \\xNN:\n"
+           "    create|unlink <ino> f|d <parent> <name>\n"
+           "    rename <ino> f|d <parent> <name> <new parent> <new name>\n"
+           "    attr <ino>          its inode was written, attributes, size or the entries of a directory\n"
+           "    write <ino> <off> <len>  data written or punched, the ino is the file's even for blocks a clone\n"
+           "                        stores under the ino of the file it was cloned from. a file inlined in its\n"
+           "                        inode is written whole with its attr event, its data can't be told apart\n"
+           "    trunc <ino> <off>   data from off on dropped\n"
+           "    drop <ino>          the inode is gone\n", prog);
+}
+
+static int parse_args(int argc, char* argv[], changes_options& opts) {
+    static const option long_opts[] = {
+            {"dbpath", required_argument, nullptr, 'd'},
+            {"since", required_argument, nullptr, 's'},
+            {"latest", no_argument, nullptr, 'l'},
+            {"paths", no_argument, nullptr, 'p'},
+            {"help", no_argument, nullptr, 'h'},
+            {nullptr, 0, nullptr, 0}
+    };
+
+    int c;
+    char* end;
+    while((c = getopt_long(argc, argv, "d:s:lph", long_opts, nullptr)) != -1) {
+        switch(c) {
+            case 'd': opts.dbpaths.emplace_back(optarg); break;
+            case 's':
+                end = optarg;
+                do {
+                    opts.since.push_back(strtoull(end, &end, 10));
+                } while(*end++ == ',');
+                break;
+            case 'l': opts.latest = true; break;
+            case 'p': opts.paths = true; break;
+            default: return -1;
+        }
+    }
+    if(optind != argc) {
+        return -1;
+    }
+    if(opts.dbpaths.empty()) {
+        opts.dbpaths.emplace_back("./db");
+    }
+    if(!opts.latest && opts.since.size() != opts.dbpaths.size()) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * a name as a single word of an event line
+ */
+static string escape(string_view name) {
+    string out;
+    char hex[8];
+    for(char c : name) {
+        if(c == '\\' || c <= ' ' || c == 0x7f) {
+            sprintf(hex, "\\x%02x", (uint8_t)c);
+            out.append(hex);
+        } else {
+            out.push_back(c);
+        }
+    }
+    return out;
+}
+
+/**
+ * @return ino if key is the key of an inode, 0 if it isn't. 0 is the super block
+ */
+static uint64_t inode_of(const Slice& key) {
+    if(key.empty() || key.size() >= INODE_KEY_LEN) {
+        return 0;
+    }
+    uint64_t ino = 0;
+    for(size_t i = 0;i < key.size();i++) {
+        if(key[i] < '0' || key[i] > '9') return 0;
+        ino = ino * 10 + (key[i] - '0');
+    }
+    return ino;
+}
+
+/**
+ * @return whether key is the key of a block, "<ino>:<blk>"
+ */
+static bool block_of(const Slice& key, uint64_t& ino, uint64_t& blk) {
+    string k = key.ToString();
+    char* end;
+    ino = strtoull(k.c_str(), &end, 10);
+    if(end == k.c_str() || *end != ':') {
+        return false;
+    }
+    blk = strtoull(end + 1, &end, 16);
+    return *end == '\0';
+}
+
+/**
+ * the shards of the fs opened as secondaries, with the index if the fs has one
+ */
+struct change_source {
+    vector<DB*> shards;
+    vector<rocksdb::ColumnFamilyHandle*> indexes;
+    vector<vector<rocksdb::ColumnFamilyHandle*>> handles;
+
+    /**
+     * the path of an inode as the entries of the index have it now, "-" if it's not linked any more
+     */
+    string path_of(uint64_t ino) {
+        vector<string> names;
+        string rV;
+        while(ino != ROOT_DENTRY_INO) {
+            bool found = false;
+            // the entry is in the shard of the inode, any will do to look
+            string key(1, 'p');
+            for(int shift = 56;shift >= 0;shift -= 8) key.push_back((char)(ino >> shift));
+            for(size_t i = 0;i < shards.size() && !found;i++) {
+                found = shards[i]->Get(ReadOptions(), indexes[i], key, &rV).ok() && rV.size() >= sizeof(uint64_t);
+            }
+            if(!found || names.size() > 4096) {
+                return "-";
+            }
+            names.push_back(rV.substr(sizeof(uint64_t)));
+            ino = 0;
+            for(int i = 0;i < 8;i++) ino = ino << 8 | (uint8_t)rV[i];
+        }
+        string path;
+        for(auto it = names.rbegin();it != names.rend();it++) {
+            path.append("/").append(escape(*it));
+        }
+        return path.empty() ? "/" : path;
+    }
+};
+
+/**
+ * the events of a batch. the ops the fs logged with it come first, then the inodes written, the data
+ * written and the inodes dropped. the index, the markers and the counters aren't events.
+ * blocks are keyed by the ino they're stored under, a clone's are under the ino of the file it was cloned
+ * from. the data events of such blocks go to the files whose inodes were written with them. an inlined file's
+ * data is in its inode, every write of the inode is a write of all of it
+ */
+class change_decoder : public WriteBatch::Handler {
+private:
+    std::set<uint32_t> data_cfs; // default and meta, where inodes and blocks are
+    vector<string> ops;
+    std::set<uint64_t> attrs, drops;
+    map<uint64_t, std::set<uint64_t>> blocks; // by the ino they're stored under
+    vector<std::pair<uint64_t, uint64_t>> truncs;
+    map<uint64_t, std::set<uint64_t>> owners; // the files written, by the ino their blocks are stored under
+    map<uint64_t, uint64_t> inlined; // the size of the inlined files written
+
+    /**
+     * the files blocks stored under blk_ino belong to, blk_ino itself if no inode in the batch says
+     */
+    vector<uint64_t> files_of(uint64_t blk_ino) {
+        auto o = owners.find(blk_ino);
+        if(o == owners.end()) {
+            return {blk_ino};
+        }
+        return vector<uint64_t>(o->second.begin(), o->second.end());
+    }
+
+public:
+    explicit change_decoder(std::set<uint32_t> data_cfs) : data_cfs(std::move(data_cfs)) {}
+
+    Status PutCF(uint32_t cf, const Slice& key, const Slice& value) override {
+        uint64_t ino, blk;
+        if(data_cfs.count(cf) == 0) {
+            return Status::OK();
+        }
+        if((ino = inode_of(key)) != 0) {
+            attrs.insert(ino);
+            inode_t inode(value.data(), value.size());
+            if((inode.mode & S_IFMT) == S_IFREG && inode.inlined) {
+                inlined[ino] = inode.file_sz;
+            } else if((inode.mode & S_IFMT) == S_IFREG) {
+                owners[inode.blk_ino(ino)].insert(ino);
+            }
+        } else if(block_of(key, ino, blk)) {
+            blocks[ino].insert(blk);
+        }
+        return Status::OK();
+    }
+
+    Status DeleteCF(uint32_t cf, const Slice& key) override {
+        uint64_t ino, blk;
+        if(data_cfs.count(cf) == 0) {
+            return Status::OK();
+        }
+        if((ino = inode_of(key)) != 0) {
+            drops.insert(ino);
+        } else if(block_of(key, ino, blk)) {
+            blocks[ino].insert(blk);
+        }
+        return Status::OK();
+    }
+
+    Status DeleteRangeCF(uint32_t cf, const Slice& beg, const Slice& end) override {
+        uint64_t ino, blk, end_ino, end_blk;
+        if(data_cfs.count(cf) > 0 && block_of(beg, ino, blk) && block_of(end, end_ino, end_blk) && ino == end_ino) {
+            if(end_blk - blk > MAX_FILE_SZ / BLOCK_SZ) {
+                truncs.emplace_back(ino, blk * BLOCK_SZ);
+            } else {
+                for(;blk < end_blk;blk++) blocks[ino].insert(blk);
+            }
+        }
+        return Status::OK();
+    }
+
+    Status MergeCF(uint32_t cf, const Slice& key, const Slice& value) override {
+        return Status::OK();
+    }
+
+    void LogData(const Slice& blob) override {
+        rfs_change_d c;
+        if(blob.size() < sizeof(c)) return;
+        memcpy(&c, blob.data(), sizeof(c));
+        if(c.magic != CHANGE_MAGIC || blob.size() != sizeof(c) + c.name_len + c.new_name_len) return;
+        string_view name(blob.data() + sizeof(c), c.name_len);
+        string_view new_name(blob.data() + sizeof(c) + c.name_len, c.new_name_len);
+        const char* ftype = c.ftype == dir ? "d" : "f";
+        char line[128];
+        switch(c.op) {
+            case change_create:
+            case change_unlink:
+                snprintf(line, sizeof(line), "%s %lu %s %lu ", c.op == change_create ? "create" : "unlink", c.ino, ftype, c.parent);
+                ops.push_back(line + escape(name));
+                break;
+            case change_rename:
+                snprintf(line, sizeof(line), "rename %lu %s %lu ", c.ino, ftype, c.parent);
+                ops.push_back(line + escape(name) + " " + std::to_string(c.new_parent) + " " + escape(new_name));
+                break;
+        }
+    }
+
+    /**
+     * print the events decoded and start over, ranges of blocks written together are one write
+     * @param src to end the events of an inode with its path, nullptr not to
+     */
+    void flush(size_t shard, uint64_t seq, change_source* src) {
+        auto path = [&](uint64_t ino) { return src == nullptr ? string() : " " + src->path_of(ino); };
+        for(auto& op : ops) {
+            printf("%zu %lu %s\n", shard, seq, op.c_str());
+        }
+        for(uint64_t ino : attrs) {
+            if(drops.count(ino) == 0) printf("%zu %lu attr %lu%s\n", shard, seq, ino, path(ino).c_str());
+        }
+        for(auto& b : blocks) {
+            for(uint64_t ino : files_of(b.first)) {
+                string p = path(ino);
+                for(auto it = b.second.begin();it != b.second.end();) {
+                    uint64_t beg = *it, end = beg + 1;
+                    while(++it != b.second.end() && *it == end) end++;
+                    printf("%zu %lu write %lu %lu %lu%s\n", shard, seq, ino, beg * BLOCK_SZ, (end - beg) * BLOCK_SZ, p.c_str());
+                }
+            }
+        }
+        for(auto& i : inlined) {
+            if(i.second > 0 && drops.count(i.first) == 0) {
+                printf("%zu %lu write %lu 0 %lu%s\n", shard, seq, i.first, i.second, path(i.first).c_str());
+            }
+        }
+        for(auto& t : truncs) {
+            for(uint64_t ino : files_of(t.first)) {
+                if(drops.count(ino) == 0) printf("%zu %lu trunc %lu %lu%s\n", shard, seq, ino, t.second, path(ino).c_str());
+            }
+        }
+        for(uint64_t ino : drops) {
+            printf("%zu %lu drop %lu\n", shard, seq, ino);
+        }
+        ops.clear();
+        attrs.clear();
+        drops.clear();
+        blocks.clear();
+        truncs.clear();
+        owners.clear();
+        inlined.clear();
+    }
+};
+
+int main(int argc, char* argv[]) {
+    changes_options opts;
+    if(parse_args(argc, argv, opts) != 0) {
+        show_help(argv[0]);
+        return 1;
+    }
+
+    rocksdb::Options options;
+    options.merge_operator = make_shared<rfs_counter_merge>();
+    // a secondary keeps every table open, and its own info log out of the primary's way
+    options.max_open_files = -1;
+    char scratch[] = "/tmp/rfs_changes.XXXXXX";
+    if(mkdtemp(scratch) == nullptr) {
+        fprintf(stderr, "rfs_changes: mkdtemp failed\n");
+        return 1;
+    }
+
+    change_source src;
+    vector<std::set<uint32_t>> data_cfs;
+    int ret = 0;
+    for(size_t i = 0;i < opts.dbpaths.size() && ret == 0;i++) {
+        // opened as the mount opens it, plain tables of inodes are only read through mmap
+        vector<rocksdb::ColumnFamilyDescriptor> cfs = layout_cfs(options, opts.dbpaths[i], read_layout(opts.dbpaths[i]));
+        DB* db = nullptr;
+        vector<rocksdb::ColumnFamilyHandle*> handles;
+        Status s = DB::OpenAsSecondary(options, opts.dbpaths[i], string(scratch) + "/" + std::to_string(i), cfs,
+                                       &handles, &db);
+        if(s.ok()) {
+            s = db->TryCatchUpWithPrimary();
+        }
+        if(!s.ok()) {
+            fprintf(stderr, "rfs_changes: open %s failed: %s\n", opts.dbpaths[i].c_str(), s.ToString().c_str());
+            if(db != nullptr) delete db;
+            ret = 1;
+            break;
+        }
+        src.shards.push_back(db);
+        src.handles.push_back(handles);
+        data_cfs.emplace_back();
+        rocksdb::ColumnFamilyHandle* index = nullptr;
+        for(size_t c = 0;c < cfs.size();c++) {
+            if(cfs[c].name == INDEX_CF) index = handles[c];
+            else data_cfs.back().insert(handles[c]->GetID());
+        }
+        src.indexes.push_back(index);
+        if(opts.paths && index == nullptr) {
+            fprintf(stderr, "rfs_changes: %s has no index, paths need a mount with --index\n", opts.dbpaths[i].c_str());
+            ret = 1;
+        }
+    }
+
+    vector<uint64_t> next(src.shards.size());
+    for(size_t i = 0;i < src.shards.size() && ret == 0;i++) {
+        DB* db = src.shards[i];
+        next[i] = db->GetLatestSequenceNumber() + 1;
+        if(opts.latest || opts.since[i] >= next[i]) {
+            if(!opts.latest) next[i] = opts.since[i];
+            continue;
+        }
+
+        unique_ptr<rocksdb::TransactionLogIterator> it;
+        Status s = db->GetUpdatesSince(opts.since[i], &it);
+        change_decoder decoder(data_cfs[i]);
+        next[i] = opts.since[i];
+        for(;s.ok() && it->Valid();it->Next()) {
+            rocksdb::BatchResult r = it->GetBatch();
+            // the batch holding since comes first, one after it means those before are gone
+            if(next[i] == opts.since[i] && r.sequence > opts.since[i]) {
+                s = Status::NotFound("WAL archived past the sequence");
+                break;
+            }
+            s = r.writeBatchPtr->Iterate(&decoder);
+            decoder.flush(i, r.sequence, opts.paths ? &src : nullptr);
+            next[i] = r.sequence + r.writeBatchPtr->Count();
+        }
+        if(s.ok()) s = it->status();
+        if(!s.ok()) {
+            fprintf(stderr, "rfs_changes: changes of %s since %lu are gone, a full backup is needed: %s\n",
+                    opts.dbpaths[i].c_str(), opts.since[i], s.ToString().c_str());
+            ret = 2;
+        }
+    }
+
+    if(ret == 0) {
+        printf("next");
+        for(size_t i = 0;i < next.size();i++) {
+            printf("%c%lu", i == 0 ? ' ' : ',', next[i]);
+        }
+        printf("\n");
+    }
+
+    for(size_t i = 0;i < src.shards.size();i++) {
+        for(auto h : src.handles[i]) src.shards[i]->DestroyColumnFamilyHandle(h);
+        delete src.shards[i];
+    }
+    std::error_code ec;
+    std::filesystem::remove_all(scratch, ec);
+    return ret;
+}
@@ -0,0 +1,151 @@
+//
+// Created by aln0 on 4/9/23.
+//
+
+#include "rocksdb_fs.h"
+#include "types.h"
+
+using rocksdb::PinnableSlice;
+
+static const int64_t ref_inc = 1, ref_dec = -1;
+
+/**
+ * 64 bit FNV-1a, only picks the chunk key, equal hashes are told apart by comparing the bytes
+ */
+static uint64_t chunk_hash(const string& data) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for(unsigned char c : data) {
+        h ^= c;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/**
+ * mark a chunk a batch drops a reference to, it's dropped once the batch is written if nothing refers to it
+ */
+static void release_chunk(WriteBatch &batch, const string &ck, vector<string> &released) {
+    char mk[RELEASED_KEY_LEN];
+    released_key(mk, ck);
+    batch.Put(mk, Slice());
+    released.push_back(ck);
+}
+
+/**
+ * add the dirty blocks of a deduplicated file to batch. a block value is the key of the chunk holding its bytes,
+ * a chunk value is its int64 reference count followed by the bytes.
+ * chunks the replaced blocks referred to are appended to released and marked in batch, they may be dropped once
+ * batch is written. dedup_lock must be held until then
+ */
+void rocksdb_fs::dedup_blocks(uint64_t ino, inode_t *inode, WriteBatch &batch, vector<string> &released) {
+    char blk_key[BLOCK_KEY_LEN], ck[CHUNK_KEY_LEN];
+    map<string, const string*> added; // chunks first stored by this batch
+    string old;
+    DB* db = db_of(inode->blk_ino(ino));
+
+    for(auto& b : inode->blocks) {
+        if(!b.second.dirty) continue;
+        block_key(blk_key, inode->blk_ino(ino), b.first);
+        if(db->Get(ReadOptions(), blk_key, &old).ok()) {
+            batch.Merge(old, Slice((char*)&ref_dec, sizeof(ref_dec)));
+            release_chunk(batch, old, released);
+        }
+        if(b.second.data.empty()) {
+            batch.Delete(blk_key);
+            continue;
+        }
+
+        const string& data = b.second.data;
+        uint64_t h = chunk_hash(data);
+        for(uint32_t n = 0;;n++) {
+            chunk_key(ck, h, n);
+            auto it = added.find(ck);
+            if(it != added.end()) {
+                if(*it->second != data) continue;
+                batch.Merge(ck, Slice((char*)&ref_inc, sizeof(ref_inc)));
+                break;
+            }
+
+            PinnableSlice rV;
+            if(!db->Get(ReadOptions(), db->DefaultColumnFamily(), ck, &rV).ok()) {
+                string val((char*)&ref_inc, sizeof(ref_inc));
+                val.append(data);
+                batch.Put(ck, val);
+                added[ck] = &data;
+                break;
+            }
+            if(rV.size() >= sizeof(int64_t) && Slice(rV.data() + sizeof(int64_t), rV.size() - sizeof(int64_t)) == data) {
+                batch.Merge(ck, Slice((char*)&ref_inc, sizeof(ref_inc)));
+                break;
+            }
+        }
+        batch.Put(blk_key, ck);
+    }
+}
+
+/**
+ * drop the blocks of a deduplicated file in [beg, end) of db along with their chunk references
+ */
+void rocksdb_fs::drop_deduped_blocks(DB* db, const Slice &beg, const Slice &end) {
+    unique_lock<mutex> l(dedup_lock);
+    ReadOptions opts;
+    opts.iterate_upper_bound = &end;
+    auto it = unique_ptr<rocksdb::Iterator>(db->NewIterator(opts));
+
+    WriteBatch batch;
+    vector<string> released;
+    for(it->Seek(beg); it->Valid(); it->Next()) {
+        batch.Merge(it->value(), Slice((char*)&ref_dec, sizeof(ref_dec)));
+        release_chunk(batch, it->value().ToString(), released);
+    }
+    batch.DeleteRange(db->DefaultColumnFamily(), beg, end);
+    if(!it->status().ok() || !db->Write(WriteOptions(), &batch).ok()) {
+        RFS_DEBUG("rfs::drop_deduped_blocks", "write failed");
+        return;
+    }
+    drop_unused_chunks(db, released);
+}
+
+/**
+ * delete the chunks of db no block refers to any more along with their marks, dedup_lock must be held.
+ * a mark stays if its chunk can't be read, the next mount tries again
+ */
+void rocksdb_fs::drop_unused_chunks(DB* db, const vector<string> &chunks) {
+    int64_t refs;
+    char mk[RELEASED_KEY_LEN];
+    WriteBatch batch;
+    for(auto& ck : chunks) {
+        PinnableSlice rV;
+        Status s = db->Get(ReadOptions(), db->DefaultColumnFamily(), ck, &rV);
+        if(!s.ok() && !s.IsNotFound()) {
+            continue;
+        }
+        released_key(mk, ck);
+        batch.Delete(mk);
+        if(!s.ok() || rV.size() < sizeof(int64_t)) {
+            continue;
+        }
+        memcpy(&refs, rV.data(), sizeof(refs));
+        if(refs <= 0) {
+            batch.Delete(ck);
+        }
+    }
+    if(batch.Count() > 0 && !db->Write(WriteOptions(), &batch).ok()) {
+        RFS_DEBUG("rfs::drop_unused_chunks", "write failed");
+    }
+}
+
+/**
+ * drop the chunks released by the writes a crash stopped before they could be dropped
+ */
+void rocksdb_fs::sweep_chunks() {
+    unique_lock<mutex> l(dedup_lock);
+    for(DB* db : shards) {
+        vector<string> chunks;
+        auto it = unique_ptr<rocksdb::Iterator>(db->NewIterator(ReadOptions()));
+        for(it->Seek("g"); it->Valid() && it->key()[0] == 'g'; it->Next()) {
+            chunks.emplace_back(it->key().data() + 1, it->key().size() - 1);
+        }
+        drop_unused_chunks(db, chunks);
+    }
+}
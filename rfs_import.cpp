@@ -0,0 +1,569 @@
+//
+// Created by aln0 on 4/2/23.
+//
+// rfs_import: offline bulk loader. Walks a host directory tree in parallel, builds the
+// superblock, inode, directory and data block records in sorted SST files with SstFileWriter and
+// ingests them into the db with IngestExternalFiles, bypassing the mount entirely. Inodes go to the
+// column family of their own when the db has one.
+//
+
+#include "rocksdb/db.h"
+#include "rocksdb/sst_file_writer.h"
+#include "rfs_layout.h"
+#include "rfs_merge.h"
+#include "types.h"
+
+#include <getopt.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using rocksdb::DB;
+using rocksdb::Status;
+using rocksdb::Slice;
+using rocksdb::ReadOptions;
+using rocksdb::WriteOptions;
+using std::vector;
+using std::pair;
+using std::mutex;
+using std::unique_lock;
+using std::condition_variable;
+
+// buffered bytes per worker before its records are sorted and spilled into an sst file
+#define SST_SPILL_THRESHOLD (64 << 20)
+
+struct import_options {
+    const char* dbpath = "./db";
+    const char* target = "/";
+    const char* src = nullptr;
+    int threads = 0;
+};
+
+struct dir_job {
+    string host_path;
+    uint64_t ino;
+    struct stat st;
+};
+
+/**
+ * keep the mode, owner and timestamps of the host file
+ */
+static void copy_attrs(inode_t* inode, const struct stat& st) {
+    inode->mode = st.st_mode;
+    inode->uid = st.st_uid;
+    inode->gid = st.st_gid;
+    inode->atime = st.st_atim;
+    inode->mtime = st.st_mtim;
+    inode->ctime = st.st_ctim;
+}
+
+/**
+ * per-worker record buffer, spilled into its own sst files when it grows over SST_SPILL_THRESHOLD.
+ * records of different workers never share a key, so the spilled files may overlap freely.
+ * with meta_options inodes are spilled apart, for the column family of their own
+ */
+class sst_sink {
+private:
+    const rocksdb::Options& options;
+    const rocksdb::Options* meta_options;
+    string dir;
+    int worker;
+    vector<pair<string, string>> records[2]; // file data, inodes
+    size_t buffered = 0;
+    int seq = 0;
+
+public:
+    vector<string> files[2];
+
+    sst_sink(const rocksdb::Options& options, const rocksdb::Options* meta_options, string dir, int worker)
+        : options(options), meta_options(meta_options), dir(std::move(dir)), worker(worker) {}
+
+    int add(const char* key, const char* data, size_t size, bool inode = false) {
+        auto& r = records[inode && meta_options != nullptr];
+        r.emplace_back(key, string(data, size));
+        buffered += r.back().first.size() + size;
+        return buffered >= SST_SPILL_THRESHOLD ? spill() : 0;
+    }
+
+    int spill() {
+        if(spill(0) != 0 || spill(1) != 0) {
+            return -1;
+        }
+        buffered = 0;
+        return 0;
+    }
+
+    int spill(int cf) {
+        if(records[cf].empty()) {
+            return 0;
+        }
+        std::sort(records[cf].begin(), records[cf].end(),
+                  [](const pair<string, string>& a, const pair<string, string>& b) { return a.first < b.first; });
+
+        char fname[64];
+        sprintf(fname, "/%d-%d.sst", worker, seq++);
+        rocksdb::SstFileWriter writer(rocksdb::EnvOptions(), cf == 0 ? options : *meta_options);
+        Status s = writer.Open(dir + fname);
+        for(size_t i = 0;s.ok() && i < records[cf].size();i++) {
+            s = writer.Put(records[cf][i].first, records[cf][i].second);
+        }
+        if(s.ok()) s = writer.Finish();
+        if(!s.ok()) {
+            fprintf(stderr, "rfs_import: writing %s%s failed: %s\n", dir.c_str(), fname, s.ToString().c_str());
+            return -1;
+        }
+
+        files[cf].push_back(dir + fname);
+        records[cf].clear();
+        return 0;
+    }
+};
+
+/**
+ * parallel walker of the host tree. directories are handed out through a shared queue, every
+ * worker lists one directory at a time, allocates inode numbers for its children and emits
+ * the directory record together with the records of its regular files.
+ */
+class tree_importer {
+private:
+    std::atomic<uint64_t> cur_ino;
+    std::atomic<uint64_t> n_files{0};
+    std::atomic<uint64_t> n_bytes{0};
+    std::atomic<uint64_t> n_skipped{0};
+    std::atomic<bool> failed{false};
+
+    mutex queue_lock;
+    condition_variable queue_cv;
+    std::deque<dir_job> queue;
+    size_t pending = 0; // queued or being processed
+
+    vector<unique_ptr<sst_sink>> sinks;
+
+public:
+    tree_importer(uint64_t last_ino, const rocksdb::Options& options, const rocksdb::Options* meta_options,
+                  const string& tmp_dir, int threads)
+        : cur_ino(last_ino) {
+        for(int i = 0;i < threads;i++) {
+            sinks.emplace_back(make_unique<sst_sink>(options, meta_options, tmp_dir, i));
+        }
+    }
+
+    uint64_t last_ino() const { return cur_ino.load(); }
+    uint64_t files() const { return n_files.load(); }
+    uint64_t bytes() const { return n_bytes.load(); }
+    uint64_t skipped() const { return n_skipped.load(); }
+
+    /**
+     * the files of file data with cf 0, of inodes with 1
+     */
+    vector<string> sst_files(int cf) const {
+        vector<string> ret;
+        for(auto& s : sinks) ret.insert(ret.end(), s->files[cf].begin(), s->files[cf].end());
+        return ret;
+    }
+
+    /**
+     * list the children of a host directory into dentries of the target directory, added in one pass.
+     * subdirectories are queued, regular files are emitted right away. new names must not clash with the
+     * dentries the directory already holds
+     * @return -1 on failure
+     */
+    int list_dir(const string& host_path, inode_t* dir_inode, sst_sink* sink) {
+        DIR* d = ::opendir(host_path.c_str());
+        if(d == nullptr) {
+            fprintf(stderr, "rfs_import: cannot open %s: %s\n", host_path.c_str(), strerror(errno));
+            return -1;
+        }
+
+        dirent* ent;
+        vector<rfs_dirent> children;
+        struct stat st = {};
+        while((ent = ::readdir(d)) != nullptr) {
+            if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+                continue;
+            }
+
+            string child = host_path + "/" + ent->d_name;
+            if(lstat(child.c_str(), &st) != 0) {
+                fprintf(stderr, "rfs_import: cannot stat %s: %s\n", child.c_str(), strerror(errno));
+                n_skipped++;
+                continue;
+            }
+            if(!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+                fprintf(stderr, "rfs_import: skip %s: unsupported file type\n", child.c_str());
+                n_skipped++;
+                continue;
+            }
+
+            // the same limit as mknod has. a name cut short could clash with another, it's skipped whole
+            if(strlen(ent->d_name) > MAX_FILE_NAME_LEN) {
+                fprintf(stderr, "rfs_import: skip %s: name too long\n", child.c_str());
+                n_skipped++;
+                continue;
+            }
+            if(dir_inode->find_dentry_d(ent->d_name) != nullptr) {
+                fprintf(stderr, "rfs_import: %s already exists in the target directory\n", ent->d_name);
+                closedir(d);
+                return -1;
+            }
+            rfs_dirent dentry = {++cur_ino, reg, ent->d_name};
+
+            if(S_ISDIR(st.st_mode)) {
+                dentry.ftype = dir;
+                push({child, dentry.ino, st});
+            } else if(import_file(child, dentry.ino, st, sink) != 0) {
+                closedir(d);
+                return -1;
+            }
+            children.push_back(std::move(dentry));
+        }
+
+        closedir(d);
+        dir_inode->add_dentries_d(children);
+        return 0;
+    }
+
+    int import_file(const string& host_path, uint64_t ino, const struct stat& st, sst_sink* sink) {
+        int fd = ::open(host_path.c_str(), O_RDONLY);
+        if(fd < 0) {
+            fprintf(stderr, "rfs_import: cannot open %s: %s\n", host_path.c_str(), strerror(errno));
+            return -1;
+        }
+
+        // blocks of zeros are left as holes
+        inode_t inode;
+        copy_attrs(&inode, st);
+        char buf[BLOCK_SZ], key[BLOCK_KEY_LEN];
+        static const char zeros[BLOCK_SZ] = {};
+        ssize_t n = 0;
+        size_t len;
+        for(uint64_t blk = 0;;blk++) {
+            for(len = 0;len < BLOCK_SZ;len += n) {
+                n = ::read(fd, buf + len, BLOCK_SZ - len);
+                if(n <= 0) break;
+            }
+            if(n < 0) {
+                fprintf(stderr, "rfs_import: cannot read %s: %s\n", host_path.c_str(), strerror(errno));
+                ::close(fd);
+                return -1;
+            }
+            if(len == 0) break;
+
+            inode.file_sz += len;
+            if(memcmp(buf, zeros, len) != 0) {
+                block_key(key, ino, blk);
+                if(sink->add(key, buf, len) != 0) {
+                    ::close(fd);
+                    return -1;
+                }
+            }
+            if(len < BLOCK_SZ) break;
+        }
+        ::close(fd);
+
+        inode.before_write_back();
+        n_files++;
+        n_bytes += inode.file_sz;
+        inode_key(key, ino);
+        return sink->add(key, (const char*)inode.data(), inode.used_dat_sz + inode.attr_sz, true);
+    }
+
+    void push(dir_job job) {
+        unique_lock<mutex> l(queue_lock);
+        queue.push_back(std::move(job));
+        pending++;
+        queue_cv.notify_one();
+    }
+
+    void worker(int id) {
+        sst_sink* sink = sinks[id].get();
+        while(true) {
+            dir_job job;
+            {
+                unique_lock<mutex> l(queue_lock);
+                queue_cv.wait(l, [this] { return !queue.empty() || pending == 0 || failed; });
+                if(queue.empty() || failed) {
+                    return;
+                }
+                job = std::move(queue.front());
+                queue.pop_front();
+            }
+
+            inode_t dir_inode;
+            copy_attrs(&dir_inode, job.st);
+            if(list_dir(job.host_path, &dir_inode, sink) != 0) {
+                failed = true;
+            } else {
+                char key[INODE_KEY_LEN];
+                inode_key(key, job.ino);
+                dir_inode.before_write_back();
+                if(sink->add(key, (const char*)dir_inode.data(), dir_inode.used_dat_sz + dir_inode.attr_sz, true) != 0) {
+                    failed = true;
+                }
+            }
+
+            unique_lock<mutex> l(queue_lock);
+            if(--pending == 0 || failed) {
+                queue_cv.notify_all();
+            }
+        }
+    }
+
+    /**
+     * import the children of src into the directory inode `target`, which is written back by the caller
+     * @return -1 on failure
+     */
+    int run(const string& src, inode_t* target, int threads) {
+        if(list_dir(src, target, sinks[0].get()) != 0) {
+            return -1;
+        }
+
+        vector<std::thread> workers;
+        for(int i = 0;i < threads;i++) {
+            workers.emplace_back(&tree_importer::worker, this, i);
+        }
+        for(auto& t : workers) {
+            t.join();
+        }
+
+        for(auto& s : sinks) {
+            if(failed || s->spill() != 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+};
+
+static void show_help(const char* prog) {
+    printf("usage: %s [options] <host_dir>\n"
+           "    --dbpath=<s>        Path of rocksdb's persistent file (default: \"./db\")\n"
+           "    --target=<s>        Existing directory of the file system to import into (default: \"/\")\n"
+           "    --threads=<d>       Number of walker threads (default: number of cpus)\n"
+           "exits with 2 if files were skipped, names too long or types other than regular files and directories\n", prog);
+}
+
+static int parse_args(int argc, char* argv[], import_options& opts) {
+    static const option long_opts[] = {
+            {"dbpath", required_argument, nullptr, 'd'},
+            {"target", required_argument, nullptr, 't'},
+            {"threads", required_argument, nullptr, 'j'},
+            {"help", no_argument, nullptr, 'h'},
+            {nullptr, 0, nullptr, 0}
+    };
+
+    int c;
+    while((c = getopt_long(argc, argv, "d:t:j:h", long_opts, nullptr)) != -1) {
+        switch(c) {
+            case 'd': opts.dbpath = optarg; break;
+            case 't': opts.target = optarg; break;
+            case 'j': opts.threads = atoi(optarg); break;
+            default: return -1;
+        }
+    }
+    if(optind != argc - 1) {
+        return -1;
+    }
+    opts.src = argv[optind];
+    if(opts.threads <= 0) {
+        opts.threads = (int)std::max(1u, std::thread::hardware_concurrency());
+    }
+    return 0;
+}
+
+/**
+ * resolve the target directory in the db
+ * @return the directory's inode, nullptr if it does not exist or is not a directory
+ */
+static unique_ptr<inode_t> resolve_target(DB* db, rocksdb::ColumnFamilyHandle* meta, const char* path, uint64_t& ino) {
+    string rV;
+    ino = ROOT_DENTRY_INO;
+    if(!db->Get(ReadOptions(), meta, std::to_string(ino), &rV).ok()) {
+        return nullptr;
+    }
+    auto inode = make_unique<inode_t>(rV.data(), rV.size());
+
+    string p(path);
+    size_t beg = 0, end;
+    while(beg < p.size()) {
+        end = p.find('/', beg);
+        if(end == string::npos) end = p.size();
+        if(end > beg) {
+            const rfs_dentry_d* dentry_cursor = inode->find_dentry_d(string_view(p).substr(beg, end - beg));
+            if(dentry_cursor == nullptr || dentry_cursor->ftype != dir) {
+                return nullptr;
+            }
+            ino = dentry_cursor->ino;
+            if(!db->Get(ReadOptions(), meta, std::to_string(ino), &rV).ok()) {
+                return nullptr;
+            }
+            inode = make_unique<inode_t>(rV.data(), rV.size());
+        }
+        beg = end + 1;
+    }
+    return inode;
+}
+
+int main(int argc, char* argv[]) {
+    import_options opts;
+    if(parse_args(argc, argv, opts) != 0) {
+        show_help(argv[0]);
+        return 1;
+    }
+
+    rocksdb::Options options;
+    options.IncreaseParallelism();
+    options.OptimizeLevelStyleCompaction();
+    options.create_if_missing = true;
+    options.merge_operator = make_shared<rfs_counter_merge>();
+    // opened as the mount opens it, inodes are imported into their column family if the db has one
+    rfs_layout layout = read_layout(opts.dbpath);
+    vector<rocksdb::ColumnFamilyDescriptor> cfs = layout_cfs(options, opts.dbpath, layout);
+    vector<rocksdb::ColumnFamilyHandle*> handles;
+    DB* db;
+    Status s = DB::Open(options, opts.dbpath, cfs, &handles, &db);
+    if(!s.ok()) {
+        fprintf(stderr, "rfs_import: open %s failed: %s\n", opts.dbpath, s.ToString().c_str());
+        return 1;
+    }
+    rocksdb::ColumnFamilyHandle* meta = handles[layout.meta ? 1 : 0];
+    rocksdb::ColumnFamilyHandle* index = layout.index ? handles.back() : nullptr;
+    unique_ptr<rocksdb::Options> meta_options;
+    if(layout.meta) {
+        meta_options = make_unique<rocksdb::Options>(rocksdb::DBOptions(options), cfs[1].options);
+    }
+    auto close_db = [&]() {
+        for(auto h : handles) db->DestroyColumnFamilyHandle(h);
+        db->Close();
+        delete db;
+    };
+
+    // inodes would have to be spread by ino, only an unsharded fs is imported into
+    string rV;
+    uint32_t shard[2] = {0, 1};
+    if(db->Get(ReadOptions(), SHARD_KEY, &rV).ok() && rV.size() == sizeof(shard)) {
+        memcpy(shard, rV.data(), sizeof(shard));
+    }
+    if(shard[1] > 1) {
+        fprintf(stderr, "rfs_import: %s is shard %u of %u, sharded fs can't be imported into\n", opts.dbpath,
+                shard[0] + 1, shard[1]);
+        close_db();
+        return 1;
+    }
+    // some inodes would still be in the default column family, the mount moves them
+    if(layout.meta && !db->Get(ReadOptions(), META_KEY, &rV).ok()) {
+        fprintf(stderr, "rfs_import: %s has inodes left to move, mount it once first\n", opts.dbpath);
+        close_db();
+        return 1;
+    }
+
+    // a fresh db gets the same super block and root as rocksdb_fs::mount would create
+    super_block_d super_d = {1};
+    unique_ptr<inode_t> target;
+    uint64_t target_ino = ROOT_DENTRY_INO;
+    s = db->Get(ReadOptions(), meta, "0", &rV);
+    if(s.IsNotFound()) {
+        target = make_unique<inode_t>();
+        target->mode = S_IFDIR | 0755;
+        target->uid = getuid();
+        target->gid = getgid();
+        target->touch(RFS_ATIME);
+    } else if(s.ok()) {
+        // the records of an older format are converted by the mount, not mixed with new ones
+        uint32_t format = 0;
+        string fV;
+        if(db->Get(ReadOptions(), FORMAT_KEY, &fV).ok() && fV.size() == sizeof(format)) {
+            memcpy(&format, fV.data(), sizeof(format));
+        }
+        if(format != RFS_FORMAT) {
+            fprintf(stderr, "rfs_import: %s is of format %u, mount it once first\n", opts.dbpath, format);
+            close_db();
+            return 1;
+        }
+        memcpy(&super_d, rV.data(), sizeof(super_block_d));
+        // numbers up to cur_ino + FILE_COUNTER_THRESHOLD may have been handed out by the last mount
+        super_d.cur_ino += FILE_COUNTER_THRESHOLD;
+        target = resolve_target(db, meta, opts.target, target_ino);
+        if(target == nullptr) {
+            fprintf(stderr, "rfs_import: target %s is not a directory\n", opts.target);
+            close_db();
+            return 1;
+        }
+    } else {
+        fprintf(stderr, "rfs_import: read super block failed: %s\n", s.ToString().c_str());
+        close_db();
+        return 1;
+    }
+
+    string tmp_dir = string(opts.dbpath) + "/import.tmp";
+    ::mkdir(tmp_dir.c_str(), 0755);
+
+    tree_importer importer(super_d.cur_ino, options, meta_options.get(), tmp_dir, opts.threads);
+    int ret = importer.run(opts.src, target.get(), opts.threads);
+
+    // file data and inodes become visible together
+    vector<rocksdb::IngestExternalFileArg> args;
+    vector<string> files;
+    for(int cf = 0;cf < 2;cf++) {
+        vector<string> part = importer.sst_files(cf);
+        if(part.empty()) continue;
+        files.insert(files.end(), part.begin(), part.end());
+        args.emplace_back();
+        args.back().column_family = cf == 0 ? db->DefaultColumnFamily() : meta;
+        args.back().external_files = std::move(part);
+        args.back().options.move_files = true;
+    }
+    if(ret == 0 && !args.empty()) {
+        s = db->IngestExternalFiles(args);
+        if(!s.ok()) {
+            fprintf(stderr, "rfs_import: ingest failed: %s\n", s.ToString().c_str());
+            ret = -1;
+        }
+    }
+
+    // link the imported tree only after all of its records are visible
+    if(ret == 0) {
+        super_d.cur_ino = importer.last_ino();
+        target->touch(RFS_MTIME | RFS_CTIME);
+        target->before_write_back();
+        rocksdb::WriteBatch batch;
+        uint32_t format = RFS_FORMAT;
+        batch.Put(FORMAT_KEY, Slice((char*)&format, sizeof(format)));
+        batch.Put(meta, "0", Slice((char*)&super_d, sizeof(super_block_d)));
+        batch.Put(meta, std::to_string(target_ino), Slice((char*)target->data(), target->used_dat_sz + target->attr_sz));
+        // the next mount counts the usage again, with the imported tree
+        char ukey[USAGE_KEY_LEN];
+        usage_key(ukey, ROOT_DENTRY_INO);
+        batch.Delete(ukey);
+        // and indexes it again
+        if(index != nullptr) batch.Delete(index, INDEX_KEY);
+        s = db->Write(WriteOptions(), &batch);
+        if(!s.ok()) {
+            fprintf(stderr, "rfs_import: link imported tree failed: %s\n", s.ToString().c_str());
+            ret = -1;
+        }
+    }
+
+    for(auto& f : files) {
+        ::unlink(f.c_str());
+    }
+    ::rmdir(tmp_dir.c_str());
+    close_db();
+
+    if(ret != 0) {
+        return 1;
+    }
+    printf("rfs_import: %lu files, %lu bytes imported, %lu skipped\n", importer.files(), importer.bytes(),
+           importer.skipped());
+    return importer.skipped() > 0 ? 2 : 0;
+}
@@ -0,0 +1,459 @@
+//
+// Created by aln0 on 4/25/23.
+//
+
+#include "rocksdb_fs.h"
+#include "types.h"
+#include <fnmatch.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <set>
+
+static void put_be(string& key, uint64_t val) {
+    for(int shift = 56;shift >= 0;shift -= 8) {
+        key.push_back((char)(val >> shift));
+    }
+}
+
+static uint64_t get_be(const char* p) {
+    uint64_t val = 0;
+    for(int i = 0;i < 8;i++) {
+        val = val << 8 | (uint8_t)p[i];
+    }
+    return val;
+}
+
+/**
+ * mtimes sort as unsigned with the sign bit flipped, the ones before 1970 come first
+ */
+static uint64_t mtime_val(int64_t sec) {
+    return (uint64_t)sec ^ (1ULL << 63);
+}
+
+static string value_key(char type, uint64_t val, uint64_t ino) {
+    string key(1, type);
+    put_be(key, val);
+    put_be(key, ino);
+    return key;
+}
+
+static string entry_key(uint64_t ino) {
+    string key(1, 'p');
+    put_be(key, ino);
+    return key;
+}
+
+static string token_key(string_view token, uint64_t ino) {
+    string key(1, 'n');
+    key.append(token);
+    key.push_back('\0');
+    put_be(key, ino);
+    return key;
+}
+
+/**
+ * the runs of letters and digits of a name lowercased, each once
+ */
+static vector<string> name_tokens(string_view name) {
+    vector<string> tokens;
+    string token;
+    for(size_t i = 0;i <= name.size();i++) {
+        if(i < name.size() && isalnum((unsigned char)name[i])) {
+            token.push_back((char)tolower((unsigned char)name[i]));
+            continue;
+        }
+        if(!token.empty() && std::find(tokens.begin(), tokens.end(), token) == tokens.end()) {
+            tokens.push_back(token);
+        }
+        token.clear();
+    }
+    return tokens;
+}
+
+/**
+ * the longest run of letters and digits of a glob that is sure to start a token of the names it matches,
+ * lowercased. it has to begin the glob or follow a literal character that isn't a letter or a digit.
+ * empty if there's none, every name is matched then
+ */
+static string glob_token(const string& pattern) {
+    string best, run;
+    bool usable = false, boundary = true;
+    for(size_t i = 0;i <= pattern.size();i++) {
+        char c = i < pattern.size() ? pattern[i] : '\0';
+        if(isalnum((unsigned char)c)) {
+            if(run.empty()) usable = boundary;
+            run.push_back((char)tolower((unsigned char)c));
+            continue;
+        }
+        if(usable && run.size() > best.size()) {
+            best = run;
+        }
+        run.clear();
+        if(c == '[') {
+            // a class matches a character we don't know
+            i = pattern.find(']', i + 2);
+            if(i == string::npos) break;
+            boundary = false;
+        } else if(c == '\\') {
+            i++;
+            boundary = i < pattern.size() && !isalnum((unsigned char)pattern[i]);
+        } else {
+            boundary = c != '*' && c != '?';
+        }
+    }
+    return best;
+}
+
+/**
+ * a term of a query, "mtime>T", "mtime<T", "size>N", "size<N" or "name=GLOB".
+ * T is in seconds since the epoch, N in bytes with an optional K, M, G or T suffix
+ */
+struct find_term {
+    char type; // 'm', 's' or 'n' like the keys scanned for it
+    char op;
+    uint64_t val;
+    string pattern;
+};
+
+/**
+ * split a query into its terms, they're separated by commas and all have to match
+ */
+static int parse_query(string_view query, vector<find_term>& terms) {
+    while(!query.empty()) {
+        size_t comma = query.find(',');
+        string_view t = query.substr(0, comma);
+        query = comma == string_view::npos ? string_view() : query.substr(comma + 1);
+
+        size_t op = t.find_first_of("<>=");
+        if(op == string_view::npos) {
+            return -1;
+        }
+        string_view field = t.substr(0, op);
+        string arg(t.substr(op + 1));
+        find_term term = {0, t[op], 0, ""};
+        if(field == "name" && term.op == '=') {
+            term.type = 'n';
+            term.pattern = arg;
+            terms.push_back(term);
+            continue;
+        }
+        if(term.op == '=' || arg.empty()) {
+            return -1;
+        }
+
+        char* end;
+        if(field == "mtime") {
+            term.type = 'm';
+            term.val = mtime_val(strtoll(arg.c_str(), &end, 10));
+        } else if(field == "size") {
+            term.type = 's';
+            term.val = strtoull(arg.c_str(), &end, 10);
+            const char* units = "KMGT";
+            const char* unit = *end != '\0' ? strchr(units, *end) : nullptr;
+            if(unit != nullptr) {
+                term.val <<= 10 * (unit - units + 1);
+                end++;
+            }
+        } else {
+            return -1;
+        }
+        if(*end != '\0') {
+            return -1;
+        }
+        terms.push_back(term);
+    }
+    return terms.empty() ? -1 : 0;
+}
+
+/**
+ * add the mtime and size records of an inode to txn, replacing the ones of its last write back
+ */
+void rocksdb_fs::stage_index(rfs_txn &txn, uint64_t ino, inode_t *inode) {
+    WriteBatch& batch = txn.batch(shard_of(ino));
+    rocksdb::ColumnFamilyHandle* cf = index_of(ino);
+    if(!inode->written || inode->written_mtime != inode->mtime.tv_sec) {
+        if(inode->written) batch.Delete(cf, value_key('m', mtime_val(inode->written_mtime), ino));
+        batch.Put(cf, value_key('m', mtime_val(inode->mtime.tv_sec), ino), Slice());
+    }
+    if(!inode->written || inode->written_sz != inode->file_sz) {
+        if(inode->written) batch.Delete(cf, value_key('s', inode->written_sz, ino));
+        batch.Put(cf, value_key('s', inode->file_sz, ino), Slice());
+    }
+}
+
+/**
+ * add the entry pointing at ino and the tokens of its name to txn
+ * @param old_name the name the entry had before a rename, its tokens are dropped
+ */
+void rocksdb_fs::stage_entry(rfs_txn &txn, uint64_t ino, uint64_t parent, string_view name, string_view old_name) {
+    WriteBatch& batch = txn.batch(shard_of(ino));
+    rocksdb::ColumnFamilyHandle* cf = index_of(ino);
+    for(auto& t : name_tokens(old_name)) {
+        batch.Delete(cf, token_key(t, ino));
+    }
+    for(auto& t : name_tokens(name)) {
+        batch.Put(cf, token_key(t, ino), Slice());
+    }
+    string val;
+    put_be(val, parent);
+    val.append(name);
+    batch.Put(cf, entry_key(ino), val);
+}
+
+/**
+ * add the dropping of every record of an inode in the index to batch, batch goes to the inode's shard
+ * @param inode as stored, nullptr if it isn't
+ */
+void rocksdb_fs::drop_index(WriteBatch &batch, uint64_t ino, inode_t *inode) {
+    rocksdb::ColumnFamilyHandle* cf = index_of(ino);
+    string rV;
+    if(db_of(ino)->Get(ReadOptions(), cf, entry_key(ino), &rV).ok() && rV.size() >= sizeof(uint64_t)) {
+        for(auto& t : name_tokens(string_view(rV).substr(sizeof(uint64_t)))) {
+            batch.Delete(cf, token_key(t, ino));
+        }
+        batch.Delete(cf, entry_key(ino));
+    }
+    if(inode != nullptr && inode->written) {
+        batch.Delete(cf, value_key('m', mtime_val(inode->written_mtime), ino));
+        batch.Delete(cf, value_key('s', inode->written_sz, ino));
+    }
+}
+
+/**
+ * add the dropping of an unlinked inode's records in the index to txn, they go with the entry that pointed at it.
+ * drop_inode drops what a batch staged for it meanwhile
+ */
+void rocksdb_fs::stage_unindex(rfs_txn &txn, uint64_t ino) {
+    if(indexes.empty()) {
+        return;
+    }
+    auto inode = unique_ptr<inode_t>(read_inode(ino));
+    drop_index(txn.batch(shard_of(ino)), ino, inode.get());
+}
+
+/**
+ * index every inode, for a volume that wasn't indexed until now or whose indexing a crash interrupted.
+ * whatever was indexed is dropped first, the batches of each shard are written as they fill up
+ */
+int rocksdb_fs::build_index() {
+    string rV;
+    if(shards[0]->Get(ReadOptions(), indexes[0], INDEX_KEY, &rV).ok()) {
+        return 0;
+    }
+    for(size_t i = 0;i < shards.size();i++) {
+        if(!shards[i]->DeleteRange(WriteOptions(), indexes[i], "", "\xff").ok()) return -1;
+    }
+
+    rfs_txn txn;
+    auto root = unique_ptr<inode_t>(read_inode(ROOT_DENTRY_INO));
+    if(root == nullptr) {
+        return -1;
+    }
+    root->written = false;
+    stage_index(txn, ROOT_DENTRY_INO, root.get());
+    if(index_tree(txn, ROOT_DENTRY_INO) != 0) {
+        return -1;
+    }
+    for(auto& b : txn.batches) {
+        if(!shards[b.first]->Write(WriteOptions(), &b.second).ok()) return -1;
+    }
+    // once every shard has its part, a crash before has it built again
+    return shards[0]->Put(WriteOptions(), indexes[0], INDEX_KEY, Slice()).ok() ? 0 : -1;
+}
+
+/**
+ * add the records of everything below a directory to txn
+ */
+int rocksdb_fs::index_tree(rfs_txn &txn, uint64_t ino) {
+    auto inode = unique_ptr<inode_t>(read_inode(ino));
+    if(inode == nullptr) {
+        return -1;
+    }
+    size_t dir_cnt = inode->dentry_cnt();
+    for(size_t i = 0;i < dir_cnt;i++) {
+        rfs_dentry_d* d = inode->dentry_at(i);
+        auto child = unique_ptr<inode_t>(read_inode(d->ino));
+        if(child == nullptr) continue;
+        // nothing of it is indexed yet
+        child->written = false;
+        stage_entry(txn, d->ino, ino, d->get_name());
+        stage_index(txn, d->ino, child.get());
+        WriteBatch& batch = txn.batch(shard_of(d->ino));
+        if(batch.GetDataSize() >= DIRTY_FLUSH_THRESHOLD) {
+            if(!db_of(d->ino)->Write(WriteOptions(), &batch).ok()) return -1;
+            batch.Clear();
+        }
+        if(d->ftype == dir && index_tree(txn, d->ino) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * the path of an inode, from the entries pointing at it and at the directories above
+ * @return -1 if one is missing, the inode isn't linked any more
+ */
+int rocksdb_fs::entry_path(uint64_t ino, string &path) {
+    vector<string> names;
+    string rV;
+    while(ino != ROOT_DENTRY_INO) {
+        // a loop left by a crash mid rename ends somewhere
+        if(names.size() > 4096 || !db_of(ino)->Get(ReadOptions(), index_of(ino), entry_key(ino), &rV).ok()
+           || rV.size() < sizeof(uint64_t)) {
+            return -1;
+        }
+        names.push_back(rV.substr(sizeof(uint64_t)));
+        ino = get_be(rV.data());
+    }
+    path.clear();
+    for(auto it = names.rbegin();it != names.rend();it++) {
+        path.append("/").append(*it);
+    }
+    if(path.empty()) {
+        path = "/";
+    }
+    return 0;
+}
+
+/**
+ * answer a query with a range scan of the index of each shard instead of a walk of the tree. the first term
+ * picks the range, the inodes in it are checked against the others. a name scans the entries of a token of it,
+ * or all of them. the inodes are matched as they were last written back
+ * @param out the paths matching, a line each
+ */
+int rocksdb_fs::find(string_view query, string &out) {
+    vector<find_term> terms;
+    if(parse_query(query, terms) != 0) {
+        return -EINVAL;
+    }
+    const find_term& first = terms[0];
+    string token = first.type == 'n' ? glob_token(first.pattern) : "";
+
+    string beg, end;
+    if(first.type == 'n') {
+        beg = token.empty() ? "p" : "n" + token;
+        end = token.empty() ? "q" : beg;
+        if(!token.empty()) end.back()++;
+    } else if(first.op == '>') {
+        if(first.val == UINT64_MAX) return 0;
+        beg = value_key(first.type, first.val + 1, 0);
+        end = string(1, first.type + 1);
+    } else {
+        beg = string(1, first.type);
+        end = value_key(first.type, first.val, 0);
+    }
+
+    string path, rV;
+    for(size_t i = 0;i < shards.size();i++) {
+        Slice upper(end);
+        ReadOptions opts;
+        opts.iterate_upper_bound = &upper;
+        auto it = unique_ptr<rocksdb::Iterator>(shards[i]->NewIterator(opts, indexes[i]));
+        std::set<uint64_t> seen; // a token scanned by its prefix may be several of the name's
+        for(it->Seek(beg); it->Valid(); it->Next()) {
+            Slice key = it->key();
+            if(key.size() < 1 + sizeof(uint64_t)) continue;
+            uint64_t ino = get_be(key.data() + key.size() - sizeof(uint64_t));
+            if(!seen.insert(ino).second) continue;
+
+            unique_ptr<inode_t> inode;
+            bool match = true;
+            for(auto& t : terms) {
+                if(t.type == 'n') {
+                    if(!shards[i]->Get(ReadOptions(), indexes[i], entry_key(ino), &rV).ok() || rV.size() < sizeof(uint64_t)
+                       || fnmatch(t.pattern.c_str(), rV.c_str() + sizeof(uint64_t), 0) != 0) {
+                        match = false;
+                    }
+                } else {
+                    if(inode == nullptr) inode = unique_ptr<inode_t>(read_inode(ino));
+                    if(inode == nullptr) {
+                        match = false;
+                        break;
+                    }
+                    uint64_t val = t.type == 'm' ? mtime_val(inode->mtime.tv_sec) : inode->file_sz;
+                    match = t.op == '>' ? val > t.val : val < t.val;
+                }
+                if(!match) break;
+            }
+            if(match && entry_path(ino, path) == 0) {
+                out.append(path).append("\n");
+            }
+        }
+        if(!it->status().ok()) {
+            return -EIO;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @param query set to what follows RFS_FIND_DIR, empty for the directory itself
+ * @return whether path is RFS_FIND_DIR or a query in it, never if the fs isn't indexed
+ */
+bool rocksdb_fs::is_find_path(string_view path, string_view &query) {
+    string_view dir = RFS_FIND_DIR;
+    if(indexes.empty() || path.substr(0, dir.size()) != dir) {
+        return false;
+    }
+    if(path.size() == dir.size()) {
+        query = string_view();
+        return true;
+    }
+    if(path[dir.size()] != '/') {
+        return false;
+    }
+    query = path.substr(dir.size() + 1);
+    return true;
+}
+
+/**
+ * a query reads as an empty file, it's only run once opened
+ */
+int rocksdb_fs::find_getattr(string_view query, struct stat *stat) {
+    memset(stat, 0, sizeof(*stat));
+    stat->st_mode = query.empty() ? S_IFDIR | 0555 : S_IFREG | 0444;
+    stat->st_nlink = query.empty() ? 2 : 1;
+    stat->st_uid = getuid();
+    stat->st_gid = getgid();
+    clock_gettime(CLOCK_REALTIME, &stat->st_mtim);
+    stat->st_atim = stat->st_ctim = stat->st_mtim;
+    return 0;
+}
+
+/**
+ * run a query, its result is read through the handle until it's released. direct io makes the
+ * kernel read past the size of 0 getattr gave
+ */
+int rocksdb_fs::find_open(string_view query, fuse_file_info *fi) {
+    if(query.empty()) {
+        return -EISDIR;
+    }
+    if((fi->flags & O_ACCMODE) != O_RDONLY) {
+        return -EACCES;
+    }
+    string out;
+    int ret = find(query, out);
+    if(ret != 0) {
+        return ret;
+    }
+    unique_lock<mutex> l(find_lock);
+    fi->fh = RFS_FIND_FH | ++find_seq;
+    fi->direct_io = 1;
+    finds[fi->fh] = std::move(out);
+    return 0;
+}
+
+int rocksdb_fs::find_read(char *buf, size_t size, off_t offset, fuse_file_info *fi) {
+    unique_lock<mutex> l(find_lock);
+    auto f = finds.find(fi->fh);
+    if(f == finds.end()) {
+        return -EBADF;
+    }
+    if(offset < 0 || (size_t)offset >= f->second.size()) {
+        return 0;
+    }
+    size = std::min(size, f->second.size() - offset);
+    memcpy(buf, f->second.data() + offset, size);
+    return size;
+}
@@ -0,0 +1,169 @@
+//
+// Created by aln0 on 4/14/23.
+//
+
+#include "rfs_inode_cache.h"
+
+using std::unique_lock;
+using std::mutex;
+
+// the protected segment takes up to this share of the budget
+#define PROTECT_RATIO 0.8
+// slots the inos are spread over to tell whether one was written or dropped meanwhile
+#define STAMP_SLOTS 1024
+
+rfs_inode_cache::rfs_inode_cache(size_t capacity) {
+    this->capacity = capacity;
+    this->protect_cap = capacity * PROTECT_RATIO;
+    this->usage = 0;
+    this->protect_usage = 0;
+    this->stamps.assign(STAMP_SLOTS, 0);
+}
+
+void rfs_inode_cache::bump(uint64_t ino) {
+    stamps[ino % STAMP_SLOTS]++;
+}
+
+/**
+ * taken before an inode is read from db, fill drops the value read if the inode was written or dropped since
+ */
+uint64_t rfs_inode_cache::stamp(uint64_t ino) {
+    unique_lock<mutex> l(lock);
+    return stamps[ino % STAMP_SLOTS];
+}
+
+/**
+ * bytes an entry holds, bookkeeping included
+ */
+size_t rfs_inode_cache::charge(const entry &e) {
+    return e.val.capacity() + sizeof(entry) + 4 * sizeof(void*);
+}
+
+/**
+ * @return a copy of the cached inode, nullptr on miss
+ */
+inode_t* rfs_inode_cache::get(uint64_t ino) {
+    unique_lock<mutex> l(lock);
+    auto it = index.find(ino);
+    if(it == index.end()) {
+        return nullptr;
+    }
+
+    entry_it e = it->second;
+    if(e->protect) {
+        protect.splice(protect.begin(), protect, e);
+    } else {
+        // second hit, promote and demote the protected tail if the segment overflows
+        e->protect = true;
+        protect.splice(protect.begin(), probation, e);
+        protect_usage += charge(*e);
+        while(protect_usage > protect_cap && protect.size() > 1) {
+            entry_it tail = std::prev(protect.end());
+            tail->protect = false;
+            protect_usage -= charge(*tail);
+            probation.splice(probation.begin(), protect, tail);
+        }
+    }
+    return new inode_t(e->val.data(), e->val.size());
+}
+
+/**
+ * cache the stored form of an inode once it's written
+ */
+void rfs_inode_cache::put(uint64_t ino, const rocksdb::Slice &val) {
+    if(capacity == 0) {
+        return;
+    }
+
+    unique_lock<mutex> l(lock);
+    bump(ino);
+    auto it = index.find(ino);
+    if(it != index.end()) {
+        entry_it e = it->second;
+        size_t old = charge(*e);
+        e->val.assign(val.data(), val.size());
+        usage += charge(*e) - old;
+        if(e->protect) {
+            protect_usage += charge(*e) - old;
+        }
+    } else {
+        probation.push_front({ino, val.ToString(), false});
+        index[ino] = probation.begin();
+        usage += charge(probation.front());
+    }
+    evict();
+}
+
+/**
+ * cache an inode read from db, unless it's cached already or was written or dropped after stamp was taken
+ */
+void rfs_inode_cache::fill(uint64_t ino, const rocksdb::Slice &val, uint64_t stamp) {
+    if(capacity == 0) {
+        return;
+    }
+
+    unique_lock<mutex> l(lock);
+    if(stamps[ino % STAMP_SLOTS] != stamp || index.count(ino) != 0) {
+        return;
+    }
+    probation.push_front({ino, val.ToString(), false});
+    index[ino] = probation.begin();
+    usage += charge(probation.front());
+    evict();
+}
+
+void rfs_inode_cache::erase(uint64_t ino) {
+    unique_lock<mutex> l(lock);
+    bump(ino);
+    auto it = index.find(ino);
+    if(it == index.end()) {
+        return;
+    }
+
+    entry_it e = it->second;
+    usage -= charge(*e);
+    if(e->protect) {
+        protect_usage -= charge(*e);
+        protect.erase(e);
+    } else {
+        probation.erase(e);
+    }
+    index.erase(it);
+}
+
+/**
+ * drop least recently used entries until the cache fits its budget, probationary ones go first
+ */
+void rfs_inode_cache::evict() {
+    while(usage > capacity && !index.empty()) {
+        bool from_protect = probation.empty();
+        std::list<entry>& seg = from_protect ? protect : probation;
+        entry_it tail = std::prev(seg.end());
+        usage -= charge(*tail);
+        if(from_protect) {
+            protect_usage -= charge(*tail);
+        }
+        index.erase(tail->ino);
+        seg.erase(tail);
+    }
+}
+
+size_t rfs_inode_cache::get_usage() {
+    unique_lock<mutex> l(lock);
+    return usage;
+}
+
+/**
+ * the inos of up to n entries, the protected ones first and most recently used first in each segment
+ */
+std::vector<uint64_t> rfs_inode_cache::hottest(size_t n) {
+    unique_lock<mutex> l(lock);
+    std::vector<uint64_t> inos;
+    for(auto seg : {&protect, &probation}) {
+        for(auto& e : *seg) {
+            if(inos.size() >= n) return inos;
+            inos.push_back(e.ino);
+        }
+    }
+    return inos;
+}
@@ -0,0 +1,53 @@
+//
+// Created by aln0 on 4/14/23.
+//
+
+#ifndef ROCKS_FUSE_RFS_INODE_CACHE_H
+#define ROCKS_FUSE_RFS_INODE_CACHE_H
+
+#include "rocksdb/slice.h"
+#include "types.h"
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * byte budgeted cache of written back inodes, as they are stored in db, so an inode read again skips db.
+ * segmented LRU: an inode enters the probationary segment and is promoted to the protected one on its
+ * second hit, a scan of inodes read once only churns the probationary segment
+ */
+class rfs_inode_cache {
+private:
+    struct entry {
+        uint64_t ino;
+        string val;
+        bool protect;
+    };
+    typedef std::list<entry>::iterator entry_it;
+
+    std::list<entry> probation, protect; // most recently used first
+    std::unordered_map<uint64_t, entry_it> index;
+    size_t capacity, protect_cap;
+    size_t usage, protect_usage;
+    std::vector<uint64_t> stamps; // bumped by the puts and erases of the inos of a slot
+    std::mutex lock;
+
+    void bump(uint64_t ino);
+
+    static size_t charge(const entry& e);
+    void evict();
+
+public:
+    explicit rfs_inode_cache(size_t capacity);
+
+    inode_t* get(uint64_t ino);
+    uint64_t stamp(uint64_t ino);
+    void put(uint64_t ino, const rocksdb::Slice& val);
+    void fill(uint64_t ino, const rocksdb::Slice& val, uint64_t stamp);
+    void erase(uint64_t ino);
+    size_t get_usage();
+    std::vector<uint64_t> hottest(size_t n);
+};
+
+#endif //ROCKS_FUSE_RFS_INODE_CACHE_H
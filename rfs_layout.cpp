@@ -0,0 +1,85 @@
+//
+// Created by aln0 on 5/2/23.
+//
+
+#include "rfs_layout.h"
+#include "rocksdb/convenience.h"
+#include "rocksdb/db.h"
+#include "rocksdb/slice_transform.h"
+#include "rocksdb/table.h"
+#include "rocksdb/utilities/options_util.h"
+
+using std::vector;
+
+/**
+ * which column families there are comes from the manifest, how they're stored from the last OPTIONS file.
+ * a meta column family from before its tables were told apart is of plain ones
+ */
+rfs_layout read_layout(const string& path) {
+    rfs_layout layout;
+    vector<string> names;
+    if(!rocksdb::DB::ListColumnFamilies(rocksdb::DBOptions(), path, &names).ok()) {
+        return layout;
+    }
+    layout.meta = std::count(names.begin(), names.end(), META_CF) > 0;
+    layout.plain_meta = layout.meta;
+    layout.index = std::count(names.begin(), names.end(), INDEX_CF) > 0;
+
+    rocksdb::ConfigOptions config;
+    config.ignore_unknown_options = true;
+    rocksdb::DBOptions db_opts;
+    vector<rocksdb::ColumnFamilyDescriptor> descs;
+    if(!rocksdb::LoadLatestOptions(config, path, &db_opts, &descs).ok()) {
+        return layout;
+    }
+    for(auto& d : descs) {
+        if(d.name == META_CF && d.options.table_factory != nullptr) {
+            layout.plain_meta = strcmp(d.options.table_factory->Name(), "PlainTable") == 0;
+        } else if(d.name == rocksdb::kDefaultColumnFamilyName && d.options.cf_paths.size() > 1) {
+            layout.cold_path = d.options.cf_paths[1].path;
+            layout.hot_sz = d.options.cf_paths[0].target_size;
+        }
+    }
+    return layout;
+}
+
+/**
+ * inodes and the super block are only ever looked up by their whole key. a plain table keeps a hash index of the
+ * keys in memory and points into the mmapped file, a lookup is a bloom check and a hash probe with no block to
+ * find, read or decompress
+ */
+rocksdb::ColumnFamilyOptions plain_meta_options(const rocksdb::Options& options) {
+    rocksdb::ColumnFamilyOptions meta(options);
+    rocksdb::PlainTableOptions plain;
+    plain.user_key_len = rocksdb::kPlainTableVariableLength;
+    plain.bloom_bits_per_key = 10;
+    plain.hash_table_ratio = 0.75;
+    meta.table_factory.reset(rocksdb::NewPlainTableFactory(plain));
+    // the whole key is the prefix, inode keys are never scanned
+    meta.prefix_extractor.reset(rocksdb::NewNoopTransform());
+    meta.memtable_prefix_bloom_size_ratio = 0.1;
+    return meta;
+}
+
+/**
+ * file data of a tiered shard fills path up to hot_sz by level, the levels below go to its cold path. the other
+ * column families are on path alone, a block based meta one keeps tiered inodes there without mmap
+ */
+vector<rocksdb::ColumnFamilyDescriptor> layout_cfs(rocksdb::Options& options, const string& path,
+                                                   const rfs_layout& layout) {
+    if(layout.plain_meta) {
+        // plain tables are read through mmap, the blocks of the other column families are then too
+        options.allow_mmap_reads = true;
+    }
+    vector<rocksdb::ColumnFamilyDescriptor> cfs = {{rocksdb::kDefaultColumnFamilyName, options}};
+    if(!layout.cold_path.empty()) {
+        cfs[0].options.cf_paths = {{path, layout.hot_sz}, {layout.cold_path, UINT64_MAX}};
+    }
+    if(layout.meta) {
+        cfs.emplace_back(META_CF, layout.plain_meta ? plain_meta_options(options) : rocksdb::ColumnFamilyOptions(options));
+    }
+    if(layout.index) {
+        cfs.emplace_back(INDEX_CF, options);
+    }
+    return cfs;
+}
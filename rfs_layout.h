@@ -0,0 +1,41 @@
+//
+// Created by aln0 on 5/2/23.
+//
+
+#ifndef ROCKS_FUSE_RFS_LAYOUT_H
+#define ROCKS_FUSE_RFS_LAYOUT_H
+
+#include "rocksdb/options.h"
+#include "types.h"
+#include <vector>
+
+/**
+ * how the column families of a shard are laid out. rocksdb keeps the options it was opened with in an OPTIONS
+ * file next to it, the layout is read back from there so that the mount and the tools open a shard alike
+ */
+struct rfs_layout {
+    bool meta = false; // inodes and the super block are in META_CF
+    bool plain_meta = false; // of plain tables, read through mmap
+    bool index = false; // INDEX_CF is there
+    string cold_path; // of the shard, where the levels of file data past hot_sz are. empty if not tiered
+    uint64_t hot_sz = 0;
+};
+
+/**
+ * the layout of the shard at path, a fresh one has none
+ */
+rfs_layout read_layout(const string& path);
+
+/**
+ * the plain tables inodes are kept in with meta_in_memory
+ */
+rocksdb::ColumnFamilyOptions plain_meta_options(const rocksdb::Options& options);
+
+/**
+ * the column families to open a shard with layout by, each from options. plain tables need mmap reads,
+ * options gets them then
+ */
+std::vector<rocksdb::ColumnFamilyDescriptor> layout_cfs(rocksdb::Options& options, const string& path,
+                                                        const rfs_layout& layout);
+
+#endif //ROCKS_FUSE_RFS_LAYOUT_H
@@ -0,0 +1,621 @@
+//
+// Created by aln0 on 5/6/23.
+//
+
+#include "rfs_lowlevel.h"
+#include <fcntl.h>
+#include <unordered_map>
+
+// seconds the kernel keeps attributes and entries, what the high level session defaults to
+#define RFS_TIMEOUT 1.0
+
+/**
+ * the kernel names files by node ids, the fs by path. a node is the ino of a file looked up, kept until the
+ * kernel forgets as many lookups as it was replied. paths are rebuilt from the names of the nodes up to the
+ * root. the entries of RFS_FIND_DIR have no ino, they get ids of their own with RFS_FIND_FH set
+ */
+struct rfs_node {
+    fuse_ino_t parent;
+    string name;
+    uint64_t nlookup;
+    bool unlinked; // the name it had is kept for releasedir
+};
+
+static rfs_session_conf sc;
+static fuse_session* session;
+static mutex node_lock;
+static std::unordered_map<fuse_ino_t, rfs_node> nodes = {{FUSE_ROOT_ID, {0, "", 1, false}}};
+static map<std::pair<fuse_ino_t, string>, fuse_ino_t> names; // the node of each name linked
+static uint64_t find_nodes = 0;
+
+/**
+ * @param unlinked whether the path an unlinked node had is returned rather than an empty one
+ * @return empty if the node is unknown
+ */
+static string node_path(fuse_ino_t ino, bool unlinked = false) {
+    unique_lock<mutex> l(node_lock);
+    vector<const string*> parts;
+    while(ino != FUSE_ROOT_ID) {
+        auto n = nodes.find(ino);
+        if(n == nodes.end() || (n->second.unlinked && !unlinked)) {
+            return "";
+        }
+        parts.push_back(&n->second.name);
+        ino = n->second.parent;
+    }
+    string path;
+    for(auto p = parts.rbegin();p != parts.rend();p++) {
+        path += '/';
+        path += **p;
+    }
+    return path.empty() ? "/" : path;
+}
+
+static string child_path(fuse_ino_t parent, const char* name) {
+    string path = node_path(parent);
+    if(path.empty()) {
+        return path;
+    }
+    if(path.size() > 1) path += '/';
+    return path + name;
+}
+
+/**
+ * unlink the node of a name, node_lock held
+ */
+static void drop_name(fuse_ino_t parent, const string& name) {
+    auto it = names.find({parent, name});
+    if(it == names.end()) {
+        return;
+    }
+    auto n = nodes.find(it->second);
+    if(n != nodes.end()) n->second.unlinked = true;
+    names.erase(it);
+}
+
+/**
+ * a lookup of ino replied to the kernel
+ */
+static void remember(fuse_ino_t ino, fuse_ino_t parent, const char* name) {
+    unique_lock<mutex> l(node_lock);
+    auto it = nodes.find(ino);
+    if(it == nodes.end()) {
+        it = nodes.emplace(ino, rfs_node{parent, name, 0, true}).first;
+    }
+    rfs_node& n = it->second;
+    n.nlookup++;
+    if(ino == FUSE_ROOT_ID || (!n.unlinked && n.parent == parent && n.name == name)) {
+        return;
+    }
+    if(!n.unlinked) names.erase({n.parent, n.name});
+    drop_name(parent, name);
+    n.parent = parent;
+    n.name = name;
+    n.unlinked = false;
+    names[{parent, name}] = ino;
+}
+
+static void forget(fuse_ino_t ino, uint64_t nlookup) {
+    unique_lock<mutex> l(node_lock);
+    auto n = nodes.find(ino);
+    if(n == nodes.end() || ino == FUSE_ROOT_ID) {
+        return;
+    }
+    n->second.nlookup -= std::min(nlookup, n->second.nlookup);
+    if(n->second.nlookup == 0) {
+        if(!n->second.unlinked) names.erase({n->second.parent, n->second.name});
+        nodes.erase(n);
+    }
+}
+
+static void unlinked(fuse_ino_t parent, const char* name) {
+    unique_lock<mutex> l(node_lock);
+    drop_name(parent, name);
+}
+
+static void moved(fuse_ino_t parent, const char* name, fuse_ino_t new_parent, const char* new_name) {
+    unique_lock<mutex> l(node_lock);
+    auto it = names.find({parent, name});
+    if(it == names.end()) {
+        return;
+    }
+    fuse_ino_t ino = it->second;
+    names.erase(it);
+    // what the rename replaced goes
+    drop_name(new_parent, new_name);
+    rfs_node& n = nodes[ino];
+    n.parent = new_parent;
+    n.name = new_name;
+    names[{new_parent, new_name}] = ino;
+}
+
+static rfs_tracer* tracer() {
+    return *sc.tracer;
+}
+
+/**
+ * an op traced from its call to its deferred reply, it owns what its scope points to
+ */
+struct rfs_deferred_trace {
+    string path;
+    fuse_file_info fi;
+    rfs_trace_scope scope;
+
+    rfs_deferred_trace(rfs_tracer* t, rfs_op op, string p, const fuse_file_info* f, int64_t off, uint64_t size)
+            : path(std::move(p)), fi(f != nullptr ? *f : fuse_file_info()),
+              scope(t, op, path.c_str(), f != nullptr ? &fi : nullptr, off, size) {}
+};
+
+/**
+ * nullptr unless ops are traced, the path is only rebuilt for the trace
+ */
+static shared_ptr<rfs_deferred_trace> trace_later(rfs_op op, fuse_ino_t ino, const char* name,
+                                                  const fuse_file_info* fi = nullptr, int64_t off = 0,
+                                                  uint64_t size = 0) {
+    rfs_tracer* t = tracer();
+    if(t == nullptr || !t->on()) {
+        return nullptr;
+    }
+    return make_shared<rfs_deferred_trace>(t, op, name != nullptr ? child_path(ino, name) : node_path(ino), fi,
+                                           off, size);
+}
+
+static void fill_entry(fuse_entry_param* e, fuse_ino_t ino, const struct stat* stat) {
+    memset(e, 0, sizeof(*e));
+    e->ino = ino;
+    e->attr = *stat;
+    e->attr.st_ino = ino;
+    e->attr_timeout = RFS_TIMEOUT;
+    e->entry_timeout = RFS_TIMEOUT;
+}
+
+/**
+ * the entry of a file just made, remembered like a lookup of it
+ */
+static int new_entry(fuse_ino_t parent, const char* name, const string& path, fuse_entry_param* e) {
+    struct stat stat = {};
+    int ret = sc.fs->getattr(path.c_str(), &stat);
+    if(ret != 0) {
+        return ret;
+    }
+    remember(stat.st_ino, parent, name);
+    fill_entry(e, stat.st_ino, &stat);
+    return 0;
+}
+
+static int keep_cache(int ret, fuse_file_info* fi) {
+    if(ret == 0 && sc.keep_cache && (fi->flags & O_DIRECT) == 0) {
+        fi->keep_cache = 1;
+    }
+    return ret;
+}
+
+static void rfs_ll_init(void* userdata, fuse_conn_info* conn) {
+    if(sc.start(conn) != 0) {
+        fuse_session_exit(session);
+    }
+}
+
+static void rfs_ll_destroy(void* userdata) {
+    sc.stop();
+}
+
+/**
+ * the entries of RFS_FIND_DIR are looked up on the spot, the others once the reads of their parents
+ * and inodes are done together with those of other ops
+ */
+static void rfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char* name) {
+    if((parent & RFS_FIND_FH) || (parent == FUSE_ROOT_ID && strcmp(name, RFS_FIND_DIR + 1) == 0)) {
+        string path = child_path(parent, name);
+        rfs_trace_scope t(tracer(), op_getattr, path.c_str());
+        struct stat stat = {};
+        int ret = t.done(path.empty() ? -ENOENT : sc.fs->getattr(path.c_str(), &stat));
+        if(ret != 0) {
+            fuse_reply_err(req, -ret);
+            return;
+        }
+        if(stat.st_ino == 0) {
+            unique_lock<mutex> l(node_lock);
+            stat.st_ino = RFS_FIND_FH | ++find_nodes;
+        }
+        fuse_entry_param e;
+        remember(stat.st_ino, parent, name);
+        fill_entry(&e, stat.st_ino, &stat);
+        fuse_reply_entry(req, &e);
+        return;
+    }
+    auto t = trace_later(op_getattr, parent, name);
+    sc.fs->lookup_async(parent, name, [req, parent, n = string(name), t](int ret, const struct stat* stat) {
+        if(t != nullptr) t->scope.done(ret);
+        if(ret != 0) {
+            fuse_reply_err(req, -ret);
+            return;
+        }
+        fuse_entry_param e;
+        remember(stat->st_ino, parent, n.c_str());
+        fill_entry(&e, stat->st_ino, stat);
+        fuse_reply_entry(req, &e);
+    });
+}
+
+static void rfs_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+    forget(ino, nlookup);
+    fuse_reply_none(req);
+}
+
+static void rfs_ll_forget_multi(fuse_req_t req, size_t count, fuse_forget_data* forgets) {
+    for(size_t i = 0;i < count;i++) {
+        forget(forgets[i].ino, forgets[i].nlookup);
+    }
+    fuse_reply_none(req);
+}
+
+static void rfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, fuse_file_info* fi) {
+    if(ino & RFS_FIND_FH) {
+        string path = node_path(ino);
+        rfs_trace_scope t(tracer(), op_getattr, path.c_str());
+        struct stat stat = {};
+        int ret = t.done(path.empty() ? -ENOENT : sc.fs->getattr(path.c_str(), &stat));
+        stat.st_ino = ino;
+        if(ret != 0) fuse_reply_err(req, -ret);
+        else fuse_reply_attr(req, &stat, RFS_TIMEOUT);
+        return;
+    }
+    auto t = trace_later(op_getattr, ino, nullptr);
+    sc.fs->getattr_async(ino, [req, t](int ret, const struct stat* stat) {
+        if(t != nullptr) t->scope.done(ret);
+        if(ret != 0) fuse_reply_err(req, -ret);
+        else fuse_reply_attr(req, stat, RFS_TIMEOUT);
+    });
+}
+
+/**
+ * the changes are made in the order the high level session makes them: mode, owner, size, then times
+ */
+static void rfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int to_set, fuse_file_info* fi) {
+    string path = node_path(ino);
+    if(path.empty()) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    const char* p = path.c_str();
+    int ret = 0;
+    if(to_set & FUSE_SET_ATTR_MODE) {
+        rfs_trace_scope t(tracer(), op_chmod, p, nullptr, 0, 0, attr->st_mode);
+        ret = t.done(sc.fs->chmod(p, attr->st_mode));
+    }
+    if(ret == 0 && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))) {
+        uid_t uid = to_set & FUSE_SET_ATTR_UID ? attr->st_uid : (uid_t)-1;
+        gid_t gid = to_set & FUSE_SET_ATTR_GID ? attr->st_gid : (gid_t)-1;
+        rfs_trace_scope t(tracer(), op_chown, p, nullptr, 0, gid, uid);
+        ret = t.done(sc.fs->chown(p, uid, gid));
+    }
+    if(ret == 0 && (to_set & FUSE_SET_ATTR_SIZE)) {
+        rfs_trace_scope t(tracer(), op_truncate, p, fi, 0, attr->st_size);
+        ret = t.done(sc.fs->truncate(p, attr->st_size, fi));
+    }
+    if(ret == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+        timespec tv[2] = {{0, UTIME_OMIT}, {0, UTIME_OMIT}};
+        if(to_set & FUSE_SET_ATTR_ATIME) tv[0] = to_set & FUSE_SET_ATTR_ATIME_NOW ? timespec{0, UTIME_NOW} : attr->st_atim;
+        if(to_set & FUSE_SET_ATTR_MTIME) tv[1] = to_set & FUSE_SET_ATTR_MTIME_NOW ? timespec{0, UTIME_NOW} : attr->st_mtim;
+        rfs_trace_scope t(tracer(), op_utimens, p, nullptr, rfs_utime_ns(tv[0]), rfs_utime_ns(tv[1]),
+                          rfs_utime_bits(tv[0]) | rfs_utime_bits(tv[1]) << 2);
+        ret = t.done(sc.fs->utimens(p, tv));
+    }
+    struct stat stat = {};
+    if(ret == 0) {
+        ret = sc.fs->getattr(p, &stat);
+    }
+    stat.st_ino = ino;
+    if(ret != 0) fuse_reply_err(req, -ret);
+    else fuse_reply_attr(req, &stat, RFS_TIMEOUT);
+}
+
+static void rfs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode, dev_t rdev) {
+    string path = child_path(parent, name);
+    if(path.empty()) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    rfs_trace_scope t(tracer(), op_mknod, path.c_str(), nullptr, 0, 0, mode);
+    const fuse_ctx* ctx = fuse_req_ctx(req);
+    int ret = t.done(sc.fs->mknod(path.c_str(), mode, ctx->uid, ctx->gid));
+    fuse_entry_param e;
+    if(ret == 0) ret = new_entry(parent, name, path, &e);
+    if(ret != 0) fuse_reply_err(req, -ret);
+    else fuse_reply_entry(req, &e);
+}
+
+static void rfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode) {
+    string path = child_path(parent, name);
+    if(path.empty()) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    rfs_trace_scope t(tracer(), op_mkdir, path.c_str(), nullptr, 0, 0, mode);
+    const fuse_ctx* ctx = fuse_req_ctx(req);
+    int ret = t.done(sc.fs->mkdir(path.c_str(), mode, ctx->uid, ctx->gid));
+    fuse_entry_param e;
+    if(ret == 0) ret = new_entry(parent, name, path, &e);
+    if(ret != 0) fuse_reply_err(req, -ret);
+    else fuse_reply_entry(req, &e);
+}
+
+static void rfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char* name) {
+    string path = child_path(parent, name);
+    rfs_trace_scope t(tracer(), op_unlink, path.c_str());
+    int ret = t.done(path.empty() ? -ENOENT : sc.fs->unlink(path.c_str()));
+    if(ret == 0) unlinked(parent, name);
+    fuse_reply_err(req, -ret);
+}
+
+static void rfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char* name) {
+    string path = child_path(parent, name);
+    rfs_trace_scope t(tracer(), op_rmdir, path.c_str());
+    int ret = t.done(path.empty() ? -ENOENT : sc.fs->rmdir(path.c_str()));
+    if(ret == 0) unlinked(parent, name);
+    fuse_reply_err(req, -ret);
+}
+
+/**
+ * RENAME_NOREPLACE and RENAME_EXCHANGE aren't supported
+ */
+static void rfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char* name, fuse_ino_t new_parent,
+                          const char* new_name, unsigned int flags) {
+    if(flags != 0) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+    string from = child_path(parent, name), to = child_path(new_parent, new_name);
+    rfs_trace_scope t(tracer(), op_rename, from.c_str());
+    t.second(to.c_str());
+    int ret = t.done(from.empty() || to.empty() ? -ENOENT : sc.fs->rename(from.c_str(), to.c_str()));
+    if(ret == 0) moved(parent, name, new_parent, new_name);
+    fuse_reply_err(req, -ret);
+}
+
+static void rfs_ll_open(fuse_req_t req, fuse_ino_t ino, fuse_file_info* fi) {
+    string path = node_path(ino);
+    rfs_trace_scope t(tracer(), op_open, path.c_str(), fi);
+    int ret = t.done(path.empty() ? -ENOENT : keep_cache(sc.fs->open(path.c_str(), fi), fi));
+    if(ret != 0) fuse_reply_err(req, -ret);
+    else fuse_reply_open(req, fi);
+}
+
+static void rfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, fuse_file_info* fi) {
+    auto t = trace_later(op_read, ino, nullptr, fi, off, size);
+    sc.fs->read_async(size, off, fi, [req, t](int ret, const char* buf) {
+        if(t != nullptr) t->scope.done(ret);
+        if(ret < 0) fuse_reply_err(req, -ret);
+        else fuse_reply_buf(req, buf, ret);
+    });
+}
+
+/**
+ * a file unlinked while open is only written through its cached inode, one opened with O_DIRECT is gone
+ */
+static void rfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char* buf, size_t size, off_t off,
+                         fuse_file_info* fi) {
+    string path = node_path(ino);
+    rfs_trace_scope t(tracer(), op_write, path.c_str(), fi, off, size);
+    bool gone = path.empty() && (fi->flags & O_DIRECT);
+    int ret = t.done(gone ? -ENOENT : sc.fs->write(path.c_str(), buf, size, off, fi));
+    if(ret < 0) fuse_reply_err(req, -ret);
+    else fuse_reply_write(req, ret);
+}
+
+static void rfs_ll_release(fuse_req_t req, fuse_ino_t ino, fuse_file_info* fi) {
+    string path = node_path(ino, true);
+    rfs_trace_scope t(tracer(), op_release, path.c_str(), fi);
+    fuse_reply_err(req, -t.done(sc.fs->release(fi)));
+}
+
+static void rfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, fuse_file_info* fi) {
+    string path = node_path(ino, true);
+    rfs_trace_scope t(tracer(), op_fsync, path.c_str(), fi);
+    fuse_reply_err(req, -t.done(sc.fs->fsync(fi)));
+}
+
+static void rfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, fuse_file_info* fi) {
+    string path = node_path(ino);
+    rfs_trace_scope t(tracer(), op_opendir, path.c_str(), fi);
+    int ret = t.done(path.empty() ? -ENOENT : sc.fs->opendir(path.c_str(), fi));
+    if(ret != 0) fuse_reply_err(req, -ret);
+    else fuse_reply_open(req, fi);
+}
+
+/**
+ * the buffer a readdir fills, readdirplus replies entries the kernel holds on to like lookups
+ */
+struct rfs_dir_buf {
+    fuse_req_t req;
+    fuse_ino_t parent;
+    bool plus;
+    vector<char> buf;
+    size_t used;
+};
+
+static int fill_dir(void* p, const char* name, const struct stat* stat, off_t off, fuse_fill_dir_flags flags) {
+    auto d = (rfs_dir_buf*)p;
+    size_t left = d->buf.size() - d->used;
+    size_t need;
+    if(d->plus) {
+        fuse_entry_param e;
+        fill_entry(&e, stat->st_ino, stat);
+        need = fuse_add_direntry_plus(d->req, d->buf.data() + d->used, left, name, &e, off);
+        if(need > left) return 1;
+        remember(stat->st_ino, d->parent, name);
+    } else {
+        need = fuse_add_direntry(d->req, d->buf.data() + d->used, left, name, stat, off);
+        if(need > left) return 1;
+    }
+    d->used += need;
+    return 0;
+}
+
+static void read_dir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, fuse_file_info* fi, bool plus) {
+    string path = node_path(ino);
+    auto flags = plus ? FUSE_READDIR_PLUS : (fuse_readdir_flags)0;
+    rfs_trace_scope t(tracer(), op_readdir, path.c_str(), fi, off, 0, flags);
+    rfs_dir_buf d = {req, ino, plus, vector<char>(size), 0};
+    int ret = t.done(path.empty() ? -ENOENT : sc.fs->readdir(path.c_str(), &d, fill_dir, off, fi, flags));
+    if(ret != 0) fuse_reply_err(req, -ret);
+    else fuse_reply_buf(req, d.buf.data(), d.used);
+}
+
+static void rfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, fuse_file_info* fi) {
+    read_dir(req, ino, size, off, fi, false);
+}
+
+static void rfs_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, fuse_file_info* fi) {
+    read_dir(req, ino, size, off, fi, true);
+}
+
+static void rfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, fuse_file_info* fi) {
+    // the directory cache is dropped by the path the directory had, even if it's gone since
+    string path = node_path(ino, true);
+    rfs_trace_scope t(tracer(), op_releasedir, path.c_str(), fi);
+    fuse_reply_err(req, -t.done(sc.fs->releasedir(path.c_str(), fi)));
+}
+
+static void rfs_ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+    struct statvfs st = {};
+    int ret = sc.fs->statfs("/", &st);
+    if(ret != 0) fuse_reply_err(req, -ret);
+    else fuse_reply_statfs(req, &st);
+}
+
+static void rfs_ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char* name, size_t size) {
+    string path = node_path(ino);
+    rfs_trace_scope t(tracer(), op_getxattr, path.c_str(), nullptr, 0, size);
+    t.second(name);
+    vector<char> value(size);
+    int ret = t.done(path.empty() ? -ENOENT : sc.fs->getxattr(path.c_str(), name, size > 0 ? value.data() : nullptr, size));
+    if(ret < 0) fuse_reply_err(req, -ret);
+    else if(size == 0) fuse_reply_xattr(req, ret);
+    else fuse_reply_buf(req, value.data(), ret);
+}
+
+static void rfs_ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size) {
+    string path = node_path(ino);
+    rfs_trace_scope t(tracer(), op_listxattr, path.c_str(), nullptr, 0, size);
+    vector<char> list(size);
+    int ret = t.done(path.empty() ? -ENOENT : sc.fs->listxattr(path.c_str(), size > 0 ? list.data() : nullptr, size));
+    if(ret < 0) fuse_reply_err(req, -ret);
+    else if(size == 0) fuse_reply_xattr(req, ret);
+    else fuse_reply_buf(req, list.data(), ret);
+}
+
+static void rfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode, fuse_file_info* fi) {
+    string path = child_path(parent, name);
+    if(path.empty()) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    rfs_trace_scope t(tracer(), op_create, path.c_str(), fi, 0, 0, mode);
+    const fuse_ctx* ctx = fuse_req_ctx(req);
+    int ret = t.done(keep_cache(sc.fs->create(path.c_str(), mode, ctx->uid, ctx->gid, fi), fi));
+    fuse_entry_param e;
+    if(ret == 0) {
+        ret = new_entry(parent, name, path, &e);
+        // the file is open, its handle has to be released
+        if(ret != 0) sc.fs->release(fi);
+    }
+    if(ret != 0) fuse_reply_err(req, -ret);
+    else fuse_reply_create(req, &e, fi);
+}
+
+/**
+ * RFS_IOC_BATCH on a directory, the batch comes in and goes back out with the results
+ */
+static void rfs_ll_ioctl(fuse_req_t req, fuse_ino_t ino, rfs_ioctl_cmd cmd, void* arg, fuse_file_info* fi,
+                         unsigned int flags, const void* in_buf, size_t in_bufsz, size_t out_bufsz) {
+    if(flags & FUSE_IOCTL_COMPAT) {
+        fuse_reply_err(req, ENOSYS);
+        return;
+    }
+    if((unsigned int)cmd != RFS_IOC_BATCH || (flags & FUSE_IOCTL_DIR) == 0) {
+        fuse_reply_err(req, ENOTTY);
+        return;
+    }
+    string path = node_path(ino);
+    if(path.empty() || in_bufsz < sizeof(rfs_batch_d) || out_bufsz < sizeof(rfs_batch_d)) {
+        fuse_reply_err(req, path.empty() ? ENOENT : EINVAL);
+        return;
+    }
+    auto b = make_unique<rfs_batch_d>();
+    memcpy(b.get(), in_buf, sizeof(rfs_batch_d));
+    const fuse_ctx* ctx = fuse_req_ctx(req);
+    int ret = sc.fs->batch(path.c_str(), fi, b.get(), ctx->uid, ctx->gid);
+    if(ret < 0) fuse_reply_err(req, -ret);
+    else fuse_reply_ioctl(req, ret, b.get(), sizeof(rfs_batch_d));
+}
+
+static void rfs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t off, off_t len, fuse_file_info* fi) {
+    string path = node_path(ino);
+    rfs_trace_scope t(tracer(), op_fallocate, path.c_str(), fi, off, len, mode);
+    fuse_reply_err(req, -t.done(path.empty() ? -ENOENT : sc.fs->fallocate(path.c_str(), mode, off, len, fi)));
+}
+
+static void rfs_ll_copy_file_range(fuse_req_t req, fuse_ino_t ino_in, off_t off_in, fuse_file_info* fi_in,
+                                   fuse_ino_t ino_out, off_t off_out, fuse_file_info* fi_out, size_t len,
+                                   int flags) {
+    string path_in = node_path(ino_in), path_out = node_path(ino_out);
+    rfs_trace_scope t(tracer(), op_copy_file_range, path_in.c_str(), fi_in, off_in, len, flags);
+    t.second(path_out.c_str(), fi_out, off_out);
+    ssize_t ret = t.done(path_in.empty() || path_out.empty() ? -ENOENT :
+                         sc.fs->copy_file_range(path_in.c_str(), fi_in, off_in, path_out.c_str(), fi_out, off_out,
+                                                len, flags));
+    if(ret < 0) fuse_reply_err(req, -ret);
+    else fuse_reply_write(req, ret);
+}
+
+static void rfs_ll_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence, fuse_file_info* fi) {
+    string path = node_path(ino);
+    rfs_trace_scope t(tracer(), op_lseek, path.c_str(), fi, off, 0, whence);
+    off_t ret = t.done(path.empty() ? -ENOENT : sc.fs->lseek(path.c_str(), off, whence, fi));
+    if(ret < 0) fuse_reply_err(req, -ret);
+    else fuse_reply_lseek(req, ret);
+}
+
+static const fuse_lowlevel_ops rfs_ll_oper = {
+        .init = rfs_ll_init,
+        .destroy = rfs_ll_destroy,
+        .lookup = rfs_ll_lookup,
+        .forget = rfs_ll_forget,
+        .getattr = rfs_ll_getattr,
+        .setattr = rfs_ll_setattr,
+        .mknod = rfs_ll_mknod,
+        .mkdir = rfs_ll_mkdir,
+        .unlink = rfs_ll_unlink,
+        .rmdir = rfs_ll_rmdir,
+        .rename = rfs_ll_rename,
+        .open = rfs_ll_open,
+        .read = rfs_ll_read,
+        .write = rfs_ll_write,
+        .release = rfs_ll_release,
+        .fsync = rfs_ll_fsync,
+        .opendir = rfs_ll_opendir,
+        .readdir = rfs_ll_readdir,
+        .releasedir = rfs_ll_releasedir,
+        .statfs = rfs_ll_statfs,
+        .getxattr = rfs_ll_getxattr,
+        .listxattr = rfs_ll_listxattr,
+        .create = rfs_ll_create,
+        .ioctl = rfs_ll_ioctl,
+        .forget_multi = rfs_ll_forget_multi,
+        .fallocate = rfs_ll_fallocate,
+        .readdirplus = rfs_ll_readdirplus,
+        .copy_file_range = rfs_ll_copy_file_range,
+        .lseek = rfs_ll_lseek,
+};
+
+/**
+ * a session whose getattr, lookup and read are replied from the threads completing them, a worker takes the
+ * next request as soon as one is deferred
+ */
+fuse_session* rfs_session_new(fuse_args* args, const rfs_session_conf& conf) {
+    sc = conf;
+    session = fuse_session_new(args, &rfs_ll_oper, sizeof(rfs_ll_oper), nullptr);
+    return session;
+}
@@ -0,0 +1,31 @@
+//
+// Created by aln0 on 5/6/23.
+//
+
+#ifndef ROCKS_FUSE_RFS_LOWLEVEL_H
+#define ROCKS_FUSE_RFS_LOWLEVEL_H
+
+#include "rocksdb_fs.h"
+#include "fuse_lowlevel.h"
+#include "rfs_trace.h"
+
+#if FUSE_USE_VERSION < 35
+typedef int rfs_ioctl_cmd;
+#else
+typedef unsigned int rfs_ioctl_cmd;
+#endif
+
+/**
+ * what the low level session runs with, the daemon sets the fs up the same way for either session
+ */
+struct rfs_session_conf {
+    rocksdb_fs* fs;
+    rfs_tracer** tracer; // to the tracer while ops are traced, nullptr otherwise
+    bool keep_cache; // the pages of a file stay cached after it's closed
+    int (*start)(fuse_conn_info* conn); // connects and mounts the fs, -1 ends the session
+    void (*stop)();
+};
+
+fuse_session* rfs_session_new(fuse_args* args, const rfs_session_conf& conf);
+
+#endif //ROCKS_FUSE_RFS_LOWLEVEL_H
@@ -0,0 +1,51 @@
+//
+// Created by aln0 on 4/9/23.
+//
+
+#include "rfs_merge.h"
+#include <cstring>
+#include <cstdint>
+
+using rocksdb::Slice;
+
+/**
+ * add the deltas of an operand to the leading counters of value, value grows if it holds fewer counters
+ */
+static bool add_counters(std::string* value, const Slice& operand) {
+    if(operand.size() % sizeof(int64_t) != 0) {
+        return false;
+    }
+    if(value->size() < operand.size()) {
+        value->resize(operand.size(), '\0');
+    }
+
+    int64_t cnt, delta;
+    for(size_t off = 0;off < operand.size();off += sizeof(int64_t)) {
+        memcpy(&cnt, value->data() + off, sizeof(int64_t));
+        memcpy(&delta, operand.data() + off, sizeof(int64_t));
+        cnt += delta;
+        memcpy(&(*value)[off], &cnt, sizeof(int64_t));
+    }
+    return true;
+}
+
+bool rfs_counter_merge::FullMergeV2(const MergeOperationInput &merge_in, MergeOperationOutput *merge_out) const {
+    std::string& value = merge_out->new_value;
+    value.clear();
+    if(merge_in.existing_value != nullptr) {
+        value.assign(merge_in.existing_value->data(), merge_in.existing_value->size());
+    }
+
+    for(const Slice& operand : merge_in.operand_list) {
+        if(!add_counters(&value, operand)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool rfs_counter_merge::PartialMerge(const Slice &key, const Slice &left_operand, const Slice &right_operand,
+                                     std::string *new_value, rocksdb::Logger *logger) const {
+    new_value->assign(left_operand.data(), left_operand.size());
+    return add_counters(new_value, right_operand);
+}
@@ -0,0 +1,22 @@
+//
+// Created by aln0 on 4/9/23.
+//
+
+#ifndef ROCKS_FUSE_RFS_MERGE_H
+#define ROCKS_FUSE_RFS_MERGE_H
+
+#include "rocksdb/merge_operator.h"
+
+/**
+ * values led by little endian int64 counters, e.g. the reference count of a chunk followed by its bytes.
+ * an operand is a list of int64 deltas added to the leading counters, whatever follows the counters is kept
+ */
+class rfs_counter_merge : public rocksdb::MergeOperator {
+public:
+    bool FullMergeV2(const MergeOperationInput& merge_in, MergeOperationOutput* merge_out) const override;
+    bool PartialMerge(const rocksdb::Slice& key, const rocksdb::Slice& left_operand, const rocksdb::Slice& right_operand,
+                      std::string* new_value, rocksdb::Logger* logger) const override;
+    const char* Name() const override { return "rfs_counter_merge"; }
+};
+
+#endif //ROCKS_FUSE_RFS_MERGE_H
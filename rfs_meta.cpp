@@ -0,0 +1,129 @@
+//
+// Created by aln0 on 4/21/23.
+//
+
+#include "rocksdb_fs.h"
+#include "types.h"
+#include <unistd.h>
+
+/**
+ * move the inodes and the super block a shard had in the default column family into the meta one, a batch at
+ * a time. a crash before META_KEY is written moves the rest on the next mount
+ */
+int rocksdb_fs::move_meta() {
+    string rV;
+    for(size_t i = 0;i < shards.size();i++) {
+        DB* db = shards[i];
+        if(metas[i]->GetID() == 0 || db->Get(ReadOptions(), META_KEY, &rV).ok()) {
+            continue;
+        }
+
+        WriteBatch batch;
+        auto it = unique_ptr<rocksdb::Iterator>(db->NewIterator(ReadOptions()));
+        for(it->Seek("0"); it->Valid() && it->key()[0] >= '0' && it->key()[0] <= '9';) {
+            string key = it->key().ToString();
+            size_t colon = key.find(':');
+            if(colon != string::npos) {
+                // "<ino>:<blk>" sort after every "<ino><digit>", skip to the next ino
+                key.resize(colon);
+                key.push_back(':' + 1);
+                it->Seek(key);
+                continue;
+            }
+            batch.Put(metas[i], key, it->value());
+            batch.Delete(key);
+            if(batch.GetDataSize() >= DIRTY_FLUSH_THRESHOLD) {
+                if(!db->Write(WriteOptions(), &batch).ok()) return -1;
+                batch.Clear();
+            }
+            it->Next();
+        }
+        batch.Put(META_KEY, Slice());
+        if(!db->Write(WriteOptions(), &batch).ok()) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * bring the records of a volume to RFS_FORMAT, a fresh one only gets FORMAT_KEY. a volume of format 0 is converted
+ * in place from the root down, an inode in a batch with its blocks and a mark that it's done. a crash leaves the
+ * ones marked to be read as they are, FORMAT_KEY replaces the marks once every inode is converted
+ * @param fresh the super block has just been created
+ * @return -1 for a volume of a format this one doesn't read
+ */
+int rocksdb_fs::upgrade_format(bool fresh) {
+    string rV;
+    uint32_t format = RFS_FORMAT;
+    Status s = shards[0]->Get(ReadOptions(), FORMAT_KEY, &rV);
+    if(s.ok()) {
+        if(rV.size() != sizeof(format)) {
+            return -1;
+        }
+        memcpy(&format, rV.data(), sizeof(format));
+        if(format != RFS_FORMAT) {
+            fprintf(stderr, "rfs: the volume is of format %u, this build reads format %u\n", format, RFS_FORMAT);
+            return -1;
+        }
+        return 0;
+    }
+    if(!s.IsNotFound()) {
+        return -1;
+    }
+
+    char key[INODE_KEY_LEN], vkey[UPGRADED_KEY_LEN], bkey[BLOCK_KEY_LEN];
+    vector<std::pair<uint64_t, file_type>> todo;
+    if(!fresh) {
+        todo.emplace_back(ROOT_DENTRY_INO, dir);
+    }
+    while(!todo.empty()) {
+        uint64_t ino = todo.back().first;
+        file_type ftype = todo.back().second;
+        todo.pop_back();
+        inode_key(key, ino);
+        upgraded_key(vkey, ino);
+        DB* db = db_of(ino);
+        if(!db->Get(ReadOptions(), meta_of(ino), key, &rV).ok()) {
+            continue;
+        }
+        string mark;
+        unique_ptr<inode_t> inode;
+        if(db->Get(ReadOptions(), vkey, &mark).ok()) {
+            inode = make_unique<inode_t>(rV.data(), rV.size());
+        } else {
+            inode = make_unique<inode_t>(rV.data(), rV.size(), ftype);
+            inode->uid = getuid();
+            inode->gid = getgid();
+            inode->touch(RFS_ATIME | RFS_MTIME | RFS_CTIME);
+            WriteBatch batch;
+            for(auto& b : inode->blocks) {
+                block_key(bkey, ino, b.first);
+                batch.Put(bkey, b.second.data);
+            }
+            inode->blocks.clear();
+            inode->before_write_back();
+            batch.Put(meta_of(ino), key, Slice((char*)inode->data(), inode->used_dat_sz + inode->attr_sz));
+            batch.Put(vkey, Slice());
+            if(!db->Write(WriteOptions(), &batch).ok()) {
+                return -1;
+            }
+        }
+        for(size_t i = 0;ftype == dir && i < inode->dentry_cnt();i++) {
+            rfs_dentry_d* d = inode->dentry_at(i);
+            todo.emplace_back(d->ino, d->ftype);
+        }
+    }
+
+    for(size_t i = shards.size();i-- > 0;) {
+        WriteBatch batch;
+        batch.DeleteRange("v", "w");
+        if(i == 0) {
+            batch.Put(FORMAT_KEY, Slice((char*)&format, sizeof(format)));
+        }
+        if(!shards[i]->Write(WriteOptions(), &batch).ok()) {
+            return -1;
+        }
+    }
+    return 0;
+}
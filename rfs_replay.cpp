@@ -0,0 +1,341 @@
+//
+// Created by aln0 on 4/18/23.
+//
+// rfs_replay: re-executes a trace recorded with --trace against rocksdb_fs directly, no fuse involved.
+// The ops run one at a time in the order they were called, so a replay is deterministic. Start it on a
+// copy of the db as it was when tracing began, otherwise the ops meet different files than they did.
+//
+
+#include "rocksdb_fs.h"
+#include "rfs_trace.h"
+
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <unordered_map>
+
+using std::unordered_map;
+
+struct replay_options {
+    vector<string> dbpaths;
+    const char* trace = nullptr;
+    bool orig_speed = false;
+    rfs_config conf;
+};
+
+struct replay_op {
+    rfs_trace_rec rec;
+    string path;
+    string to;
+};
+
+/**
+ * latencies of one op type, of the traced calls and of their replay
+ */
+struct op_stats {
+    vector<uint64_t> orig;
+    vector<uint64_t> replay;
+    size_t mismatch = 0; // failed in one run only
+};
+
+static void show_help(const char* prog) {
+    printf("usage: %s [options] <trace>\n"
+           "    --dbpath=<s>        Path of rocksdb's persistent file (default: \"./db\"), once per shard\n"
+           "    --speed=<s>         orig keeps the traced gaps between ops, max issues them back to back (default: max)\n"
+           "    --clone             Replay with copy_file_range cloning on, as the traced mount may have run\n"
+           "    --dedup             Replay with deduplication on\n"
+           "    --bg_io_limit=<n>   MiB/s flushes and compactions may use, as the mount option (default: no limit)\n"
+           "    --block_cache=<n>   MiB of block cache, as the mount option (default: 32)\n"
+           "    --hyper_clock       HyperClockCache as block cache\n"
+           "    --secondary_cache=<n>  MiB of compressed secondary cache (default: 0)\n"
+           "    --meta_in_memory    Inodes in plain tables read through mmap\n"
+           "    --cold_path=<s>     Tier file data to a directory per shard in it, as the mount option. a tiered\n"
+           "                        volume is opened with its own without it\n"
+           "    --hot_size=<n>      MiB of file data a shard keeps on its dbpath with --cold_path (default: 16384)\n", prog);
+}
+
+static int parse_args(int argc, char* argv[], replay_options& opts) {
+    static const option long_opts[] = {
+            {"dbpath", required_argument, nullptr, 'd'},
+            {"speed", required_argument, nullptr, 's'},
+            {"clone", no_argument, nullptr, 'c'},
+            {"dedup", no_argument, nullptr, 'u'},
+            {"bg_io_limit", required_argument, nullptr, 'l'},
+            {"block_cache", required_argument, nullptr, 'b'},
+            {"hyper_clock", no_argument, nullptr, 'k'},
+            {"secondary_cache", required_argument, nullptr, 'x'},
+            {"meta_in_memory", no_argument, nullptr, 'm'},
+            {"cold_path", required_argument, nullptr, 't'},
+            {"hot_size", required_argument, nullptr, 'z'},
+            {"help", no_argument, nullptr, 'h'},
+            {nullptr, 0, nullptr, 0}
+    };
+
+    int c;
+    while((c = getopt_long(argc, argv, "d:s:cul:b:kx:mt:z:h", long_opts, nullptr)) != -1) {
+        switch(c) {
+            case 'd': opts.dbpaths.emplace_back(optarg); break;
+            case 's':
+                if(strcmp(optarg, "orig") == 0) opts.orig_speed = true;
+                else if(strcmp(optarg, "max") != 0) return -1;
+                break;
+            case 'c': opts.conf.clone = true; break;
+            case 'u': opts.conf.dedup = true; break;
+            case 'l': opts.conf.bg_io_limit = strtoull(optarg, nullptr, 10) << 20; break;
+            case 'b': opts.conf.block_cache_sz = strtoull(optarg, nullptr, 10) << 20; break;
+            case 'k': opts.conf.hyper_clock = true; break;
+            case 'x': opts.conf.secondary_cache_sz = strtoull(optarg, nullptr, 10) << 20; break;
+            case 'm': opts.conf.meta_in_memory = true; break;
+            case 't': opts.conf.cold_path = optarg; break;
+            case 'z': opts.conf.hot_sz = strtoull(optarg, nullptr, 10) << 20; break;
+            default: return -1;
+        }
+    }
+    if(optind != argc - 1) {
+        return -1;
+    }
+    opts.trace = argv[optind];
+    if(opts.dbpaths.empty()) {
+        opts.dbpaths.emplace_back("./db");
+    }
+    return 0;
+}
+
+/**
+ * read every record of a trace, sorted by the time they were called
+ */
+static int load_trace(const char* path, vector<replay_op>& ops) {
+    FILE* in = fopen(path, "rb");
+    if(in == nullptr) {
+        return -errno;
+    }
+
+    rfs_trace_hdr hdr;
+    if(fread(&hdr, sizeof(hdr), 1, in) != 1 || memcmp(hdr.magic, RFS_TRACE_MAGIC, sizeof(hdr.magic)) != 0
+       || hdr.version != RFS_TRACE_VERSION || hdr.rec_sz != sizeof(rfs_trace_rec)) {
+        fclose(in);
+        return -EINVAL;
+    }
+
+    replay_op op;
+    while(fread(&op.rec, sizeof(op.rec), 1, in) == 1) {
+        op.path.resize(op.rec.path_len);
+        op.to.resize(op.rec.to_len);
+        if(fread(&op.path[0], 1, op.path.size(), in) != op.path.size() || fread(&op.to[0], 1, op.to.size(), in) != op.to.size()
+           || op.rec.op >= op_cnt) {
+            fclose(in);
+            return -EINVAL;
+        }
+        ops.push_back(op);
+    }
+    fclose(in);
+
+    std::stable_sort(ops.begin(), ops.end(), [](const replay_op& a, const replay_op& b) { return a.rec.ts < b.rec.ts; });
+    return 0;
+}
+
+static int fill_dir(void* buf, const char* name, const struct stat* st, off_t off, fuse_fill_dir_flags flags) {
+    return 0;
+}
+
+static timespec utime_ts(int64_t ns, uint32_t bits) {
+    timespec ts = {(time_t)(ns / 1000000000), (long)(ns % 1000000000)};
+    if(bits & 1) ts.tv_nsec = UTIME_NOW;
+    if(bits & 2) ts.tv_nsec = UTIME_OMIT;
+    return ts;
+}
+
+class replayer {
+private:
+    rocksdb_fs& fs;
+    unordered_map<uint64_t, uint64_t> handles; // traced file handle to the replay's
+    vector<char> buf;
+
+    /**
+     * the replay's file handle for a traced one, handles opened before tracing began are opened now
+     */
+    fuse_file_info handle(const rfs_trace_rec& rec, uint64_t fh, const string& path) {
+        fuse_file_info fi = {};
+        fi.flags = rec.flags;
+        auto it = handles.find(fh);
+        if(it == handles.end()) {
+            fuse_file_info opened = {};
+            opened.flags = rec.flags;
+            bool is_dir = rec.op == op_readdir || rec.op == op_releasedir;
+            if((is_dir ? fs.opendir(path.c_str(), &opened) : fs.open(path.c_str(), &opened)) == 0) {
+                it = handles.emplace(fh, opened.fh).first;
+            }
+        }
+        if(it != handles.end()) {
+            fi.fh = it->second;
+        }
+        return fi;
+    }
+
+    void opened(const rfs_trace_rec& rec, const fuse_file_info& fi, int64_t ret) {
+        if(ret == 0 && rec.ret == 0) {
+            handles[rec.fh] = fi.fh;
+        }
+    }
+
+public:
+    explicit replayer(rocksdb_fs& fs) : fs(fs) {}
+
+    int64_t run(const replay_op& op) {
+        const rfs_trace_rec& rec = op.rec;
+        const char* path = op.path.c_str();
+        fuse_file_info fi = {};
+        if(rec.has_fh && rec.op != op_open && rec.op != op_opendir && rec.op != op_create) {
+            fi = handle(rec, rec.fh, op.path);
+        } else {
+            fi.flags = rec.flags;
+        }
+
+        int64_t ret = 0;
+        switch(rec.op) {
+            case op_getattr: {
+                struct stat st;
+                ret = fs.getattr(path, &st);
+                break;
+            }
+            case op_mknod: ret = fs.mknod(path, rec.aux, getuid(), getgid()); break;
+            case op_mkdir: ret = fs.mkdir(path, rec.aux, getuid(), getgid()); break;
+            case op_unlink: ret = fs.unlink(path); break;
+            case op_rmdir: ret = fs.rmdir(path); break;
+            case op_rename: ret = fs.rename(path, op.to.c_str()); break;
+            case op_chmod: ret = fs.chmod(path, rec.aux); break;
+            case op_chown: ret = fs.chown(path, rec.aux, rec.size); break;
+            case op_truncate: ret = fs.truncate(path, rec.size, rec.has_fh ? &fi : nullptr); break;
+            case op_open:
+                ret = fs.open(path, &fi);
+                opened(rec, fi, ret);
+                break;
+            case op_create:
+                ret = fs.create(path, rec.aux, getuid(), getgid(), &fi);
+                opened(rec, fi, ret);
+                break;
+            case op_opendir:
+                ret = fs.opendir(path, &fi);
+                opened(rec, fi, ret);
+                break;
+            case op_read:
+                buf.resize(std::max(buf.size(), (size_t)rec.size));
+                ret = fs.read(path, buf.data(), rec.size, rec.off, &fi);
+                break;
+            case op_write:
+                // the traced bytes aren't kept, only their amount
+                buf.resize(std::max(buf.size(), (size_t)rec.size));
+                ret = fs.write(path, buf.data(), rec.size, rec.off, &fi);
+                break;
+            case op_release:
+                ret = fs.release(&fi);
+                handles.erase(rec.fh);
+                break;
+            case op_releasedir:
+                ret = fs.releasedir(path, &fi);
+                handles.erase(rec.fh);
+                break;
+            case op_fsync: ret = fs.fsync(&fi); break;
+            case op_readdir:
+                ret = fs.readdir(path, nullptr, fill_dir, rec.off, &fi, (fuse_readdir_flags)rec.aux);
+                break;
+            case op_utimens: {
+                timespec tv[2] = {utime_ts(rec.off, rec.aux & 3), utime_ts(rec.size, rec.aux >> 2 & 3)};
+                ret = fs.utimens(path, tv);
+                break;
+            }
+            case op_fallocate: ret = fs.fallocate(path, rec.aux, rec.off, rec.size, &fi); break;
+            case op_copy_file_range: {
+                fuse_file_info fo = handle(rec, rec.fh2, op.to);
+                ret = fs.copy_file_range(path, &fi, rec.off, op.to.c_str(), &fo, rec.off2, rec.size, rec.aux);
+                break;
+            }
+            case op_lseek: ret = fs.lseek(path, rec.off, rec.aux, &fi); break;
+            case op_getxattr:
+                buf.resize(std::max(buf.size(), (size_t)rec.size));
+                ret = fs.getxattr(path, op.to.c_str(), buf.data(), rec.size);
+                break;
+            case op_listxattr:
+                buf.resize(std::max(buf.size(), (size_t)rec.size));
+                ret = fs.listxattr(path, buf.data(), rec.size);
+                break;
+            default: break;
+        }
+        return ret;
+    }
+};
+
+static uint64_t percentile(vector<uint64_t>& v, double p) {
+    size_t i = std::min(v.size() - 1, (size_t)(p * v.size()));
+    std::nth_element(v.begin(), v.begin() + i, v.end());
+    return v[i];
+}
+
+static void report(op_stats (&stats)[op_cnt]) {
+    printf("%-16s %9s %9s %9s %9s %9s %9s %9s %9s\n", "op", "count", "mismatch",
+           "p50(us)", "p90(us)", "p99(us)", "max(us)", "orig p50", "orig p99");
+    for(int op = 0;op < op_cnt;op++) {
+        op_stats& s = stats[op];
+        if(s.replay.empty()) continue;
+        printf("%-16s %9zu %9zu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", rfs_op_names[op], s.replay.size(), s.mismatch,
+               percentile(s.replay, 0.5) / 1e3, percentile(s.replay, 0.9) / 1e3, percentile(s.replay, 0.99) / 1e3,
+               *std::max_element(s.replay.begin(), s.replay.end()) / 1e3,
+               percentile(s.orig, 0.5) / 1e3, percentile(s.orig, 0.99) / 1e3);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    replay_options opts;
+    if(parse_args(argc, argv, opts) != 0) {
+        show_help(argv[0]);
+        return 1;
+    }
+
+    vector<replay_op> ops;
+    int ret = load_trace(opts.trace, ops);
+    if(ret != 0) {
+        fprintf(stderr, "rfs_replay: read %s failed: %s\n", opts.trace, strerror(-ret));
+        return 1;
+    }
+
+    rocksdb_fs fs;
+    if(fs.connect(opts.dbpaths, opts.conf) != 0 || fs.mount() != 0) {
+        fprintf(stderr, "rfs_replay: open %s failed\n", opts.dbpaths[0].c_str());
+        return 1;
+    }
+
+    replayer r(fs);
+    static op_stats stats[op_cnt];
+    auto start = std::chrono::steady_clock::now();
+    for(auto& op : ops) {
+        if(opts.orig_speed) {
+            std::this_thread::sleep_until(start + std::chrono::nanoseconds(op.rec.ts));
+        }
+        auto beg = std::chrono::steady_clock::now();
+        int64_t res = r.run(op);
+        auto lat = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - beg);
+
+        op_stats& s = stats[op.rec.op];
+        s.replay.push_back(lat.count());
+        s.orig.push_back(op.rec.lat);
+        if((res < 0) != (op.rec.ret < 0)) {
+            s.mismatch++;
+        }
+    }
+    auto total = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+
+    printf("%zu ops replayed in %ld ms\n", ops.size(), (long)total.count());
+    report(stats);
+
+    char cache_stats[1024];
+    int len = fs.getxattr("/", RFS_XATTR_STATS, cache_stats, sizeof(cache_stats));
+    if(len > 0) {
+        printf("\n%.*s", len, cache_stats);
+    }
+    fs.close();
+    return 0;
+}
@@ -0,0 +1,193 @@
+//
+// Created by aln0 on 4/19/23.
+//
+
+#include "rocksdb_fs.h"
+#include "types.h"
+#include <set>
+#include <chrono>
+
+/**
+ * inos are handed out in sequence, they're mixed so that files created together spread over the shards
+ */
+size_t rocksdb_fs::shard_of(uint64_t ino) const {
+    if(shards.size() == 1) {
+        return 0;
+    }
+    ino ^= ino >> 33;
+    ino *= 0xff51afd7ed558ccdULL;
+    ino ^= ino >> 33;
+    ino *= 0xc4ceb9fe1a85ec53ULL;
+    ino ^= ino >> 33;
+    return ino % shards.size();
+}
+
+/**
+ * whether a shard holds nothing yet, in neither column family inodes may be in
+ */
+bool rocksdb_fs::empty_shard(size_t shard) {
+    for(auto cf : {shards[shard]->DefaultColumnFamily(), metas[shard]}) {
+        auto it = unique_ptr<rocksdb::Iterator>(shards[shard]->NewIterator(ReadOptions(), cf));
+        it->SeekToFirst();
+        if(it->Valid()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * inodes are placed by the number of shards, a db opened in another place or with another count would lose them.
+ * the shards without a stamp are only stamped once all of them have passed
+ */
+int rocksdb_fs::check_shards() {
+    string rV;
+    vector<uint32_t> fresh;
+    for(uint32_t i = 0;i < shards.size();i++) {
+        uint32_t want[2] = {i, (uint32_t)shards.size()}, have[2];
+        Status s = shards[i]->Get(ReadOptions(), SHARD_KEY, &rV);
+        if(s.IsNotFound()) {
+            // a fresh db, or one from before sharding that is its only shard. the inodes of such a db are placed
+            // for one shard, mounted with others most would be looked for elsewhere
+            if(shards.size() > 1 && !empty_shard(i)) {
+                fprintf(stderr, "rfs: --dbpath #%u holds an unsharded fs, it can only be mounted alone\n", i + 1);
+                return -1;
+            }
+            fresh.push_back(i);
+            continue;
+        }
+        if(!s.ok() || rV.size() != sizeof(have)) {
+            return -1;
+        }
+        memcpy(have, rV.data(), sizeof(have));
+        if(have[0] != want[0] || have[1] != want[1]) {
+            fprintf(stderr, "rfs: --dbpath #%u is shard %u of %u, mounted as %u of %u\n", i + 1, have[0] + 1, have[1],
+                    want[0] + 1, want[1]);
+            return -1;
+        }
+    }
+    for(uint32_t i : fresh) {
+        uint32_t want[2] = {i, (uint32_t)shards.size()};
+        if(!shards[i]->Put(WriteOptions(), SHARD_KEY, Slice((char*)want, sizeof(want))).ok()) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * write the batches of txn atomically. a batch alone is written as is, otherwise the largest one commits the txn:
+ * it's written together with an intent holding the other batches, each of those is then written with a
+ * marker of the intent. recover_intents finishes what a crash interrupted.
+ * the intent and the batches it holds are synced, a power failure can't keep one and lose the other. the intent
+ * goes before its markers, a marker without it is never taken for a batch still to apply
+ * @return -1 if a shard failed to take its batch, the others keep theirs
+ */
+int rocksdb_fs::commit(rfs_txn &txn) {
+    if(txn.batches.empty()) {
+        return 0;
+    }
+    if(txn.batches.size() == 1) {
+        auto& b = *txn.batches.begin();
+        return shards[b.first]->Write(WriteOptions(), &b.second).ok() ? 0 : -1;
+    }
+
+    char key[INTENT_KEY_LEN];
+    intent_key(key, ++txn_id);
+    auto coord = std::max_element(txn.batches.begin(), txn.batches.end(), [](auto& a, auto& b) {
+        return a.second.GetDataSize() < b.second.GetDataSize();
+    });
+
+    // [uint32 shard, uint32 len, batch] of every other shard
+    string intent;
+    for(auto it = txn.batches.begin();it != txn.batches.end();it++) {
+        if(it == coord) continue;
+        it->second.Put(key, Slice());
+        const string& rep = it->second.Data();
+        uint32_t hdr[2] = {(uint32_t)it->first, (uint32_t)rep.size()};
+        intent.append((char*)hdr, sizeof(hdr));
+        intent.append(rep);
+    }
+    coord->second.Put(key, intent);
+    WriteOptions sync;
+    sync.sync = true;
+    if(!shards[coord->first]->Write(sync, &coord->second).ok()) {
+        return -1;
+    }
+
+    int ret = 0;
+    for(auto it = txn.batches.begin();it != txn.batches.end();it++) {
+        if(it != coord && !shards[it->first]->Write(sync, &it->second).ok()) {
+            // a shard that fails a write stops taking them, replaying the batch over what came since would be
+            // worse than the part missing
+            RFS_DEBUG("rfs::commit", "shard write failed");
+            ret = -1;
+        }
+    }
+    shards[coord->first]->Delete(sync, key);
+    for(auto it = txn.batches.begin();it != txn.batches.end();it++) {
+        if(it != coord) shards[it->first]->Delete(WriteOptions(), key);
+    }
+    return ret;
+}
+
+/**
+ * apply the batches of the intents a crash left behind that their shards haven't got yet,
+ * then drop the intents and their markers
+ */
+void rocksdb_fs::recover_intents() {
+    struct intent {
+        size_t shard;
+        string key;
+        string val;
+    };
+    vector<intent> found;
+    vector<std::set<string>> applied(shards.size());
+    uint64_t last = 0;
+    WriteOptions sync;
+    sync.sync = true;
+
+    for(size_t i = 0;i < shards.size();i++) {
+        auto it = unique_ptr<rocksdb::Iterator>(shards[i]->NewIterator(ReadOptions()));
+        for(it->Seek("i"); it->Valid() && it->key()[0] == 'i'; it->Next()) {
+            string key = it->key().ToString();
+            last = std::max(last, (uint64_t)strtoull(key.c_str() + 1, nullptr, 16));
+            if(it->value().empty()) {
+                applied[i].insert(key);
+            } else {
+                found.push_back({i, key, it->value().ToString()});
+            }
+        }
+    }
+
+    for(auto& in : found) {
+        const char* p = in.val.data();
+        const char* end = p + in.val.size();
+        uint32_t hdr[2];
+        while(p + sizeof(hdr) <= end) {
+            memcpy(hdr, p, sizeof(hdr));
+            p += sizeof(hdr);
+            if(hdr[1] > (size_t)(end - p)) {
+                break;
+            }
+            if(hdr[0] < shards.size() && applied[hdr[0]].count(in.key) == 0) {
+                WriteBatch batch(string(p, hdr[1]));
+                shards[hdr[0]]->Write(sync, &batch);
+                applied[hdr[0]].insert(in.key);
+            }
+            p += hdr[1];
+        }
+        shards[in.shard]->Delete(sync, in.key);
+    }
+    // markers left without their intent go too
+    for(size_t i = 0;i < shards.size();i++) {
+        for(auto& key : applied[i]) {
+            shards[i]->Delete(WriteOptions(), key);
+        }
+    }
+    // a marker whose delete didn't last past a crash must never match a later intent, the numbers go on from
+    // the clock rather than from the ones found
+    uint64_t now = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    txn_id = std::max(last, now);
+}
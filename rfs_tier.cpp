@@ -0,0 +1,102 @@
+//
+// Created by aln0 on 4/27/23.
+//
+
+#include "rocksdb_fs.h"
+#include "rocksdb/metadata.h"
+#include "types.h"
+#include <chrono>
+
+/**
+ * file data fills the fast path of a shard up to hot_sz, the levels past that are on cold_path. recent data is
+ * in the upper levels and stays fast, the inodes and the index never leave. demote evens it out by the reads
+ */
+void rocksdb_fs::tier_loop() {
+    unique_lock<mutex> l(tier_lock);
+    while(!tier_stop) {
+        tier_cv.wait_for(l, std::chrono::seconds(TIER_INTERVAL));
+        if(tier_stop) break;
+        l.unlock();
+        for(size_t i = 0;i < shards.size();i++) {
+            demote(i);
+        }
+        l.lock();
+    }
+}
+
+/**
+ * move the tables of file data a shard's fast path reads least, by the reads rocksdb samples per table,
+ * to the last level on the cold path until the fast path is back under hot_sz. the last level is where
+ * compactions would move them in time anyway
+ */
+int rocksdb_fs::demote(size_t shard) {
+    DB* db = shards[shard];
+    rocksdb::ColumnFamilyMetaData meta;
+    db->GetColumnFamilyMetaData(db->DefaultColumnFamily(), &meta);
+    int last = (int)meta.levels.size() - 1;
+
+    uint64_t hot_bytes = 0;
+    vector<const rocksdb::SstFileMetaData*> files;
+    for(auto& level : meta.levels) {
+        for(auto& f : level.files) {
+            if(f.db_path != db->GetName()) continue;
+            hot_bytes += f.size;
+            // L0 is what was just flushed
+            if(level.level > 0 && !f.being_compacted) files.push_back(&f);
+        }
+    }
+    if(hot_bytes <= conf.hot_sz) {
+        return 0;
+    }
+
+    // fewest reads for their size first
+    std::sort(files.begin(), files.end(), [](auto a, auto b) {
+        return (double)a->num_reads_sampled / (a->size + 1) < (double)b->num_reads_sampled / (b->size + 1);
+    });
+    vector<string> names;
+    for(auto f : files) {
+        // a tenth below the target, so that the next flushes don't bring it right back
+        if(hot_bytes <= conf.hot_sz / 10 * 9) break;
+        names.push_back(f->name);
+        hot_bytes -= f->size;
+    }
+    if(names.empty()) {
+        return 0;
+    }
+    Status s = db->CompactFiles(rocksdb::CompactionOptions(), db->DefaultColumnFamily(), names, last, 1);
+    if(!s.ok()) {
+        RFS_DEBUG("rfs::demote", "compaction failed");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * how the tables of the shards split between the fast and the cold paths, in bytes and in sampled reads
+ */
+string rocksdb_fs::tier_report() {
+    uint64_t bytes[2] = {0, 0}, reads[2] = {0, 0};
+    for(size_t i = 0;i < shards.size();i++) {
+        vector<rocksdb::ColumnFamilyHandle*> cfs = {shards[i]->DefaultColumnFamily(), metas[i]};
+        if(metas[i]->GetID() == 0) cfs.pop_back();
+        if(i < indexes.size()) cfs.push_back(indexes[i]);
+        for(auto cf : cfs) {
+            rocksdb::ColumnFamilyMetaData meta;
+            shards[i]->GetColumnFamilyMetaData(cf, &meta);
+            for(auto& level : meta.levels) {
+                for(auto& f : level.files) {
+                    int cold = f.db_path != shards[i]->GetName();
+                    bytes[cold] += f.size;
+                    reads[cold] += f.num_reads_sampled;
+                }
+            }
+        }
+    }
+    string report;
+    const char* names[2] = {"hot", "cold"};
+    for(int t = 0;t < 2;t++) {
+        report.append("tier.").append(names[t]).append(".bytes ").append(std::to_string(bytes[t])).append("\n");
+        report.append("tier.").append(names[t]).append(".reads_sampled ").append(std::to_string(reads[t])).append("\n");
+    }
+    return report;
+}
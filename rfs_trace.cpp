@@ -0,0 +1,224 @@
+//
+// Created by aln0 on 4/18/23.
+//
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 32
+#endif
+
+#include "rfs_trace.h"
+#include "fuse_common.h"
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+// how often the flusher drains the rings
+#define FLUSH_INTERVAL_MS 10
+
+const char* const rfs_op_names[op_cnt] = {
+        "getattr", "mknod", "mkdir", "unlink", "rmdir", "rename", "chmod", "chown", "truncate",
+        "open", "read", "write", "release", "fsync", "opendir", "readdir", "releasedir", "create",
+        "utimens", "fallocate", "copy_file_range", "lseek",
+        "getxattr", "listxattr",
+};
+
+static uint64_t clock_ns(clockid_t clk) {
+    timespec ts;
+    clock_gettime(clk, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * the calling thread's ring, kept alive by the thread and the tracer, marked dead when the thread exits
+ */
+struct rfs_local_ring {
+    rfs_tracer* owner = nullptr;
+    std::shared_ptr<rfs_tracer::ring> r;
+    uint32_t tid = 0;
+
+    ~rfs_local_ring() {
+        if(r != nullptr) r->dead.store(true, std::memory_order_release);
+    }
+};
+
+static thread_local rfs_local_ring local;
+
+rfs_tracer::~rfs_tracer() {
+    close();
+}
+
+/**
+ * start tracing into path
+ * @param ring_sz bytes of each thread's ring
+ */
+int rfs_tracer::open(const char *path, size_t ring_sz) {
+    out = fopen(path, "wb");
+    if(out == nullptr) {
+        return -errno;
+    }
+
+    rfs_trace_hdr hdr = {};
+    memcpy(hdr.magic, RFS_TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = RFS_TRACE_VERSION;
+    hdr.rec_sz = sizeof(rfs_trace_rec);
+    hdr.start_ns = clock_ns(CLOCK_REALTIME);
+    if(fwrite(&hdr, sizeof(hdr), 1, out) != 1) {
+        fclose(out);
+        out = nullptr;
+        return -EIO;
+    }
+
+    this->ring_sz = ring_sz;
+    this->start = clock_ns(CLOCK_MONOTONIC);
+    this->stop = false;
+    flusher = std::thread(&rfs_tracer::flush_loop, this);
+    enabled.store(true, std::memory_order_release);
+    return 0;
+}
+
+/**
+ * stop tracing and write out what the rings still hold, no op may be running
+ */
+void rfs_tracer::close() {
+    if(out == nullptr) {
+        return;
+    }
+    enabled.store(false, std::memory_order_release);
+    {
+        std::unique_lock<std::mutex> l(lock);
+        stop = true;
+    }
+    cv.notify_one();
+    flusher.join();
+
+    for(auto& r : rings) {
+        drain(*r);
+    }
+    rings.clear();
+    if(dropped.load() != 0) {
+        fprintf(stderr, "rfs trace: %lu records dropped on full rings\n", dropped.load());
+    }
+    fclose(out);
+    out = nullptr;
+}
+
+uint64_t rfs_tracer::now() const {
+    return clock_ns(CLOCK_MONOTONIC) - start;
+}
+
+rfs_tracer::ring* rfs_tracer::local_ring() {
+    if(local.owner != this) {
+        local.r = std::make_shared<ring>(ring_sz);
+        local.owner = this;
+        local.tid = syscall(SYS_gettid);
+        std::unique_lock<std::mutex> l(lock);
+        rings.push_back(local.r);
+    }
+    return local.r.get();
+}
+
+/**
+ * append a record to the calling thread's ring, only its owner writes to a ring
+ */
+void rfs_tracer::record(rfs_trace_rec &rec, const char *path, const char *to) {
+    ring* r = local_ring();
+    rec.tid = local.tid;
+    rec.path_len = path ? strnlen(path, UINT16_MAX) : 0;
+    rec.to_len = to ? strnlen(to, UINT16_MAX) : 0;
+
+    size_t len = sizeof(rec) + rec.path_len + rec.to_len;
+    uint64_t head = r->head.load(std::memory_order_relaxed);
+    if(r->cap - (head - r->tail.load(std::memory_order_acquire)) < len) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    // the copies wrap around the end of the ring
+    uint64_t pos = head;
+    for(auto part : {std::make_pair((const char*)&rec, sizeof(rec)), std::make_pair(path, (size_t)rec.path_len),
+                     std::make_pair(to, (size_t)rec.to_len)}) {
+        if(part.second == 0) continue;
+        size_t at = pos % r->cap, n = std::min(part.second, r->cap - at);
+        memcpy(&r->buf[at], part.first, n);
+        memcpy(&r->buf[0], part.first + n, part.second - n);
+        pos += part.second;
+    }
+    r->head.store(pos, std::memory_order_release);
+}
+
+/**
+ * write out the complete records of a ring, the flusher is the only reader
+ */
+void rfs_tracer::drain(ring &r) {
+    uint64_t tail = r.tail.load(std::memory_order_relaxed);
+    uint64_t head = r.head.load(std::memory_order_acquire);
+    if(head == tail) {
+        return;
+    }
+    size_t at = tail % r.cap, n = std::min((size_t)(head - tail), r.cap - at);
+    fwrite(&r.buf[at], 1, n, out);
+    fwrite(&r.buf[0], 1, head - tail - n, out);
+    r.tail.store(head, std::memory_order_release);
+}
+
+/**
+ * the rings to drain are taken under the lock and written out after it's let go, a thread's first op never
+ * waits on the file
+ */
+void rfs_tracer::flush_loop() {
+    std::vector<std::shared_ptr<ring>> draining;
+    std::unique_lock<std::mutex> l(lock);
+    while(!stop) {
+        cv.wait_for(l, std::chrono::milliseconds(FLUSH_INTERVAL_MS));
+        draining = rings;
+        // a ring seen dead has all its records in, it's drained one last time below
+        for(size_t i = 0;i < rings.size();) {
+            if(rings[i]->dead.load(std::memory_order_acquire)) {
+                rings[i] = rings.back();
+                rings.pop_back();
+            } else {
+                i++;
+            }
+        }
+        l.unlock();
+        for(auto& r : draining) {
+            drain(*r);
+        }
+        fflush(out);
+        draining.clear();
+        l.lock();
+    }
+}
+
+rfs_trace_scope::rfs_trace_scope(rfs_tracer *tracer, rfs_op op, const char *path, const struct fuse_file_info *fi,
+                                 int64_t off, uint64_t size, uint32_t aux) {
+    if(tracer == nullptr || !tracer->on()) {
+        this->tracer = nullptr;
+        return;
+    }
+    this->tracer = tracer;
+    this->path = path;
+    this->fi = fi;
+    memset(&rec, 0, sizeof(rec));
+    rec.op = op;
+    rec.off = off;
+    rec.size = size;
+    rec.aux = aux;
+    rec.ts = tracer->now();
+}
+
+void rfs_trace_scope::finish(int64_t ret) {
+    rec.lat = tracer->now() - rec.ts;
+    rec.ret = ret;
+    if(fi != nullptr) {
+        rec.has_fh = 1;
+        rec.fh = fi->fh;
+        rec.flags = fi->flags;
+    }
+    if(fi2 != nullptr) {
+        rec.fh2 = fi2->fh;
+    }
+    tracer->record(rec, path, to);
+}
@@ -0,0 +1,160 @@
+//
+// Created by aln0 on 4/18/23.
+//
+
+#ifndef ROCKS_FUSE_RFS_TRACE_H
+#define ROCKS_FUSE_RFS_TRACE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+
+struct fuse_file_info;
+
+#define RFS_TRACE_MAGIC "RFSTRACE"
+#define RFS_TRACE_VERSION 1
+#define RFS_TRACE_RING_SZ (1 << 20)
+
+enum rfs_op : uint8_t {
+    op_getattr, op_mknod, op_mkdir, op_unlink, op_rmdir, op_rename, op_chmod, op_chown, op_truncate,
+    op_open, op_read, op_write, op_release, op_fsync, op_opendir, op_readdir, op_releasedir, op_create,
+    op_utimens, op_fallocate, op_copy_file_range, op_lseek,
+    op_getxattr, op_listxattr,
+    op_cnt
+};
+
+extern const char* const rfs_op_names[op_cnt];
+
+/**
+ * file header, followed by the records of all threads. each thread's records are in call order,
+ * the threads' runs are interleaved
+ */
+struct rfs_trace_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t rec_sz; // sizeof(rfs_trace_rec) of the writer
+    uint64_t start_ns; // CLOCK_REALTIME when tracing began
+};
+
+/**
+ * one call, followed by path_len bytes of path and to_len bytes of the second path (rename, copy_file_range) or of
+ * the attribute name (getxattr).
+ * off, size and aux carry the op's arguments: truncate keeps the size in size, chown the uid in aux and the gid
+ * in size, utimens the atime in off and the mtime in size (ns) with the UTIME_NOW and UTIME_OMIT bits of each in aux,
+ * fallocate and lseek the mode or whence in aux, getxattr and listxattr the buffer size in size
+ */
+struct rfs_trace_rec {
+    uint64_t ts; // ns since tracing began, at the call
+    uint64_t lat; // ns the call took
+    uint64_t fh; // file handle once the call returned, 0 without one
+    uint64_t fh2; // copy_file_range's destination
+    int64_t off;
+    int64_t off2;
+    uint64_t size;
+    int64_t ret;
+    uint32_t tid;
+    uint32_t aux; // mode, readdir flags, whence
+    uint32_t flags; // open flags of the file handle
+    rfs_op op;
+    uint8_t has_fh; // a file handle was passed in
+    uint16_t path_len;
+    uint16_t to_len;
+    uint8_t pad[6];
+};
+
+/**
+ * each thread appends its records to a ring of its own, lock free. a flusher thread drains the rings
+ * to the trace file, records that find their ring full are counted and dropped instead of waiting
+ */
+class rfs_tracer {
+public:
+    struct ring {
+        std::unique_ptr<char[]> buf;
+        size_t cap;
+        std::atomic<uint64_t> head{0}; // written by the owning thread
+        std::atomic<uint64_t> tail{0}; // written by the flusher
+        std::atomic<bool> dead{false}; // owning thread exited, freed once drained
+        explicit ring(size_t cap) : buf(new char[cap]), cap(cap) {}
+    };
+
+private:
+    FILE* out = nullptr;
+    uint64_t start = 0; // CLOCK_MONOTONIC ns
+    size_t ring_sz = 0;
+    std::atomic<bool> enabled{false};
+    std::atomic<uint64_t> dropped{0};
+
+    std::mutex lock; // guards rings and stop, not the file
+    std::condition_variable cv;
+    std::vector<std::shared_ptr<ring>> rings;
+    bool stop = false;
+    std::thread flusher;
+
+    ring* local_ring();
+    void drain(ring& r);
+    void flush_loop();
+
+public:
+    ~rfs_tracer();
+    int open(const char* path, size_t ring_sz = RFS_TRACE_RING_SZ);
+    void close();
+    bool on() const { return enabled.load(std::memory_order_relaxed); }
+    uint64_t now() const;
+    void record(rfs_trace_rec& rec, const char* path, const char* to);
+};
+
+/**
+ * traces the op it lives across, a no-op unless tracing is on
+ */
+class rfs_trace_scope {
+private:
+    rfs_tracer* tracer;
+    const char* path;
+    const char* to = nullptr;
+    const struct fuse_file_info* fi;
+    const struct fuse_file_info* fi2 = nullptr;
+    rfs_trace_rec rec;
+
+public:
+    rfs_trace_scope(rfs_tracer* tracer, rfs_op op, const char* path, const struct fuse_file_info* fi = nullptr,
+                    int64_t off = 0, uint64_t size = 0, uint32_t aux = 0);
+
+    /**
+     * the second file of rename and copy_file_range, the attribute name of getxattr
+     */
+    void second(const char* to_path, const struct fuse_file_info* to_fi = nullptr, int64_t to_off = 0) {
+        to = to_path;
+        fi2 = to_fi;
+        rec.off2 = to_off;
+    }
+
+    template<typename T>
+    T done(T ret) {
+        if(tracer != nullptr) {
+            finish(ret);
+        }
+        return ret;
+    }
+
+private:
+    void finish(int64_t ret);
+};
+
+/**
+ * a utimens time as traced, UTIME_NOW and UTIME_OMIT go to rfs_utime_bits
+ */
+inline int64_t rfs_utime_ns(const timespec& ts) {
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+inline uint32_t rfs_utime_bits(const timespec& ts) {
+    return ts.tv_nsec == UTIME_NOW ? 1 : ts.tv_nsec == UTIME_OMIT ? 2 : 0;
+}
+
+#endif //ROCKS_FUSE_RFS_TRACE_H
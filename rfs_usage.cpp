@@ -0,0 +1,156 @@
+//
+// Created by aln0 on 4/23/23.
+//
+
+#include "rocksdb_fs.h"
+#include "types.h"
+#include <sys/statvfs.h>
+#include <set>
+
+/**
+ * add a delta to the usage of each directory in [beg, end). the counters are merged, nothing is read,
+ * and they change in the same commit as the inodes that moved them
+ */
+void rocksdb_fs::stage_usage(rfs_txn &txn, vector<uint64_t>::const_iterator beg, vector<uint64_t>::const_iterator end,
+                             int64_t bytes, int64_t inodes) {
+    if(bytes == 0 && inodes == 0) {
+        return;
+    }
+    char key[USAGE_KEY_LEN];
+    rfs_usage_d delta = {bytes, inodes};
+    for(;beg != end;beg++) {
+        usage_key(key, *beg);
+        txn.batch(shard_of(*beg)).Merge(key, Slice((char*)&delta, sizeof(delta)));
+    }
+}
+
+/**
+ * @return -1 if the directory has no usage kept, usage is zero then
+ */
+int rocksdb_fs::read_usage(uint64_t ino, rfs_usage_d &usage) {
+    char key[USAGE_KEY_LEN];
+    usage_key(key, ino);
+    usage = {0, 0};
+    rocksdb::PinnableSlice rV;
+    if(!db_of(ino)->Get(ReadOptions(), db_of(ino)->DefaultColumnFamily(), key, &rV).ok() || rV.size() < sizeof(usage)) {
+        return -1;
+    }
+    memcpy(&usage, rV.data(), sizeof(usage));
+    return 0;
+}
+
+/**
+ * what the entry ino counts for in the usage of the directories above it. an open file counts as
+ * it was last written back, the rest of its changes are charged with its next write back.
+ * the open inodes at or below the entry are charged to the directories of lineage from then on,
+ * to none if it's empty. cache_lock must be held
+ * @param lineage the inos from the root down to the entry's new place, the entry included
+ */
+rfs_usage_d rocksdb_fs::relink_usage(uint64_t ino, file_type ftype, const vector<uint64_t> &lineage) {
+    rfs_usage_d usage = {0, 0};
+    if(ftype == dir) {
+        read_usage(ino, usage);
+        usage.inodes++;
+        for(auto& c : cache) {
+            if(c.second.i == nullptr) continue;
+            vector<uint64_t>& l = c.second.i->lineage;
+            auto it = std::find(l.begin(), l.end(), ino);
+            if(it == l.end()) continue;
+            if(lineage.empty()) {
+                l.clear();
+            } else {
+                vector<uint64_t> moved(lineage);
+                moved.insert(moved.end(), it + 1, l.end());
+                l = std::move(moved);
+            }
+        }
+        return usage;
+    }
+
+    auto c = cache.find(ino);
+    if(c != cache.end()) {
+        inode_t* inode = c->second.i.get();
+        if(inode->written) {
+            usage = {(int64_t)inode->written_sz, 1};
+        }
+        inode->lineage = lineage;
+        return usage;
+    }
+    auto inode = unique_ptr<inode_t>(read_inode(ino));
+    if(inode != nullptr) {
+        usage = {(int64_t)inode->file_sz, 1};
+    }
+    return usage;
+}
+
+/**
+ * count the usage of a directory by walking everything below it, and keep it for it and the directories below.
+ * only done once for a volume from before the usage was kept
+ */
+int rocksdb_fs::count_usage(uint64_t ino, rfs_usage_d &usage) {
+    usage = {0, 0};
+    auto inode = unique_ptr<inode_t>(read_inode(ino));
+    if(inode == nullptr) {
+        return -1;
+    }
+    size_t dir_cnt = inode->dentry_cnt();
+    for(size_t i = 0;i < dir_cnt;i++) {
+        rfs_dentry_d* d = inode->dentry_at(i);
+        if(d->ftype == dir) {
+            rfs_usage_d sub;
+            if(count_usage(d->ino, sub) != 0) {
+                return -1;
+            }
+            usage.bytes += sub.bytes;
+            usage.inodes += sub.inodes;
+        } else {
+            auto child = unique_ptr<inode_t>(read_inode(d->ino));
+            if(child != nullptr) {
+                usage.bytes += child->file_sz;
+            }
+        }
+        usage.inodes++;
+    }
+
+    char key[USAGE_KEY_LEN];
+    usage_key(key, ino);
+    return db_of(ino)->Put(WriteOptions(), key, Slice((char*)&usage, sizeof(usage))).ok() ? 0 : -1;
+}
+
+/**
+ * the usage of a directory as "name value" lines, one Get whatever its size
+ */
+string rocksdb_fs::usage_report(uint64_t ino) {
+    rfs_usage_d usage;
+    read_usage(ino, usage);
+    return "bytes " + std::to_string(usage.bytes) + "\ninodes " + std::to_string(usage.inodes) + "\n";
+}
+
+/**
+ * the fs as a whole, whatever path is given. used space is the usage of the root, the free space is what
+ * the devices of the shards have left. inodes aren't allocated ahead, as many fit as blocks do
+ */
+int rocksdb_fs::statfs(const char *path, struct statvfs *st) {
+    rfs_usage_d usage;
+    read_usage(ROOT_DENTRY_INO, usage);
+
+    // shards sharing a device count it once
+    uint64_t avail = 0;
+    std::set<unsigned long> devs;
+    for(DB* db : shards) {
+        struct statvfs dev;
+        if(::statvfs(db->GetName().c_str(), &dev) == 0 && devs.insert(dev.f_fsid).second) {
+            avail += (uint64_t)dev.f_bavail * dev.f_frsize;
+        }
+    }
+
+    memset(st, 0, sizeof(*st));
+    st->f_bsize = BLOCK_SZ;
+    st->f_frsize = BLOCK_SZ;
+    st->f_bfree = st->f_bavail = avail / BLOCK_SZ;
+    st->f_blocks = (std::max(usage.bytes, (int64_t)0) + BLOCK_SZ - 1) / BLOCK_SZ + st->f_bfree;
+    st->f_ffree = st->f_favail = st->f_bfree;
+    st->f_files = std::max(usage.inodes, (int64_t)0) + 1 + st->f_ffree; // the root counts too
+    st->f_namemax = MAX_FILE_NAME_LEN;
+    return 0;
+}
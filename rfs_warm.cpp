@@ -0,0 +1,97 @@
+//
+// Created by aln0 on 4/30/23.
+//
+
+#include "rocksdb_fs.h"
+#include "types.h"
+#include <chrono>
+#include <unistd.h>
+
+/**
+ * the inode cache knows what's hot, the block cache only by the offsets of tables, so a hot set is
+ * the inodes and the blocks of the files among them are read again from their start
+ */
+void rocksdb_fs::hot_loop() {
+    unique_lock<mutex> l(hot_lock);
+    while(!hot_stop) {
+        hot_cv.wait_for(l, std::chrono::seconds(HOT_SET_INTERVAL));
+        if(hot_stop) break;
+        l.unlock();
+        save_hot_set();
+        l.lock();
+    }
+}
+
+/**
+ * write the inos of the hottest conf.hot_set_sz inodes to HOT_SET_FILE, replacing the last ones whole
+ */
+int rocksdb_fs::save_hot_set() {
+    vector<uint64_t> inos = inode_lru->hottest(conf.hot_set_sz);
+    string path = shards[0]->GetName() + "/" + HOT_SET_FILE, tmp = path + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if(f == nullptr) {
+        RFS_DEBUG("rfs::save_hot_set", "open failed");
+        return -1;
+    }
+    uint32_t magic = HOT_SET_MAGIC;
+    bool ok = fwrite(&magic, sizeof(magic), 1, f) == 1;
+    ok = ok && fwrite(inos.data(), sizeof(uint64_t), inos.size(), f) == inos.size();
+    ok = fclose(f) == 0 && ok;
+    if(!ok || ::rename(tmp.c_str(), path.c_str()) != 0) {
+        RFS_DEBUG("rfs::save_hot_set", "write failed");
+        ::unlink(tmp.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * prefetch the hot set the last mount saved, a thread per shard so that mount returns right away.
+ * a set from another number of shards still reads right, an ino is found by its hash
+ */
+void rocksdb_fs::warm_up() {
+    string path = shards[0]->GetName() + "/" + HOT_SET_FILE;
+    FILE* f = fopen(path.c_str(), "rb");
+    if(f == nullptr) {
+        return;
+    }
+    uint32_t magic = 0;
+    vector<vector<uint64_t>> by_shard(shards.size());
+    if(fread(&magic, sizeof(magic), 1, f) == 1 && magic == HOT_SET_MAGIC) {
+        uint64_t ino;
+        while(fread(&ino, sizeof(ino), 1, f) == 1) {
+            by_shard[shard_of(ino)].push_back(ino);
+        }
+    }
+    fclose(f);
+    for(auto& inos : by_shard) {
+        if(inos.empty()) continue;
+        warmers.emplace_back(&rocksdb_fs::warm_shard, this, std::move(inos));
+    }
+}
+
+/**
+ * read the inodes of a shard into the inode cache, hottest first, and the start of the files among them into
+ * the block cache until their share of it is full. inodes dropped since are skipped
+ */
+void rocksdb_fs::warm_shard(vector<uint64_t> inos) {
+    uint64_t budget = block_cache == nullptr ? 0 : conf.block_cache_sz / shards.size();
+    vector<char> buf(HOT_FILE_PREFETCH);
+    vector<uint64_t> part;
+    vector<unique_ptr<inode_t>> inodes;
+    for(size_t beg = 0;beg < inos.size() && !hot_stop;beg += HOT_SET_BATCH) {
+        part.assign(inos.begin() + beg, inos.begin() + std::min(inos.size(), beg + HOT_SET_BATCH));
+        read_inodes(part, inodes);
+        for(size_t i = 0;i < part.size() && !hot_stop;i++) {
+            inode_t* inode = inodes[i].get();
+            if(inode == nullptr) continue;
+            warm_inodes++;
+            // a directory's entries came with its inode
+            if(S_ISDIR(inode->mode) || inode->file_sz == 0 || budget == 0) continue;
+            uint64_t n = std::min({(uint64_t)buf.size(), inode->file_sz, budget});
+            read_blocks(part[i], inode, 0, buf.data(), 0, n);
+            budget -= n;
+            warm_bytes += n;
+        }
+    }
+}
@@ -3,83 +3,330 @@
 //
 
 #include "rocksdb_fs.h"
+#include "rfs_merge.h"
+#include "rfs_layout.h"
+#include "rocksdb/rate_limiter.h"
+#include "rocksdb/table.h"
 #include "types.h"
+#include "fuse_lowlevel.h"
 #include <unistd.h>
 #include <time.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <algorithm>
 
-int rocksdb_fs::connect(const char *dbpath) {
+int rocksdb_fs::connect(const char *dbpath, const rfs_config& conf) {
+    return connect(vector<string>{dbpath}, conf);
+}
+
+/**
+ * open a db per path, each one a shard of the fs with a WAL, flushes and compactions of its own.
+ * the paths have to be given in the same order every time
+ */
+int rocksdb_fs::connect(const vector<string>& dbpaths, const rfs_config& conf) {
+    this->conf = conf;
+    inode_lru = make_unique<rfs_inode_cache>(conf.inode_cache_sz);
     rocksdb::Options options;
-    options.IncreaseParallelism();
+    options.IncreaseParallelism(conf.bg_jobs);
     options.OptimizeLevelStyleCompaction();
     options.create_if_missing = true;
-    Status s = rocksdb::DB::Open(options, dbpath, &db);
-    if(!s.ok()) {
-        RFS_DEBUG("rfs::connect", "DB connection failed");
+    options.merge_operator = make_shared<rfs_counter_merge>();
+    rocksdb::Env* env = rocksdb::Env::Default();
+    // the shards share the default env's thread pools, which IncreaseParallelism sized for one db
+    if(dbpaths.size() > 1) {
+        env->SetBackgroundThreads(conf.bg_jobs * dbpaths.size(), rocksdb::Env::LOW);
+        env->SetBackgroundThreads(dbpaths.size(), rocksdb::Env::HIGH);
+    }
+    if(conf.bg_io_limit > 0) {
+        // compactions yield the cpu and the disk to the ops, flushes keep their priority so writes don't stall
+        env->LowerThreadPoolIOPriority(rocksdb::Env::LOW);
+        env->LowerThreadPoolCPUPriority(rocksdb::Env::LOW);
+        options.bytes_per_sync = 1 << 20;
+    }
+
+    // one block cache for all the shards, so their memory is a single budget. blocks it evicts go to the
+    // secondary cache lz4 compressed, a miss there costs a decompression instead of a read
+    rocksdb::BlockBasedTableOptions table_options;
+    if(conf.block_cache_sz > 0) {
+        shared_ptr<rocksdb::SecondaryCache> secondary;
+        if(conf.secondary_cache_sz > 0) {
+            rocksdb::CompressedSecondaryCacheOptions secondary_opts;
+            secondary_opts.capacity = conf.secondary_cache_sz;
+            secondary_opts.compression_type = rocksdb::kLZ4Compression;
+            secondary = secondary_opts.MakeSharedSecondaryCache();
+        }
+        if(conf.hyper_clock) {
+            rocksdb::HyperClockCacheOptions cache_opts(conf.block_cache_sz, table_options.block_size);
+            cache_opts.secondary_cache = secondary;
+            block_cache = cache_opts.MakeSharedCache();
+        } else {
+            rocksdb::LRUCacheOptions cache_opts;
+            cache_opts.capacity = conf.block_cache_sz;
+            cache_opts.secondary_cache = secondary;
+            block_cache = cache_opts.MakeSharedCache();
+        }
+        // index and filter blocks are charged to the cache too, those of L0 are read by every lookup and stay
+        table_options.block_cache = block_cache;
+        table_options.cache_index_and_filter_blocks = true;
+        table_options.pin_l0_filter_and_index_blocks_in_cache = true;
+    } else {
+        table_options.no_block_cache = true;
+    }
+    options.table_factory.reset(rocksdb::NewBlockBasedTableFactory(table_options));
+    db_stats = rocksdb::CreateDBStatistics();
+    options.statistics = db_stats;
+    // flushed WAL files are archived rather than deleted, rfs_changes reads the changes since a sequence from them
+    if(conf.change_log_ttl > 0) {
+        options.WAL_ttl_seconds = conf.change_log_ttl;
+    }
+
+    // inodes get a column family of their own when asked to, or when a shard has one already. so does the index.
+    // tiered inodes stay on the fast path in theirs, of blocks unless meta_in_memory asks for plain tables. a
+    // shard keeps the tables and the cold path it was made with
+    rfs_layout want;
+    want.meta = conf.meta_in_memory || !conf.cold_path.empty();
+    want.plain_meta = conf.meta_in_memory;
+    want.index = conf.index;
+    string cold_path = conf.cold_path;
+    bool found = false;
+    for(size_t i = 0;i < dbpaths.size();i++) {
+        rfs_layout have = read_layout(dbpaths[i]);
+        if(have.meta && !found) {
+            want.plain_meta = have.plain_meta;
+            found = true;
+        }
+        want.meta = want.meta || have.meta;
+        want.index = want.index || have.index;
+        if(have.cold_path.empty()) {
+            continue;
+        }
+        // the levels on the cold path aren't anywhere else
+        if(cold_path.empty()) {
+            cold_path = have.cold_path.substr(0, have.cold_path.rfind('/'));
+        }
+        if(cold_path + "/" + std::to_string(i) != have.cold_path) {
+            fprintf(stderr, "rfs: --dbpath #%zu has its cold tables in %s, mounted with --cold_path=%s\n", i + 1,
+                    have.cold_path.c_str(), cold_path.c_str());
+            return -1;
+        }
+    }
+    this->conf.cold_path = cold_path;
+    want.hot_sz = conf.hot_sz;
+    options.create_missing_column_families = want.meta || want.index;
+    size_t meta_cf = want.meta ? 1 : 0, index_cf = meta_cf + 1;
+
+    for(auto& path : dbpaths) {
+        // a shard per device, each gets a limiter of its own. it tunes itself between a 20th of the limit and
+        // the limit by how often it had to hold back, flushes go before compactions. ops aren't charged
+        if(conf.bg_io_limit > 0) {
+            options.rate_limiter.reset(rocksdb::NewGenericRateLimiter(conf.bg_io_limit, 100 * 1000, 10,
+                                                                      rocksdb::RateLimiter::Mode::kAllIo, true));
+        }
+        want.cold_path = cold_path.empty() ? "" : cold_path + "/" + std::to_string(shards.size());
+        vector<rocksdb::ColumnFamilyDescriptor> cfs = layout_cfs(options, path, want);
+        DB* db;
+        vector<rocksdb::ColumnFamilyHandle*> handles;
+        Status s = rocksdb::DB::Open(options, path, cfs, &handles, &db);
+        if(!s.ok()) {
+            RFS_DEBUG("rfs::connect", "DB connection failed");
+            close();
+            return -1;
+        }
+        shards.push_back(db);
+        // the default column family is reached through db itself
+        if(want.meta) {
+            db->DestroyColumnFamilyHandle(handles[0]);
+        }
+        metas.push_back(handles[meta_cf]);
+        if(want.index) {
+            indexes.push_back(handles[index_cf]);
+        }
+    }
+    if(shards.empty() || check_shards() != 0) {
+        close();
         return -1;
     }
     return 0;
 }
 
 int rocksdb_fs::mount() {
-    if(db == nullptr) {
+    if(shards.empty()) {
+        return -1;
+    }
+    // an intent from before the inodes were moved has them for the default column family
+    recover_intents();
+    if(move_meta() != 0) {
         return -1;
     }
+
+    DB* db = shards[0];
     string rV;
-    Status s = db->Get(ReadOptions(), "0", &rV); // root dir entry resides in inode 0
+    Status s = db->Get(ReadOptions(), metas[0], "0", &rV); // root dir entry resides in inode 0
     super_block_d* super_d;
     if(s.code() == Status::Code::kNotFound) {
-        // mounted for the first time
+        // mounted for the first time, the format goes first so that a volume with a super block always has it
+        if(upgrade_format(true) != 0) {
+            return -1;
+        }
         super_d = new super_block_d;
         super_d->cur_ino = 1;
-        s = db->Put(WriteOptions(), "0", Slice((char*)(super_d), sizeof(super_block_d))); // write super block
+        s = db->Put(WriteOptions(), metas[0], "0", Slice((char*)(super_d), sizeof(super_block_d))); // write super block
         if(!s.ok()) {
             RFS_DEBUG("rfs::mount", "fs init failed");
             return -1;
         }
-        int ret = write_inode(1, nullptr);
+        inode_t root;
+        root.mode = S_IFDIR | 0755;
+        root.uid = getuid();
+        root.gid = getgid();
+        root.touch(RFS_ATIME | RFS_MTIME | RFS_CTIME);
+        int ret = write_inode(1, &root);
         if(ret != 0) {
             return ret;
         }
     } else {
+        if(upgrade_format(false) != 0) {
+            RFS_DEBUG("rfs::mount", "format upgrade failed");
+            return -1;
+        }
         super_d = (super_block_d*)(rV.data());
     }
     super.f_counter = 0;
     super.cur_ino = super_d->cur_ino + FILE_COUNTER_THRESHOLD;
-    super.root_dentry.ftype = file_type::dir;
-    super.root_dentry.ino = 1;
-    strcpy(super.root_dentry.name, "/");
     if(super_d != (super_block_d*)rV.data()) delete super_d;
+    // the next mount has to start past the inos this one hands out before alloc_ino writes the super block
+    s = db->Put(WriteOptions(), metas[0], "0", Slice((char*)&super, sizeof(super_block_d)));
+    if(!s.ok()) {
+        RFS_DEBUG("rfs::mount", "super block write failed");
+        return -1;
+    }
+    sweep_chunks();
+    recover_orphans();
+
+    // a volume from before the usage was kept, or imported into since, is walked once to count it
+    rfs_usage_d usage;
+    if(read_usage(ROOT_DENTRY_INO, usage) != 0 && count_usage(ROOT_DENTRY_INO, usage) != 0) {
+        RFS_DEBUG("rfs::mount", "usage count failed");
+        return -1;
+    }
+    if(!indexes.empty() && build_index() != 0) {
+        RFS_DEBUG("rfs::mount", "index build failed");
+        return -1;
+    }
+    if(!conf.cold_path.empty()) {
+        tier_stop = false;
+        tier_thread = std::thread(&rocksdb_fs::tier_loop, this);
+    }
+    if(conf.hot_set_sz > 0) {
+        hot_stop = false;
+        warm_up();
+        hot_thread = std::thread(&rocksdb_fs::hot_loop, this);
+    }
+    async_stop = false;
+    for(int i = 0;i < conf.async_threads;i++) {
+        async_threads.emplace_back(&rocksdb_fs::async_loop, this);
+    }
     return 0;
 }
 
 int rocksdb_fs::close() {
-    Status s = db->Close();
-    if(!s.ok()) {
-        return -1;
+    int ret = 0;
+    if(!async_threads.empty()) {
+        {
+            unique_lock<mutex> l(async_lock);
+            async_stop = true;
+        }
+        async_cv.notify_all();
+        for(auto& t : async_threads) {
+            t.join();
+        }
+        async_threads.clear();
     }
-    return 0;
+    if(orphan_thread.joinable()) {
+        orphan_stop = true;
+        orphan_thread.join();
+    }
+    if(tier_thread.joinable()) {
+        {
+            unique_lock<mutex> l(tier_lock);
+            tier_stop = true;
+        }
+        tier_cv.notify_one();
+        tier_thread.join();
+    }
+    if(hot_thread.joinable()) {
+        {
+            unique_lock<mutex> l(hot_lock);
+            hot_stop = true;
+        }
+        hot_cv.notify_one();
+        hot_thread.join();
+        for(auto& t : warmers) {
+            t.join();
+        }
+        warmers.clear();
+        // the last one, with what this mount read
+        save_hot_set();
+    }
+    for(size_t i = 0;i < shards.size();i++) {
+        shards[i]->DestroyColumnFamilyHandle(metas[i]);
+        if(i < indexes.size()) shards[i]->DestroyColumnFamilyHandle(indexes[i]);
+        if(!shards[i]->Close().ok()) {
+            ret = -1;
+        }
+    }
+    shards.clear();
+    metas.clear();
+    indexes.clear();
+    return ret;
 }
 
-int rocksdb_fs::mkdir(const char* path, mode_t mode) {
+int rocksdb_fs::mkdir(const char* path, mode_t mode, uid_t uid, gid_t gid) {
     uint64_t ino;
-     return mknod(path, mode, &ino);
+     return mknod(path, mode & ~S_IFMT, uid, gid, &ino);
+}
+
+/**
+ * fill the attributes of a file, inodes written before modes were kept get the old defaults
+ */
+void rocksdb_fs::fill_stat(file_type ftype, const inode_t* inode, struct stat* stat) {
+    if(inode->mode != 0) {
+        stat->st_mode = inode->mode;
+        stat->st_uid = inode->uid;
+        stat->st_gid = inode->gid;
+    } else {
+        stat->st_mode = (ftype == dir ? S_IFDIR : S_IFREG) | 0777;
+        stat->st_uid = getuid();
+        stat->st_gid = getgid();
+    }
+    stat->st_size = ftype == dir ? inode->used_dat_sz : inode->file_sz;
+    stat->st_nlink = ftype == dir ? 2 : 1;
+    stat->st_blocks = 1;
+    stat->st_atim = inode->atime;
+    stat->st_mtim = inode->mtime;
+    stat->st_ctim = inode->ctime;
 }
 
 int rocksdb_fs::getattr(const char *path, struct stat *stat) {
+    string_view query;
+    if(is_find_path(path, query)) {
+        return find_getattr(query, stat);
+    }
 
     bool lock = false;
-    int k;
-    auto p_path = unique_ptr<char>(parent_path(path, k));
+    string_view name;
+    string_view p_path = parent_path(path, name);
     shared_ptr<inode_t> parent_inode;
 
     cache_lock.lock();
-    if(dir_caches.find(p_path.get()) != dir_caches.end()) {
-        parent_inode = dir_caches[p_path.get()].i;
+    auto dc = dir_caches.find(p_path);
+    if(dc != dir_caches.end()) {
+        parent_inode = dc->second.i;
         lock = true;
     } else {
         cache_lock.unlock();
         bool found;
-        auto parent_dentry = lookup(p_path.get(), found);
+        auto parent_dentry = lookup(p_path, found);
 
         if(!found) {
             return -ENOENT;
@@ -88,37 +335,48 @@ int rocksdb_fs::getattr(const char *path, struct stat *stat) {
         parent_inode = parent_dentry->inode;
     }
 
-    rfs_dentry_d* target_dentry;
-    if(path[1] == '\0') {
-        target_dentry = &super.root_dentry;
-    } else {
-        target_dentry = find_dentry_d(parent_inode.get(), path + k + 1);
+    uint64_t target_ino = ROOT_DENTRY_INO;
+    file_type target_ftype = dir;
+    if(path[1] != '\0') {
+        rfs_dentry_d* target_dentry = find_dentry_d(parent_inode.get(), name);
         if(target_dentry == nullptr) {
             if(lock) cache_lock.unlock();
             return -ENOENT;
         }
+        target_ino = target_dentry->ino;
+        target_ftype = target_dentry->ftype;
     }
+    if(lock) cache_lock.unlock();
 
-    auto target_inode = unique_ptr<inode_t>(read_inode(target_dentry->ino));
-
-    if(target_dentry->ftype == dir) {
-        stat->st_mode = S_IFDIR | 0777;
-    } else {
-        stat->st_mode = S_IFREG | 0777;
+    // an open file's cached inode is newer than the one in db
+    shared_ptr<inode_t> target_inode;
+    cache_lock.lock_shared();
+    if(cache.find(target_ino) != cache.end()) {
+        target_inode = cache[target_ino].i;
+    }
+    cache_lock.unlock_shared();
+    if(target_inode == nullptr) {
+        target_inode = shared_ptr<inode_t>(read_inode(target_ino));
+        if(target_inode == nullptr) {
+            return -EIO;
+        }
     }
-    stat->st_blocks = 1;
-    stat->st_gid = getgid();
-    stat->st_uid = getuid();
-    stat->st_nlink = 1;
-    stat->st_size = target_inode->used_dat_sz;
 
+    fill_stat(target_ftype, target_inode.get(), stat);
+    stat->st_ino = target_ino;
     return 0;
 }
 
 int rocksdb_fs::opendir(const char *path, fuse_file_info *fi) {
+    string_view query;
+    if(is_find_path(path, query)) {
+        if(!query.empty()) return -ENOTDIR;
+        // the queries aren't listed
+        fi->fh = RFS_FIND_FH;
+        return 0;
+    }
     bool found;
-    auto path_cpy = unique_ptr<char>(strdup(path));
-    auto dentry = lookup(path_cpy.get(), found);
+    auto dentry = lookup(path, found);
 
     if(!found) {
         return -ENOENT;
@@ -136,7 +394,7 @@ int rocksdb_fs::opendir(const char *path, fuse_file_info *fi) {
             cache[dentry->ino].ref_cnt++;
         } else {
             cache[dentry->ino] = {1, dentry->inode};
-            dir_caches[path] = {0, dentry->inode};
+            dir_caches[path] = {dentry->inode};
         }
         cache_lock.unlock();
     }
@@ -149,10 +407,12 @@ int rocksdb_fs::releasedir(const char *path, fuse_file_info *fi) {
     if(cache.find(fi->fh) != cache.end()) {
         // if cache's ref_cnt reaches to 0, the cache will be released
         if(--cache[fi->fh].ref_cnt == 0) {
-            write_inode(fi->fh, cache[fi->fh].i.get());
+            // a file only read keeps nothing to write back
+            if(cache[fi->fh].i->attr_dirty) write_inode(fi->fh, cache[fi->fh].i.get());
             // release directory cache
-            if(dir_caches.find(path) != dir_caches.end()) {
-                dir_caches.erase(path);
+            auto dc = dir_caches.find(string_view(path));
+            if(dc != dir_caches.end()) {
+                dir_caches.erase(dc);
             }
             cache.erase(fi->fh);
         }
@@ -163,6 +423,9 @@ int rocksdb_fs::releasedir(const char *path, fuse_file_info *fi) {
 
 int rocksdb_fs::readdir(const char* path, void* buf, fuse_fill_dir_t filter,
                         off_t off, struct fuse_file_info* fi, fuse_readdir_flags flags) {
+    if(fi->fh == RFS_FIND_FH) {
+        return 0;
+    }
     bool found;
     bool lock = false;
     shared_ptr<inode_t> dir_inode;
@@ -172,8 +435,7 @@ int rocksdb_fs::readdir(const char* path, void* buf, fuse_fill_dir_t filter,
         lock = true;
     } else {
         cache_lock.unlock_shared();
-        auto path_cpy = unique_ptr<char>(strdup(path));
-        auto dentry = lookup(path_cpy.get(), found);
+        auto dentry = lookup(path, found);
         if(!found) {
             return -ENOENT;
         }
@@ -185,59 +447,60 @@ int rocksdb_fs::readdir(const char* path, void* buf, fuse_fill_dir_t filter,
         dir_inode = dentry->inode;
     }
 
-    auto dentry_cursor = (rfs_dentry_d*) dir_inode->data();
-    dentry_cursor += ((dir_caches[path].off) + off);
-    unique_ptr<inode_t> cur_inode;
-    // include the deleted directory in case of stating and deleting simultaneously.
-    size_t dir_cnt = (dir_inode->size - dir_inode->attr_sz) / sizeof(rfs_dentry_d);
+    // the offsets are taken from the names, entries added or dropped meanwhile don't shift the others.
+    // the inodes are read READDIR_BATCH at a time, about what the buffer takes
+    vector<uint64_t> inos;
+    vector<unique_ptr<inode_t>> inodes;
     struct stat stat = {};
-    int ret;
-
-    if(dir_cnt <= off) {
-        goto unlock;
-    }
-
-    for(off_t i = off;i < dir_cnt; dentry_cursor++, i++) {
-        if(dentry_cursor->ftype == dir) {
-            stat.st_mode = S_IFDIR | 0777;
-        } else {
-            stat.st_mode = S_IFREG | 0777;
+    size_t dir_cnt = dir_inode->dentry_cnt();
+    bool full = false;
+    for(size_t beg = dir_inode->seek_dentry_d(off);beg < dir_cnt && !full;beg += READDIR_BATCH) {
+        size_t end = std::min(dir_cnt, beg + READDIR_BATCH);
+        inos.clear();
+        for(size_t i = beg;i < end;i++) {
+            inos.push_back(dir_inode->dentry_at(i)->ino);
         }
-        cur_inode = unique_ptr<inode_t>(read_inode(dentry_cursor->ino));
-        stat.st_nlink = 1;
-        stat.st_size = cur_inode->used_dat_sz;
-        stat.st_blocks = 1;
-        ret = filter(buf, dentry_cursor->name, &stat, i + 1, FUSE_FILL_DIR_PLUS);
-        if(ret == 1) {
-            goto unlock;
+        read_inodes(inos, inodes);
+        for(size_t i = beg;i < end;i++) {
+            rfs_dentry_d* dentry_cursor = dir_inode->dentry_at(i);
+            inode_t* cur_inode = inodes[i - beg].get();
+            if(cur_inode == nullptr) continue;
+            fill_stat(dentry_cursor->ftype, cur_inode, &stat);
+            stat.st_ino = dentry_cursor->ino;
+            if(filter(buf, dentry_cursor->name, &stat, dir_inode->dentry_off(i), FUSE_FILL_DIR_PLUS) == 1) {
+                full = true;
+                break;
+            }
         }
     }
 
-    unlock:
     if(lock) cache_lock.unlock_shared();
     return 0;
 }
 
 
-int rocksdb_fs::mknod(const char *path, mode_t mode, uint64_t* ino) {
+/**
+ * @param lineage set to the inos from the root down to the new inode
+ */
+int rocksdb_fs::mknod(const char *path, mode_t mode, uid_t uid, gid_t gid, uint64_t* ino, vector<uint64_t>* lineage) {
     bool found;
-    int k;
     shared_ptr<inode_t> parent_inode;
     uint64_t write_back_ino = 0;
-    auto path_cpy = unique_ptr<char>(strdup(path));
-    auto par_path = unique_ptr<char>(parent_path(path, k));
-
-    int f_name_len = strlen(path_cpy.get() + k + 1);
-    if(f_name_len > MAX_FILE_NAME_LEN) {
-        // truncate the file_name
-        auto end = k + 1 + MAX_FILE_NAME_LEN;
-        path_cpy.get()[end] = '\0';
+    string_view name;
+    string_view par_path = parent_path(path, name);
+    if(name.size() > MAX_FILE_NAME_LEN) {
+        return -ENAMETOOLONG;
+    }
+    string_view query;
+    if(is_find_path(path, query)) {
+        return -EPERM;
     }
 
     cache_lock.lock();
-    if(dir_caches.find(par_path.get()) != dir_caches.end()) {
-        parent_inode = dir_caches[par_path.get()].i;
-        rfs_dentry_d* target_dentry = find_dentry_d(parent_inode.get(), path_cpy.get() + k + 1);
+    auto dc = dir_caches.find(par_path);
+    if(dc != dir_caches.end()) {
+        parent_inode = dc->second.i;
+        rfs_dentry_d* target_dentry = find_dentry_d(parent_inode.get(), name);
 
         if(target_dentry != nullptr) {
             // if inode is read from cached, the cache lock needs to be released
@@ -247,7 +510,7 @@ int rocksdb_fs::mknod(const char *path, mode_t mode, uint64_t* ino) {
 
     } else {
         cache_lock.unlock();
-        auto last_dentry = lookup(path_cpy.get(), found);
+        auto last_dentry = lookup(string_view(path, name.data() + name.size() - path), found);
 
         if (found) {
             return -EEXIST;
@@ -257,15 +520,29 @@ int rocksdb_fs::mknod(const char *path, mode_t mode, uint64_t* ino) {
         parent_inode = last_dentry->inode;
     }
 
-    unique_ptr<rfs_dentry_d> dentry_d;
-    if(mode & S_IFREG) {
-        dentry_d = unique_ptr<rfs_dentry_d>(new_dentry_d(path_cpy.get() + k + 1, reg));
-    } else {
-        dentry_d = unique_ptr<rfs_dentry_d>(new_dentry_d(path_cpy.get() + k + 1, dir));
+    file_type ftype = (mode & S_IFREG) ? reg : dir;
+    uint64_t new_ino = alloc_ino();
+
+    inode_t new_inode;
+    new_inode.dedup = conf.dedup && ftype == reg;
+    new_inode.mode = (ftype == reg ? S_IFREG : S_IFDIR) | (mode & 07777);
+    new_inode.uid = uid;
+    new_inode.gid = gid;
+    new_inode.touch(RFS_ATIME | RFS_MTIME | RFS_CTIME);
+    new_inode.lineage = parent_inode->lineage;
+    new_inode.lineage.push_back(new_ino);
+    rfs_txn txn;
+    stage_inode(txn, new_ino, &new_inode, true);
+    if(!parent_inode->lineage.empty()) {
+        if(!indexes.empty()) stage_entry(txn, new_ino, parent_inode->lineage.back(), name);
+        stage_change(txn, change_create, new_ino, ftype, parent_inode->lineage.back(), name);
     }
-
-    write_inode(dentry_d->ino, nullptr);
-    parent_inode->append_dentry_d(dentry_d.get());
+    if(commit(txn) == 0) {
+        written_back(new_ino, &new_inode);
+    }
+    parent_inode->add_dentry_d(new_ino, ftype, name);
+    parent_inode->linked.push_back(new_ino);
+    parent_inode->touch(RFS_MTIME | RFS_CTIME);
 
     if(write_back_ino) {
         write_inode(write_back_ino, parent_inode.get());
@@ -273,7 +550,12 @@ int rocksdb_fs::mknod(const char *path, mode_t mode, uint64_t* ino) {
         cache_lock.unlock();
     }
 
-    *ino = dentry_d->ino;
+    if(ino != nullptr) {
+        *ino = new_ino;
+    }
+    if(lineage != nullptr) {
+        *lineage = std::move(new_inode.lineage);
+    }
 
     return 0;
 }
@@ -281,16 +563,17 @@ int rocksdb_fs::mknod(const char *path, mode_t mode, uint64_t* ino) {
 int rocksdb_fs::write(const char* path, const char *buf, size_t size, off_t offset, fuse_file_info* fi) {
     shared_ptr<inode_t> inode;
     unique_ptr<rfs_dentry> dentry;
+    uint64_t ino;
     bool lock = false;
 
     if((fi->flags & O_DIRECT) == 0) {
         cache_lock.lock();
         inode = cache[fi->fh].i;
+        ino = fi->fh;
         lock = true;
     } else {
         bool found;
-        auto path_cpy = unique_ptr<char>(strdup(path));
-        dentry = lookup(path_cpy.get(), found);
+        dentry = lookup(path, found);
         if(!found) {
             return -ENOENT;
         }
@@ -299,24 +582,37 @@ int rocksdb_fs::write(const char* path, const char *buf, size_t size, off_t offs
         }
 
         inode = dentry->inode;
+        ino = dentry->ino;
     }
 
-    if(offset > inode->size) {
+    size_t n_size = offset + size;
+    if(n_size > MAX_FILE_SZ) {
         if(lock) cache_lock.unlock();
-        return 0;
+        return -EFBIG;
     }
 
-    size_t n_size = offset + size;
-    if(n_size > 1 << 12) {
+    if(unshare_blocks(ino, inode.get()) != 0) {
         if(lock) cache_lock.unlock();
-        return -EFBIG;
+        return -EIO;
     }
 
+    // blocks partially covered keep the rest of their bytes, a write past EOF leaves a hole behind
+    if(offset % BLOCK_SZ != 0 || size < BLOCK_SZ) {
+        load_block(ino, inode.get(), offset / BLOCK_SZ);
+    }
+    if(n_size % BLOCK_SZ != 0) {
+        load_block(ino, inode.get(), n_size / BLOCK_SZ);
+    }
     inode->write_data(buf, size, offset);
+    // cached until the file is written back, so timestamps cost no extra db write
+    inode->touch(RFS_MTIME | RFS_CTIME);
 
     if(fi->flags & O_DIRECT) {
         write_inode(dentry->ino, dentry->inode.get());
     } else {
+        if(inode->dirty_sz >= DIRTY_FLUSH_THRESHOLD) {
+            write_inode(ino, inode.get());
+        }
         cache_lock.unlock();
     }
 
@@ -324,17 +620,24 @@ int rocksdb_fs::write(const char* path, const char *buf, size_t size, off_t offs
 }
 
 int rocksdb_fs::read(const char *path, char *buf, size_t size, off_t offset, fuse_file_info* fi) {
+    if(fi->fh & RFS_FIND_FH) {
+        return find_read(buf, size, offset, fi);
+    }
     shared_ptr<inode_t> inode;
+    uint64_t ino = fi->fh;
     bool lock = false;
     if((fi->flags & O_DIRECT) == 0) {
         cache_lock.lock_shared();
-        inode = cache[fi->fh].i;
-        lock = true;
+        if(cache.find(fi->fh) != cache.end()) {
+            inode = cache[fi->fh].i;
+            lock = true;
+        } else {
+            cache_lock.unlock_shared();
+        }
     }
     if(inode == nullptr) {
         bool found;
-        auto path_cpy = unique_ptr<char>(strdup(path));
-        auto dentry = lookup(path_cpy.get(), found);
+        auto dentry = lookup(path, found);
 
         if(!found) {
             return -ENOENT;
@@ -344,33 +647,47 @@ int rocksdb_fs::read(const char *path, char *buf, size_t size, off_t offset, fus
             return -EISDIR;
         }
         inode = dentry->inode;
+        ino = dentry->ino;
     }
 
-    if(offset >= inode->size) {
+    if(offset >= inode->file_sz) {
         if(lock) cache_lock.unlock_shared();
         return 0;
     }
 
-    size = std::min(inode->size - offset, size);
-    memcpy(buf, inode->data() + offset, size);
+    size = std::min(inode->file_sz - offset, size);
+    read_blocks(ino, inode.get(), offset / BLOCK_SZ, buf, offset % BLOCK_SZ, size);
 
+    bool stale = inode->atime_stale();
     if(lock) cache_lock.unlock_shared();
+    if(stale) {
+        // an open file's atime is written back with it
+        cache_lock.lock();
+        auto c = cache.find(ino);
+        if(c != cache.end()) {
+            c->second.i->touch(RFS_ATIME);
+        } else {
+            inode->touch(RFS_ATIME);
+            write_inode(ino, inode.get());
+        }
+        cache_lock.unlock();
+    }
     return size;
 }
 
 int rocksdb_fs::rmdir(const char *path) {
     bool found;
-    int k;
     uint64_t write_back_ino = 0;
     shared_ptr<inode_t> parent_inode;
-    auto p_path = unique_ptr<char>(parent_path(path, k));
-    string key = p_path.get();
+    string_view name;
+    string_view p_path = parent_path(path, name);
     cache_lock.lock();
-    if(dir_caches.find(key) != dir_caches.end()) {
-        parent_inode = dir_caches[key].i;
+    auto dc = dir_caches.find(p_path);
+    if(dc != dir_caches.end()) {
+        parent_inode = dc->second.i;
     } else {
         cache_lock.unlock();
-        auto parent_dentry = lookup(p_path.get(), found);
+        auto parent_dentry = lookup(p_path, found);
 
         if(!found) {
             return -ENOENT;
@@ -381,22 +698,34 @@ int rocksdb_fs::rmdir(const char *path) {
     }
 
 
-    rfs_dentry_d* target_dentry = find_dentry_d(parent_inode.get(), path + k + 1);
-
-    if(target_dentry == nullptr) {
-        return -ENOENT;
-    }
+    rfs_dentry_d* target_dentry = find_dentry_d(parent_inode.get(), name);
 
-    if(target_dentry->ftype != dir) {
-        return -ENOTDIR;
+    if(target_dentry == nullptr || target_dentry->ftype != dir) {
+        if(!write_back_ino) cache_lock.unlock();
+        return target_dentry == nullptr ? -ENOENT : -ENOTDIR;
     }
 
-    drop_dentry_d(target_dentry);
+    uint64_t target_ino = target_dentry->ino;
     parent_inode->drop_dentry_d(target_dentry);
+    parent_inode->touch(RFS_MTIME | RFS_CTIME);
 
     if(write_back_ino) {
-        write_inode(write_back_ino, parent_inode.get());
+        cache_lock.lock();
+        rfs_usage_d usage = relink_usage(target_ino, dir, {});
+        cache_lock.unlock();
+        write_unlinked(write_back_ino, parent_inode.get(), target_ino, dir, name, usage);
+        drop_dentry_d(target_ino, dir);
     } else {
+        // the directory is written back once it's released, its usage changes now
+        rfs_usage_d usage = relink_usage(target_ino, dir, {});
+        rfs_txn txn;
+        stage_usage(txn, parent_inode->lineage.begin(), parent_inode->lineage.end(), -usage.bytes, -usage.inodes);
+        if(!parent_inode->lineage.empty()) {
+            stage_change(txn, change_unlink, target_ino, dir, parent_inode->lineage.back(), name);
+        }
+        stage_unindex(txn, target_ino);
+        commit(txn);
+        drop_dentry_d(target_ino, dir);
         cache_lock.unlock();
     }
 
@@ -407,28 +736,28 @@ int rocksdb_fs::rmdir(const char *path) {
 int rocksdb_fs::unlink(const char *path) {
 
     bool found;
-    int k;
     // if write_back_ino is not equal to 0, it means that the parent inode is not cached
     uint64_t write_back_ino = 0;
-    auto p_path = unique_ptr<char>(parent_path(path, k));
+    string_view name;
+    string_view p_path = parent_path(path, name);
     shared_ptr<inode_t> parent_inode;
 
     cache_lock.lock();
-    if(dir_caches.find(p_path.get()) != dir_caches.end()) {
-        parent_inode = dir_caches[p_path.get()].i;
+    auto dc = dir_caches.find(p_path);
+    if(dc != dir_caches.end()) {
+        parent_inode = dc->second.i;
     } else {
         cache_lock.unlock();
-        auto parent_dentry = lookup(p_path.get(), found);
-        write_back_ino = parent_dentry->ino;
-
-        if(!found) {
+        auto parent_dentry = lookup(p_path, found);
+        if(parent_dentry == nullptr || !found) {
             return -ENOENT;
         }
+        write_back_ino = parent_dentry->ino;
 
         parent_inode = parent_dentry->inode;
     }
 
-    rfs_dentry_d* target_dentry = find_dentry_d(parent_inode.get(), path + k + 1);
+    rfs_dentry_d* target_dentry = find_dentry_d(parent_inode.get(), name);
 
     if(target_dentry == nullptr) {
         // if inode is read from cached, the cache lock needs to be released
@@ -436,13 +765,27 @@ int rocksdb_fs::unlink(const char *path) {
         return -ENOENT;
     }
 
-    drop_inode(target_dentry->ino);
+    uint64_t target_ino = target_dentry->ino;
+    file_type target_ftype = target_dentry->ftype;
     parent_inode->drop_dentry_d(target_dentry);
+    parent_inode->touch(RFS_MTIME | RFS_CTIME);
 
     if(write_back_ino) {
-        write_inode(write_back_ino, parent_inode.get());
+        cache_lock.lock();
+        rfs_usage_d usage = relink_usage(target_ino, target_ftype, {});
+        cache_lock.unlock();
+        write_unlinked(write_back_ino, parent_inode.get(), target_ino, target_ftype, name, usage);
+        drop_inode(target_ino);
     } else {
-        dir_caches[p_path.get()].off--; // correct the real offset
+        rfs_usage_d usage = relink_usage(target_ino, target_ftype, {});
+        rfs_txn txn;
+        stage_usage(txn, parent_inode->lineage.begin(), parent_inode->lineage.end(), -usage.bytes, -usage.inodes);
+        if(!parent_inode->lineage.empty()) {
+            stage_change(txn, change_unlink, target_ino, target_ftype, parent_inode->lineage.back(), name);
+        }
+        stage_unindex(txn, target_ino);
+        commit(txn);
+        drop_inode(target_ino);
         cache_lock.unlock();
     }
 
@@ -456,52 +799,137 @@ int rocksdb_fs::rename(const char* src, const char* dst) {
 
     // get source parent directory entry and source file directory entry
     bool found;
-    int k;
-    auto src_parent_path = unique_ptr<char>(parent_path(src, k));
-    auto src_parent_dentry = lookup(src_parent_path.get(), found);
+    string_view src_name, dst_name;
+    string_view src_parent_path = parent_path(src, src_name);
+    auto src_parent_dentry = lookup(src_parent_path, found);
 
     if(!found) {
         return -ENOENT;
     }
 
-    rfs_dentry_d* src_file_dentry = find_dentry_d(src_parent_dentry->inode.get(), src + k + 1);
+    rfs_dentry_d* src_file_dentry = find_dentry_d(src_parent_dentry->inode.get(), src_name);
     if(src_file_dentry == nullptr) {
         return -ENOENT;
     }
+    // the entry moves around as others are added
+    uint64_t moved_ino = src_file_dentry->ino;
+    file_type moved_ftype = src_file_dentry->ftype;
 
     // get destination parent directory entry and destination file directory entry
-    auto dst_parent_path = unique_ptr<char>(parent_path(dst, k));
+    string_view dst_parent_path = parent_path(dst, dst_name);
+    if(dst_name.size() > MAX_FILE_NAME_LEN) {
+        return -ENAMETOOLONG;
+    }
     // judge if the operation is just renaming
-    if(strcmp(src_parent_path.get(), dst_parent_path.get()) == 0) {
-        strcpy(src_file_dentry->name, dst + k + 1);
-        write_inode(src_parent_dentry->ino, src_parent_dentry->inode.get());
+    if(src_parent_path == dst_parent_path) {
+        inode_t* parent = src_parent_dentry->inode.get();
+        rfs_txn txn;
+        rfs_dentry_d* dst_file_dentry = find_dentry_d(parent, dst_name);
+        uint64_t replaced = 0;
+        if(dst_file_dentry == nullptr) {
+            parent->add_dentry_d(src_file_dentry->ino, src_file_dentry->ftype, dst_name);
+        } else {
+            int ret = check_replace(src_file_dentry, dst_file_dentry);
+            if(ret != 0) {
+                return ret;
+            }
+            // the file replaced leaves the usage of the directories above
+            replaced = dst_file_dentry->ino;
+            cache_lock.lock();
+            rfs_usage_d dropped = relink_usage(dst_file_dentry->ino, dst_file_dentry->ftype, {});
+            cache_lock.unlock();
+            stage_usage(txn, parent->lineage.begin(), parent->lineage.end(), -dropped.bytes, -dropped.inodes);
+            overwrite_dentry_d(txn, src_parent_dentry.get(), src_file_dentry, dst_file_dentry);
+        }
+        // adding moved the entries around
+        parent->drop_dentry_d(find_dentry_d(parent, src_name));
+        parent->touch(RFS_MTIME | RFS_CTIME);
+        stage_inode(txn, src_parent_dentry->ino, parent);
+        if(!indexes.empty()) {
+            stage_entry(txn, moved_ino, src_parent_dentry->ino, dst_name, src_name);
+        }
+        stage_change(txn, change_rename, moved_ino, moved_ftype, src_parent_dentry->ino, src_name,
+                     src_parent_dentry->ino, dst_name);
+        if(commit(txn) != 0) {
+            return -EIO;
+        }
+        written_back(src_parent_dentry->ino, parent);
+        if(replaced) {
+            drop_inode(replaced);
+        }
         return 0;
     }
 
-    auto dst_parent_dentry = lookup(dst_parent_path.get(), found);
+    auto dst_parent_dentry = lookup(dst_parent_path, found);
     if(!found) {
         return -ENOENT;
     }
 
+    // the entry's usage moves to the directories the destination is under and the source isn't, an open
+    // inode at or below it is charged to those from now on. the file replaced leaves the usage of them all
+    rfs_dentry_d* dst_file_dentry = find_dentry_d(dst_parent_dentry->inode.get(), dst_name);
+    uint64_t replaced = 0;
+    if(dst_file_dentry != nullptr) {
+        int ret = check_replace(src_file_dentry, dst_file_dentry);
+        if(ret != 0) {
+            return ret;
+        }
+        replaced = dst_file_dentry->ino;
+    }
+    const vector<uint64_t>& from = src_parent_dentry->inode->lineage;
+    const vector<uint64_t>& to = dst_parent_dentry->inode->lineage;
+    vector<uint64_t> moved_lineage(to);
+    moved_lineage.push_back(src_file_dentry->ino);
+    rfs_usage_d dropped = {0, 0};
+    cache_lock.lock();
+    rfs_usage_d moved = relink_usage(src_file_dentry->ino, src_file_dentry->ftype, moved_lineage);
+    if(dst_file_dentry != nullptr) {
+        dropped = relink_usage(dst_file_dentry->ino, dst_file_dentry->ftype, {});
+    }
+    cache_lock.unlock();
+    rfs_txn txn;
+    size_t common = std::mismatch(from.begin(), from.end(), to.begin(), to.end()).first - from.begin();
+    stage_usage(txn, from.begin() + common, from.end(), -moved.bytes, -moved.inodes);
+    stage_usage(txn, to.begin() + common, to.end(), moved.bytes, moved.inodes);
+    stage_usage(txn, to.begin(), to.end(), -dropped.bytes, -dropped.inodes);
+
     // process destination
-    rfs_dentry_d* dst_file_dentry = find_dentry_d(dst_parent_dentry->inode.get(), dst + k + 1);
     if(dst_file_dentry == nullptr) {
-        dst_parent_dentry->inode->append_dentry_d(src_file_dentry);
-        write_inode(dst_parent_dentry->ino, dst_parent_dentry->inode.get());
+        dst_parent_dentry->inode->add_dentry_d(src_file_dentry->ino, src_file_dentry->ftype, dst_name);
     } else {
-        overwrite_dentry_d(dst_parent_dentry.get(), src_file_dentry, dst_file_dentry);
+        overwrite_dentry_d(txn, dst_parent_dentry.get(), src_file_dentry, dst_file_dentry);
     }
-
+    dst_parent_dentry->inode->touch(RFS_MTIME | RFS_CTIME);
     src_parent_dentry->inode->drop_dentry_d(src_file_dentry);
-    write_inode(src_parent_dentry->ino, src_parent_dentry->inode.get());
+    src_parent_dentry->inode->touch(RFS_MTIME | RFS_CTIME);
+
+    // both directories change at once, whichever shards they are in
+    stage_inode(txn, dst_parent_dentry->ino, dst_parent_dentry->inode.get());
+    stage_inode(txn, src_parent_dentry->ino, src_parent_dentry->inode.get());
+    if(!indexes.empty()) {
+        stage_entry(txn, moved_ino, dst_parent_dentry->ino, dst_name, src_name);
+    }
+    stage_change(txn, change_rename, moved_ino, moved_ftype, src_parent_dentry->ino, src_name,
+                 dst_parent_dentry->ino, dst_name);
+    if(commit(txn) != 0) {
+        return -EIO;
+    }
+    written_back(dst_parent_dentry->ino, dst_parent_dentry->inode.get());
+    written_back(src_parent_dentry->ino, src_parent_dentry->inode.get());
+    if(replaced) {
+        drop_inode(replaced);
+    }
 
     return 0;
 }
 
 int rocksdb_fs::open(const char *path, struct fuse_file_info* fi) {
+    string_view query;
+    if(is_find_path(path, query)) {
+        return find_open(query, fi);
+    }
     bool found;
-    auto path_cpy = unique_ptr<char>(strdup(path));
-    auto dentry = lookup(path_cpy.get(), found);
+    auto dentry = lookup(path, found);
 
     if(!found) {
         return -ENOENT;
@@ -528,9 +956,10 @@ int rocksdb_fs::open(const char *path, struct fuse_file_info* fi) {
 
 }
 
-int rocksdb_fs::create(const char *path, mode_t mode, fuse_file_info *fi) {
+int rocksdb_fs::create(const char *path, mode_t mode, uid_t uid, gid_t gid, fuse_file_info *fi) {
     uint64_t ino;
-    int ret = mknod(path, mode, &ino);
+    vector<uint64_t> lineage;
+    int ret = mknod(path, mode, uid, gid, &ino, &lineage);
     if(ret < 0) {
         return ret;
     }
@@ -540,6 +969,9 @@ int rocksdb_fs::create(const char *path, mode_t mode, fuse_file_info *fi) {
     if((fi->flags & O_DIRECT) == 0) {
         cache_lock.lock();
         inode_cache c = {1, shared_ptr<inode_t>(read_inode(ino))};
+        if(c.i != nullptr) {
+            c.i->lineage = std::move(lineage);
+        }
         cache[ino] = c;
         cache_lock.unlock();
     }
@@ -549,7 +981,7 @@ int rocksdb_fs::create(const char *path, mode_t mode, fuse_file_info *fi) {
 
 int rocksdb_fs::fsync(fuse_file_info *fi) {
     cache_lock.lock();
-    if(cache.find(fi->fh) != cache.end()) {
+    if(cache.find(fi->fh) != cache.end() && cache[fi->fh].i->attr_dirty) {
         write_inode(fi->fh, cache[fi->fh].i.get());
     }
     cache_lock.unlock();
@@ -557,11 +989,17 @@ int rocksdb_fs::fsync(fuse_file_info *fi) {
 }
 
 int rocksdb_fs::release(fuse_file_info *fi) {
+    if(fi->fh & RFS_FIND_FH) {
+        unique_lock<mutex> l(find_lock);
+        finds.erase(fi->fh);
+        return 0;
+    }
     cache_lock.lock();
     if(cache.find(fi->fh) != cache.end()) {
         // if cache's ref_cnt reaches to 0, the cache will be released
         if(--cache[fi->fh].ref_cnt == 0) {
-            write_inode(fi->fh, cache[fi->fh].i.get());
+            // a file only read keeps nothing to write back
+            if(cache[fi->fh].i->attr_dirty) write_inode(fi->fh, cache[fi->fh].i.get());
             cache.erase(fi->fh);
         }
     }
@@ -571,19 +1009,23 @@ int rocksdb_fs::release(fuse_file_info *fi) {
 
 int rocksdb_fs::truncate(const char *path, off_t size, struct fuse_file_info *fi) {
     shared_ptr<inode_t> inode;
-    unique_ptr<rfs_dentry> dentry;
+    uint64_t ino = 0;
+
+    if(size > MAX_FILE_SZ) {
+        return -EFBIG;
+    }
 
     cache_lock.lock();
-    if((fi->flags & O_DIRECT) == 0) {
+    if(fi != nullptr && (fi->flags & O_DIRECT) == 0 && cache.find(fi->fh) != cache.end()) {
         inode = cache[fi->fh].i;
+        ino = fi->fh;
     }
     cache_lock.unlock();
 
     // cache miss
     if(inode == nullptr) {
         bool found;
-        auto path_cpy = unique_ptr<char>(strdup(path));
-        dentry = lookup(path_cpy.get(), found);
+        auto dentry = lookup(path, found);
 
         if(!found) {
             return -ENOENT;
@@ -593,17 +1035,382 @@ int rocksdb_fs::truncate(const char *path, off_t size, struct fuse_file_info *fi
             return -EISDIR;
         }
         inode = dentry->inode;
+        ino = dentry->ino;
     }
 
-    inode->truncate(size);
+    cache_lock.lock();
+    // truncate(2) comes without a file handle, the file may still be open
+    bool cached = cache.find(ino) != cache.end();
+    if(cached) {
+        inode = cache[ino].i;
+    }
 
-    if(fi->flags & O_DIRECT) {
-        write_inode(dentry->ino, dentry->inode.get());
+    if(unshare_blocks(ino, inode.get()) != 0) {
+        cache_lock.unlock();
+        return -EIO;
+    }
+    if(size < inode->file_sz && size % BLOCK_SZ != 0) {
+        load_block(ino, inode.get(), size / BLOCK_SZ);
+    }
+    drop_blocks(inode->blk_ino(ino), inode->truncate(size), UINT64_MAX, inode->dedup);
+    inode->touch(RFS_MTIME | RFS_CTIME);
+
+    if(!cached) {
+        write_inode(ino, inode.get());
     }
+    cache_lock.unlock();
 
     return 0;
 }
 
+/**
+ * only hole punching and growing the file are supported, space is never reserved in advance
+ */
+int rocksdb_fs::fallocate(const char *path, int mode, off_t offset, off_t len, fuse_file_info *fi) {
+    if(mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) {
+        return -EOPNOTSUPP;
+    }
+    if((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE)) {
+        return -EOPNOTSUPP;
+    }
+    if(offset + len > MAX_FILE_SZ) {
+        return -EFBIG;
+    }
 
+    shared_ptr<inode_t> inode;
+    uint64_t ino = fi->fh;
+    bool lock = false;
+    if((fi->flags & O_DIRECT) == 0) {
+        cache_lock.lock();
+        if(cache.find(fi->fh) != cache.end()) {
+            inode = cache[fi->fh].i;
+            lock = true;
+        } else {
+            cache_lock.unlock();
+        }
+    }
+    if(inode == nullptr) {
+        bool found;
+        auto dentry = lookup(path, found);
+        if(!found) {
+            return -ENOENT;
+        }
+        if(dentry->ftype == dir) {
+            return -EISDIR;
+        }
+        inode = dentry->inode;
+        ino = dentry->ino;
+    }
 
+    if(mode & FALLOC_FL_PUNCH_HOLE) {
+        uint64_t from_blk, to_blk;
+        if(unshare_blocks(ino, inode.get()) != 0) {
+            if(lock) cache_lock.unlock();
+            return -EIO;
+        }
+        load_block(ino, inode.get(), offset / BLOCK_SZ);
+        load_block(ino, inode.get(), (offset + len) / BLOCK_SZ);
+        inode->punch_hole(offset, len, from_blk, to_blk);
+        drop_blocks(inode->blk_ino(ino), from_blk, to_blk, inode->dedup);
+    } else if(!(mode & FALLOC_FL_KEEP_SIZE) && (uint64_t)(offset + len) > inode->file_sz) {
+        inode->truncate(offset + len);
+    }
+    inode->touch(RFS_MTIME | RFS_CTIME);
 
+    if(lock) {
+        cache_lock.unlock();
+    } else {
+        write_inode(ino, inode.get());
+    }
+
+    return 0;
+}
+
+/**
+ * SEEK_DATA and SEEK_HOLE at block granularity, the end of file counts as a hole
+ */
+off_t rocksdb_fs::lseek(const char *path, off_t off, int whence, fuse_file_info *fi) {
+    if(whence != SEEK_DATA && whence != SEEK_HOLE) {
+        return -EINVAL;
+    }
+
+    shared_ptr<inode_t> inode;
+    uint64_t ino = fi->fh;
+    bool lock = false;
+    if((fi->flags & O_DIRECT) == 0) {
+        cache_lock.lock_shared();
+        if(cache.find(fi->fh) != cache.end()) {
+            inode = cache[fi->fh].i;
+            lock = true;
+        } else {
+            cache_lock.unlock_shared();
+        }
+    }
+    if(inode == nullptr) {
+        bool found;
+        auto dentry = lookup(path, found);
+        if(!found) {
+            return -ENOENT;
+        }
+        if(dentry->ftype == dir) {
+            return -EISDIR;
+        }
+        inode = dentry->inode;
+        ino = dentry->ino;
+    }
+
+    off_t ret = -ENXIO;
+    if(off >= 0 && (uint64_t)off < inode->file_sz) {
+        uint64_t blk = seek_block(ino, inode.get(), off / BLOCK_SZ, whence == SEEK_DATA);
+        uint64_t pos = blk >= (inode->file_sz + BLOCK_SZ - 1) / BLOCK_SZ ? inode->file_sz : std::max((uint64_t)off, blk * BLOCK_SZ);
+        if(whence == SEEK_HOLE) {
+            ret = std::min(pos, inode->file_sz);
+        } else if(pos < inode->file_sz) {
+            ret = pos;
+        }
+    }
+
+    if(lock) cache_lock.unlock_shared();
+    return ret;
+}
+
+/**
+ * copy inside the daemon, stored blocks are duplicated in db without passing through the kernel.
+ * in clone mode, copying a whole file into an empty one only shares the blocks
+ */
+ssize_t rocksdb_fs::copy_file_range(const char *path_in, fuse_file_info *fi_in, off_t off_in,
+                                    const char *path_out, fuse_file_info *fi_out, off_t off_out, size_t size, int flags) {
+    if(flags != 0) {
+        return -EINVAL;
+    }
+
+    // files opened with O_DIRECT are not cached, nor are the others always. the handles stay open through the
+    // call, one cached now still is once the lock is taken
+    cache_lock.lock_shared();
+    bool cached_in = (fi_in->flags & O_DIRECT) == 0 && cache.find(fi_in->fh) != cache.end();
+    bool cached_out = (fi_out->flags & O_DIRECT) == 0 && cache.find(fi_out->fh) != cache.end();
+    cache_lock.unlock_shared();
+    bool found;
+    unique_ptr<rfs_dentry> dentry_in, dentry_out;
+    if(!cached_in) {
+        dentry_in = lookup(path_in, found);
+        if(!found) return -ENOENT;
+        if(dentry_in->ftype == dir) return -EISDIR;
+    }
+    if(!cached_out) {
+        dentry_out = lookup(path_out, found);
+        if(!found) return -ENOENT;
+        if(dentry_out->ftype == dir) return -EISDIR;
+    }
+
+    cache_lock.lock();
+    uint64_t ino_in = dentry_in ? dentry_in->ino : fi_in->fh;
+    uint64_t ino_out = dentry_out ? dentry_out->ino : fi_out->fh;
+    auto c_in = cache.find(ino_in), c_out = cache.find(ino_out);
+    if((!dentry_in && c_in == cache.end()) || (!dentry_out && c_out == cache.end())) {
+        cache_lock.unlock();
+        return -EBADF;
+    }
+    shared_ptr<inode_t> in = dentry_in ? dentry_in->inode : c_in->second.i;
+    shared_ptr<inode_t> out = dentry_out ? dentry_out->inode : c_out->second.i;
+    if(ino_in == ino_out) {
+        out = in;
+    }
+
+    ssize_t ret = 0;
+    if(off_in < 0 || off_out < 0 || (uint64_t)off_in >= in->file_sz) {
+        goto unlock;
+    }
+    size = std::min(size, (size_t)(in->file_sz - off_in));
+    if(off_out + size > MAX_FILE_SZ) {
+        ret = -EFBIG;
+        goto unlock;
+    }
+    if(ino_in == ino_out && off_in < (off_t)(off_out + size) && off_out < (off_t)(off_in + size)) {
+        ret = -EINVAL;
+        goto unlock;
+    }
+
+    // blocks are shared within a shard only, across shards they're copied
+    if(conf.clone && ino_in != ino_out && off_in == 0 && off_out == 0 && size == in->file_sz
+            && out->file_sz == 0 && !out->shared && !in->inlined && !out->inlined && in->dedup == out->dedup
+            && shard_of(ino_in) == shard_of(ino_out)) {
+        ret = clone_blocks(ino_in, in.get(), ino_out, out.get()) == 0 ? size : -EIO;
+        goto unlock;
+    }
+
+    if(unshare_blocks(ino_out, out.get()) != 0) {
+        ret = -EIO;
+        goto unlock;
+    }
+
+    size = std::min(size, (size_t)COPY_RANGE_MAX);
+    for(size_t done = 0, n;done < size;done += n) {
+        off_t pos_in = off_in + done, pos_out = off_out + done;
+        if(pos_in % BLOCK_SZ == 0 && pos_out % BLOCK_SZ == 0 && size - done >= BLOCK_SZ) {
+            // duplicate a whole stored block, holes stay holes
+            n = BLOCK_SZ;
+            rfs_block b = {"", true};
+            auto cached = in->blocks.find(pos_in / BLOCK_SZ);
+            if(cached != in->blocks.end()) {
+                b.data = cached->second.data;
+            } else {
+                rocksdb::PinnableSlice rV;
+                int boff = get_block(ino_in, in.get(), pos_in / BLOCK_SZ, &rV);
+                if(boff >= 0) {
+                    b.data.assign(rV.data() + boff, rV.size() - boff);
+                }
+            }
+            out->blocks[pos_out / BLOCK_SZ] = std::move(b);
+            out->attr_dirty = true;
+            out->dirty_sz += BLOCK_SZ;
+            if(pos_out + n > out->file_sz) {
+                out->file_sz = pos_out + n;
+            }
+        } else {
+            char buf[BLOCK_SZ];
+            n = std::min({size - done, (size_t)(BLOCK_SZ - pos_in % BLOCK_SZ), (size_t)(BLOCK_SZ - pos_out % BLOCK_SZ)});
+            read_block(ino_in, in.get(), pos_in / BLOCK_SZ, buf, pos_in % BLOCK_SZ, n);
+            load_block(ino_out, out.get(), pos_out / BLOCK_SZ);
+            out->write_data(buf, n, pos_out);
+        }
+
+        if(out->dirty_sz >= DIRTY_FLUSH_THRESHOLD) {
+            write_inode(ino_out, out.get());
+        }
+    }
+    ret = size;
+    out->touch(RFS_MTIME | RFS_CTIME);
+
+    if(dentry_out) {
+        write_inode(ino_out, out.get());
+    }
+
+    unlock:
+    cache_lock.unlock();
+    return ret;
+}
+
+/**
+ * change the attributes in to_set, a mask of FUSE_SET_ATTR_* flags, to the ones in attr.
+ * an open file's cached inode takes the change and writes it back with its data
+ */
+int rocksdb_fs::set_attr(const char *path, const struct stat *attr, int to_set) {
+    bool found;
+    auto dentry = lookup(path, found);
+    if(!found) {
+        return -ENOENT;
+    }
+
+    cache_lock.lock();
+    auto c = cache.find(dentry->ino);
+    bool cached = c != cache.end();
+    inode_t* inode = cached ? c->second.i.get() : dentry->inode.get();
+    if(inode->mode == 0) {
+        inode->mode = (dentry->ftype == dir ? S_IFDIR : S_IFREG) | 0777;
+        inode->uid = getuid();
+        inode->gid = getgid();
+    }
+
+    if(to_set & FUSE_SET_ATTR_MODE) inode->mode = (inode->mode & S_IFMT) | (attr->st_mode & 07777);
+    if(to_set & FUSE_SET_ATTR_UID) inode->uid = attr->st_uid;
+    if(to_set & FUSE_SET_ATTR_GID) inode->gid = attr->st_gid;
+    inode->touch(RFS_CTIME | (to_set & FUSE_SET_ATTR_ATIME_NOW ? RFS_ATIME : 0) | (to_set & FUSE_SET_ATTR_MTIME_NOW ? RFS_MTIME : 0));
+    if(to_set & FUSE_SET_ATTR_ATIME) inode->atime = attr->st_atim;
+    if(to_set & FUSE_SET_ATTR_MTIME) inode->mtime = attr->st_mtim;
+
+    int ret = 0;
+    if(!cached && write_inode(dentry->ino, inode) != 0) {
+        ret = -EIO;
+    }
+    cache_lock.unlock();
+    return ret;
+}
+
+int rocksdb_fs::chmod(const char *path, mode_t mode) {
+    struct stat attr = {};
+    attr.st_mode = mode;
+    return set_attr(path, &attr, FUSE_SET_ATTR_MODE);
+}
+
+/**
+ * an id of -1 is left unchanged
+ */
+int rocksdb_fs::chown(const char *path, uid_t uid, gid_t gid) {
+    struct stat attr = {};
+    attr.st_uid = uid;
+    attr.st_gid = gid;
+    return set_attr(path, &attr, (uid != (uid_t)-1 ? FUSE_SET_ATTR_UID : 0) | (gid != (gid_t)-1 ? FUSE_SET_ATTR_GID : 0));
+}
+
+int rocksdb_fs::utimens(const char *path, const timespec tv[2]) {
+    struct stat attr = {};
+    int to_set = 0;
+    if(tv[0].tv_nsec == UTIME_NOW) {
+        to_set |= FUSE_SET_ATTR_ATIME_NOW;
+    } else if(tv[0].tv_nsec != UTIME_OMIT) {
+        to_set |= FUSE_SET_ATTR_ATIME;
+        attr.st_atim = tv[0];
+    }
+    if(tv[1].tv_nsec == UTIME_NOW) {
+        to_set |= FUSE_SET_ATTR_MTIME_NOW;
+    } else if(tv[1].tv_nsec != UTIME_OMIT) {
+        to_set |= FUSE_SET_ATTR_MTIME;
+        attr.st_mtim = tv[1];
+    }
+    return set_attr(path, &attr, to_set);
+}
+
+/**
+ * the fs keeps no xattrs of its own, only virtual ones of the root and of the directories
+ */
+int rocksdb_fs::getxattr(const char* path, const char* name, char* value, size_t size) {
+    string report;
+    if(strcmp(path, "/") == 0 && strcmp(name, RFS_XATTR_STATS) == 0) {
+        report = stats_report();
+    } else if(strcmp(name, RFS_XATTR_USAGE) == 0) {
+        bool found;
+        auto dentry = lookup(path, found);
+        if(!found) {
+            return -ENOENT;
+        }
+        if(dentry->ftype != dir) {
+            return -ENODATA;
+        }
+        report = usage_report(dentry->ino);
+    } else {
+        return -ENODATA;
+    }
+    if(size == 0) {
+        return report.size();
+    }
+    if(size < report.size()) {
+        return -ERANGE;
+    }
+    memcpy(value, report.data(), report.size());
+    return report.size();
+}
+
+int rocksdb_fs::listxattr(const char* path, char* list, size_t size) {
+    // names are nul terminated one after another
+    string names;
+    if(strcmp(path, "/") == 0) {
+        names.append(RFS_XATTR_STATS, sizeof(RFS_XATTR_STATS));
+    }
+    bool found;
+    auto dentry = lookup(path, found);
+    if(!found) {
+        return -ENOENT;
+    }
+    if(dentry->ftype == dir) {
+        names.append(RFS_XATTR_USAGE, sizeof(RFS_XATTR_USAGE));
+    }
+    if(size == 0) {
+        return names.size();
+    }
+    if(size < names.size()) {
+        return -ERANGE;
+    }
+    memcpy(list, names.data(), names.size());
+    return names.size();
+}
@@ -4,18 +4,28 @@
 
 #ifndef ROCKS_FUSE_ROCKSDB_FS_H
 #define ROCKS_FUSE_ROCKSDB_FS_H
-#define FUSE_USE_VERSION 31
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 32 // session loop takes a fuse_loop_config, pass 312 to build against libfuse >= 3.12
+#endif
 
 #include "rocksdb/db.h"
+#include "rocksdb/cache.h"
+#include "rocksdb/statistics.h"
 
 #include "fuse.h"
 #include "types.h"
+#include "rfs_inode_cache.h"
 #include <string>
+#include <vector>
 #include <mutex>
 #include <shared_mutex>
 #include <condition_variable>
+#include <atomic>
+#include <thread>
+#include <functional>
 
 using std::map;
+using std::vector;
 using std::mutex;
 using std::shared_mutex;
 using std::unique_lock;
@@ -26,6 +36,7 @@ using rocksdb::Status;
 using rocksdb::Slice;
 using rocksdb::ReadOptions;
 using rocksdb::WriteOptions;
+using rocksdb::WriteBatch;
 
 //#define DEBUG 1
 
@@ -35,12 +46,82 @@ using rocksdb::WriteOptions;
 #define RFS_DEBUG(fn, msg) do {} while(0)
 #endif
 
+// the file handles of the queries read from RFS_FIND_DIR have it set, inos never get that high
+#define RFS_FIND_FH (1ULL << 63)
+
+struct rfs_config {
+    bool clone = false; // copy_file_range of a whole file into an empty one shares the blocks copy-on-write
+    bool dedup = false; // files created store each distinct block once, as a reference counted chunk
+    size_t inode_cache_sz = 32 << 20; // bytes of written back inodes kept in memory after close, 0 disables
+    size_t bg_io_limit = 0; // bytes per second flushes and compactions of a shard may read and write, 0 for no limit
+    int bg_jobs = 16; // flushes and compactions a shard runs at once
+    size_t block_cache_sz = 32 << 20; // bytes of uncompressed blocks cached for all the shards, 0 disables
+    bool hyper_clock = false; // HyperClockCache as block cache, lock free lookups scale with threads better than LRU
+    size_t secondary_cache_sz = 0; // bytes of blocks evicted from the block cache kept compressed in memory
+    bool meta_in_memory = false; // inodes in plain tables read through mmap, for metadata that fits in memory
+    bool index = false; // inodes indexed by mtime, size and name, for the queries of RFS_FIND_DIR
+    uint64_t change_log_ttl = 0; // seconds WAL files are kept once flushed for rfs_changes, 0 logs no changes
+    string cold_path; // file data past hot_sz of a shard goes to "<cold_path>/<shard>", empty keeps it all in one place
+                      // unless the shards were tiered before
+    uint64_t hot_sz = 16ULL << 30; // bytes of file data a shard keeps on its own path with cold_path
+    size_t inline_sz = 0; // regular files up to this many bytes are kept in their inode, at most BLOCK_SZ
+    size_t hot_set_sz = 0; // inodes of the inode cache saved for the next mount to prefetch, 0 saves none
+    int async_threads = 0; // threads completing the deferred ops, 0 completes each on the thread deferring it
+};
+
+/**
+ * writes spanning several shards, committed all or nothing by rocksdb_fs::commit
+ */
+struct rfs_txn {
+    map<size_t, WriteBatch> batches; // by shard
+
+    WriteBatch& batch(size_t shard) { return batches[shard]; }
+};
+
+// replies of the deferred ops, made on the thread completing them. ret is -errno on failure
+typedef std::function<void(int ret, const struct stat* stat)> rfs_stat_done;
+typedef std::function<void(int ret, const char* buf)> rfs_read_done; // ret is the bytes in buf
+
+/**
+ * a getattr, lookup or read deferred until its reads are done, they're issued together with those of the others
+ * waiting, see rfs_async.cpp
+ */
+struct rfs_async_op {
+    struct piece {
+        string key; // of a block not loaded
+        size_t at; // where its bytes go in buf
+        size_t off; // of the bytes in the block
+        size_t len;
+    };
+    uint64_t ino; // of the parent for a lookup, until its entry is found
+    string name; // a lookup's, cleared once found
+    unique_ptr<inode_t> inode; // as read for the op
+    rfs_stat_done stat_done; // getattr and lookup
+    rfs_read_done read_done; // read
+    off_t off = 0;
+    size_t size = 0;
+    int err = 0; // -errno the op is replied with
+    bool replied = false; // a lookup of an open file, replied once found
+    bool planned = false; // buf and pieces are set
+    string buf; // a read's, the bytes loaded already are copied in when it's planned
+    uint64_t blk_ino = 0;
+    bool dedup = false;
+    vector<piece> pieces; // the blocks fetched into buf
+};
+
 class rocksdb_fs {
 
 private:
-    DB* db;
+    // an inode, its blocks and its markers live in the shard its ino hashes to, the super block in shard 0
+    vector<DB*> shards;
+    vector<rocksdb::ColumnFamilyHandle*> metas; // of each shard, where its inodes are
+    vector<rocksdb::ColumnFamilyHandle*> indexes; // of each shard, empty if the fs isn't indexed
+    std::atomic<uint64_t> txn_id{0};
+    rfs_config conf;
     super_block super;
     mutex ino_lock;
+    mutex ref_lock;
+    mutex dedup_lock;
     shared_mutex cache_lock;
 
 //    // keep the state of stating to prevent reading and unlink dir simultaneously(like bonnie++ tool)
@@ -49,29 +130,132 @@ private:
 //    bool unlinkable = true;
 
     map<uint64_t, inode_cache> cache;
-    map<string, dir_cache> dir_caches;
+    map<string, dir_cache, std::less<>> dir_caches; // transparent comparator, looked up by string_view
+    unique_ptr<rfs_inode_cache> inode_lru; // inodes as written back, whether open or not
+    shared_ptr<rocksdb::Cache> block_cache; // shared by the shards like the statistics
+    shared_ptr<rocksdb::Statistics> db_stats;
+    map<uint64_t, string> finds; // results of the queries open, by file handle
+    uint64_t find_seq = 0;
+    mutex find_lock;
+    std::thread tier_thread; // demotes cold tables with conf.cold_path
+    mutex tier_lock;
+    condition_variable tier_cv;
+    bool tier_stop = false;
+    std::thread hot_thread; // saves the hot set with conf.hot_set_sz
+    vector<std::thread> warmers; // prefetch the hot set the last mount saved, a thread per shard
+    mutex hot_lock;
+    condition_variable hot_cv;
+    std::atomic<bool> hot_stop{false};
+    std::atomic<uint64_t> warm_inodes{0};
+    std::atomic<uint64_t> warm_bytes{0};
+    std::thread orphan_thread; // drops the orphans found at mount
+    std::atomic<bool> orphan_stop{false};
+    vector<std::thread> async_threads; // complete the deferred ops with conf.async_threads
+    mutex async_lock;
+    condition_variable async_cv;
+    vector<rfs_async_op> async_ops; // deferred, not taken by a thread yet
+    bool async_stop = false;
 
 private:
+    size_t shard_of(uint64_t ino) const;
+    DB* db_of(uint64_t ino) const { return shards[shard_of(ino)]; }
+    rocksdb::ColumnFamilyHandle* meta_of(uint64_t ino) const { return metas[shard_of(ino)]; }
+    rocksdb::ColumnFamilyHandle* index_of(uint64_t ino) const { return indexes[shard_of(ino)]; }
+    bool empty_shard(size_t shard);
+    int check_shards();
+    int commit(rfs_txn& txn);
+    void recover_intents();
+    int move_meta();
+    int upgrade_format(bool fresh);
+
     inode_t* read_inode(uint64_t ino);
-    int write_inode(uint64_t ino, inode_t* inode);
+    void read_inodes(const vector<uint64_t>& inos, vector<unique_ptr<inode_t>>& out);
+    int write_inode(uint64_t ino, inode_t* inode, bool orphan = false);
+    void stage_inode(rfs_txn& txn, uint64_t ino, inode_t* inode, bool orphan = false);
+    void place_inline(uint64_t ino, inode_t* inode, WriteBatch& batch);
+    void stage_change(rfs_txn& txn, rfs_change_op op, uint64_t ino, file_type ftype, uint64_t parent, string_view name,
+                      uint64_t new_parent = 0, string_view new_name = "");
+    void written_back(uint64_t ino, inode_t* inode);
+    int write_unlinked(uint64_t parent_ino, inode_t* parent, uint64_t ino, file_type ftype, string_view name,
+                       const rfs_usage_d& usage);
     void drop_inode(uint64_t ino);
+    void recover_orphans();
+    void reclaim_orphans(vector<std::pair<uint64_t, file_type>> drops);
+
+    rfs_block* load_block(uint64_t ino, inode_t* inode, uint64_t blk);
+    void read_block(uint64_t ino, inode_t* inode, uint64_t blk, char* buf, size_t off, size_t n);
+    void read_blocks(uint64_t ino, inode_t* inode, uint64_t blk, char* buf, size_t off, size_t n);
+    int get_block(uint64_t ino, inode_t* inode, uint64_t blk, rocksdb::PinnableSlice* val);
+    void drop_blocks(uint64_t ino, uint64_t from_blk, uint64_t to_blk, bool dedup);
+    uint64_t seek_block(uint64_t ino, inode_t* inode, uint64_t blk, bool data);
+
+    int clone_blocks(uint64_t src_ino, inode_t* src, uint64_t dst_ino, inode_t* dst);
+    int unshare_blocks(uint64_t ino, inode_t* inode);
+    void release_blocks(uint64_t data_ino, bool dedup);
+    uint64_t get_refs(uint64_t data_ino);
+    int copy_blocks(uint64_t from_ino, uint64_t to_ino, bool dedup);
+
+    void dedup_blocks(uint64_t ino, inode_t* inode, WriteBatch& batch, vector<string>& released);
+    void drop_deduped_blocks(DB* db, const Slice& beg, const Slice& end);
+    void drop_unused_chunks(DB* db, const vector<string>& chunks);
+    void sweep_chunks();
+
+    void stage_usage(rfs_txn& txn, vector<uint64_t>::const_iterator beg, vector<uint64_t>::const_iterator end,
+                     int64_t bytes, int64_t inodes);
+    int read_usage(uint64_t ino, rfs_usage_d& usage);
+    rfs_usage_d relink_usage(uint64_t ino, file_type ftype, const vector<uint64_t>& lineage);
+    int count_usage(uint64_t ino, rfs_usage_d& usage);
+    string usage_report(uint64_t ino);
 
-    unique_ptr<rfs_dentry> lookup(char* path, bool &found);
+    void stage_index(rfs_txn& txn, uint64_t ino, inode_t* inode);
+    void stage_entry(rfs_txn& txn, uint64_t ino, uint64_t parent, string_view name, string_view old_name = "");
+    void drop_index(WriteBatch& batch, uint64_t ino, inode_t* inode);
+    void stage_unindex(rfs_txn& txn, uint64_t ino);
+    int build_index();
+    int index_tree(rfs_txn& txn, uint64_t ino);
+    int entry_path(uint64_t ino, string& path);
+    int find(string_view query, string& out);
+    bool is_find_path(string_view path, string_view& query);
+    int find_getattr(string_view query, struct stat* stat);
+    int find_open(string_view query, fuse_file_info* fi);
+    int find_read(char* buf, size_t size, off_t offset, fuse_file_info* fi);
 
-    rfs_dentry_d* new_dentry_d(const char* fname, file_type ftype);
-    rfs_dentry_d* find_dentry_d(inode_t* inode, const char *name);
+    unique_ptr<rfs_dentry> lookup(string_view path, bool &found);
+
+    uint64_t alloc_ino();
+    uint64_t alloc_ino_on(size_t shard);
+    rfs_dentry_d* find_dentry_d(inode_t* inode, string_view name);
 //    void append_dentry_d(rfs_dentry* parent, rfs_dentry_d* dentry_d);
-    void drop_dentry_d(const rfs_dentry_d *dentry_d);
-    void overwrite_dentry_d(rfs_dentry* parent_dst, rfs_dentry_d* src, rfs_dentry_d* dst);
+    void drop_dentry_d(uint64_t ino, file_type ftype);
+    void overwrite_dentry_d(rfs_txn& txn, rfs_dentry* parent_dst, rfs_dentry_d* src, rfs_dentry_d* dst);
+    int check_replace(const rfs_dentry_d* src, const rfs_dentry_d* dst);
 
-    char* parent_path(const char* path, int& div_idx);
+    string_view parent_path(string_view path, string_view& name);
+    int set_attr(const char* path, const struct stat* attr, int to_set);
+    string stats_report();
+    void tier_loop();
+    int demote(size_t shard);
+    string tier_report();
+    void hot_loop();
+    int save_hot_set();
+    void warm_up();
+    void warm_shard(vector<uint64_t> inos);
+    static void fill_stat(file_type ftype, const inode_t* inode, struct stat* stat);
+    void defer(rfs_async_op&& op);
+    void async_loop();
+    void complete(vector<rfs_async_op>& ops);
+    bool open_stat(uint64_t ino, struct stat* stat);
+    void resolve(rfs_async_op& op, inode_t* parent);
+    void plan_read(rfs_async_op& op, inode_t* inode);
+    void fetch_pieces(vector<rfs_async_op*>& reads);
 
 public:
-    int connect(const char *dbpath);
+    int connect(const vector<string>& dbpaths, const rfs_config& conf = rfs_config());
+    int connect(const char *dbpath, const rfs_config& conf = rfs_config());
     int mount();
     int close();
 
-    int mkdir(const char* path, mode_t mode);
+    int mkdir(const char* path, mode_t mode, uid_t uid, gid_t gid);
     int rmdir(const char* path);
     int opendir(const char* path, fuse_file_info* fi);
     int readdir(const char* path, void* buf, fuse_fill_dir_t filter,
@@ -79,17 +263,36 @@ public:
     int releasedir(const char* path, fuse_file_info* fi);
 
     int getattr(const char* path, struct stat* stat);
-    int mknod(const char* path, mode_t mode, uint64_t* ino = nullptr);
+    int mknod(const char* path, mode_t mode, uid_t uid, gid_t gid, uint64_t* ino = nullptr, vector<uint64_t>* lineage = nullptr);
     int unlink(const char*path);
     int rename (const char* src, const char* dst);
     int write(const char* path, const char* buf, size_t size, off_t offset, fuse_file_info* fi);
     int read(const char* path, char* buf, size_t size, off_t offset, fuse_file_info* fi);
 
     int open(const char* path, fuse_file_info* fi);
-    int create(const char* path, mode_t mode, fuse_file_info* fi);
+    int create(const char* path, mode_t mode, uid_t uid, gid_t gid, fuse_file_info* fi);
     int truncate(const char* path, off_t size, struct fuse_file_info *fi);
+    int fallocate(const char* path, int mode, off_t offset, off_t len, fuse_file_info* fi);
+    off_t lseek(const char* path, off_t off, int whence, fuse_file_info* fi);
+    ssize_t copy_file_range(const char* path_in, fuse_file_info* fi_in, off_t off_in,
+                            const char* path_out, fuse_file_info* fi_out, off_t off_out, size_t size, int flags);
     int fsync(fuse_file_info* fi);
     int release(fuse_file_info * fi);
+
+    int chmod(const char* path, mode_t mode);
+    int chown(const char* path, uid_t uid, gid_t gid);
+    int utimens(const char* path, const timespec tv[2]);
+
+    int batch(const char* path, fuse_file_info* fi, rfs_batch_d* b, uid_t uid, gid_t gid);
+
+    int statfs(const char* path, struct statvfs* st);
+    int getxattr(const char* path, const char* name, char* value, size_t size);
+    int listxattr(const char* path, char* list, size_t size);
+
+    // by ino, the reads they need are deferred and done together with those of other ops
+    void getattr_async(uint64_t ino, rfs_stat_done done);
+    void lookup_async(uint64_t parent, string_view name, rfs_stat_done done);
+    void read_async(size_t size, off_t offset, fuse_file_info* fi, rfs_read_done done);
 };
 
 
@@ -3,6 +3,7 @@
 //
 
 #include <memory>
+#include <algorithm>
 
 #include "rocksdb_fs.h"
 
@@ -12,124 +13,782 @@ using rocksdb::PinnableSlice;
  * @return  return nullptr means that an inode has corrupted
  */
 inode_t* rocksdb_fs::read_inode(uint64_t ino) {
+    inode_t* cached = inode_lru->get(ino);
+    if(cached != nullptr) {
+        return cached;
+    }
+
     PinnableSlice rV;
     char key[20];
     sprintf(key, "%lu", ino);
-    Status s = db->Get(ReadOptions(), db->DefaultColumnFamily(), key, &rV);
+    DB* db = db_of(ino);
+    // an inode dropped or written while it's read must not be cached as read
+    uint64_t stamp = inode_lru->stamp(ino);
+    Status s = db->Get(ReadOptions(), meta_of(ino), key, &rV);
     if(!s.ok()) {
         RFS_DEBUG("rfs::read_inode", "retrieve inode failed!");
         return nullptr;
     }
 
+    inode_lru->fill(ino, rV, stamp);
     return new inode_t(rV.data(), rV.size());
 
 }
 
 /**
+ * read_inode for many inodes at once, the ones not cached are fetched with a MultiGet per shard so their
+ * reads are issued together rather than one after another
+ * @param out set to an inode for each of inos, nullptr for the ones missing
+ */
+void rocksdb_fs::read_inodes(const vector<uint64_t> &inos, vector<unique_ptr<inode_t>> &out) {
+    out.clear();
+    out.resize(inos.size());
+    map<size_t, vector<size_t>> misses; // by shard, where in inos
+    for(size_t i = 0;i < inos.size();i++) {
+        out[i].reset(inode_lru->get(inos[i]));
+        if(out[i] == nullptr) misses[shard_of(inos[i])].push_back(i);
+    }
+
+    char key[INODE_KEY_LEN];
+    ReadOptions opts;
+    opts.async_io = true;
+    opts.optimize_multiget_for_io = true;
+    for(auto& m : misses) {
+        size_t cnt = m.second.size();
+        vector<string> keys;
+        for(size_t i : m.second) {
+            inode_key(key, inos[i]);
+            keys.emplace_back(key);
+        }
+        vector<Slice> slices(keys.begin(), keys.end());
+        vector<PinnableSlice> vals(cnt);
+        vector<Status> statuses(cnt);
+        vector<uint64_t> stamps;
+        for(size_t i : m.second) {
+            stamps.push_back(inode_lru->stamp(inos[i]));
+        }
+        shards[m.first]->MultiGet(opts, metas[m.first], cnt, slices.data(), vals.data(), statuses.data());
+        for(size_t k = 0;k < cnt;k++) {
+            if(!statuses[k].ok()) continue;
+            size_t i = m.second[k];
+            inode_lru->fill(inos[i], vals[k], stamps[k]);
+            out[i] = make_unique<inode_t>(vals[k].data(), vals[k].size());
+        }
+    }
+}
+
+/**
+ * write back the attributes of an inode together with its dirty blocks, the cached blocks are released afterwards.
+ * the orphan markers of the children linked since the last write back are cleared in the same commit
  * @param ino
- * @param inode
+ * @param inode nullptr to write an empty inode
+ * @param orphan a new inode whose dentry isn't written yet, it's marked orphan until then
  */
-int rocksdb_fs::write_inode(uint64_t ino, inode_t *inode) {
-    char key[20];
-    sprintf(key, "%lu", ino);
-    Status s;
+int rocksdb_fs::write_inode(uint64_t ino, inode_t *inode, bool orphan) {
+    int ret;
     if(inode == nullptr) {
-        s = db->Put(WriteOptions(), key, Slice());
+        char key[INODE_KEY_LEN];
+        inode_key(key, ino);
+        inode_t empty;
+        empty.before_write_back();
+        ret = db_of(ino)->Put(WriteOptions(), meta_of(ino), key, Slice((char*)empty.data(), empty.attr_sz)).ok() ? 0 : -1;
+        if(ret == 0) inode_lru->put(ino, Slice((char*)empty.data(), empty.attr_sz));
     } else {
-        inode->before_write_back();
-        s = db->Put(WriteOptions(), key, Slice((char*)inode->data(), inode->used_dat_sz + inode->attr_sz));
+        rfs_txn txn;
+        // a file's blocks are in the shard of its inode
+        WriteBatch& batch = txn.batch(shard_of(ino));
+        if((inode->mode & S_IFMT) == S_IFREG && (conf.inline_sz > 0 || inode->inlined)) {
+            place_inline(ino, inode, batch);
+        }
+        stage_inode(txn, ino, inode, orphan);
+
+        vector<string> released;
+        unique_lock<mutex> dedup_l(dedup_lock, std::defer_lock);
+        if(inode->dedup) {
+            dedup_l.lock();
+            dedup_blocks(ino, inode, batch, released);
+        } else {
+            char blk_key[BLOCK_KEY_LEN];
+            for(auto& b : inode->blocks) {
+                if(!b.second.dirty) continue;
+                block_key(blk_key, inode->blk_ino(ino), b.first);
+                if(b.second.data.empty()) {
+                    batch.Delete(blk_key);
+                } else {
+                    batch.Put(blk_key, b.second.data);
+                }
+            }
+        }
+        ret = commit(txn);
+        if(ret == 0) {
+            drop_unused_chunks(db_of(ino), released);
+            written_back(ino, inode);
+        }
     }
 
-    if(!s.ok()) {
+    if(ret != 0) {
         RFS_DEBUG("rfs::write_inode", "fs init failed");
         return -1;
     }
     return 0;
 }
 
+/**
+ * add the record of an inode to txn, and the clearing of the orphan markers of the children linked since
+ * its last write back. the markers may be in other shards, as may the directories above it, whose usage
+ * takes the change of its size since then, and the inode itself when it's new
+ * @param orphan a new inode whose dentry isn't written yet, it's marked orphan until then
+ */
+void rocksdb_fs::stage_inode(rfs_txn &txn, uint64_t ino, inode_t *inode, bool orphan) {
+    char key[INODE_KEY_LEN], okey[ORPHAN_KEY_LEN];
+    inode_key(key, ino);
+    WriteBatch& batch = txn.batch(shard_of(ino));
+    inode->before_write_back();
+    batch.Put(meta_of(ino), key, Slice((char*)inode->data(), inode->used_dat_sz + inode->attr_sz));
+    if(orphan) {
+        // the directories it's charged to from here on, uncharged if it's reclaimed before its entry is written
+        orphan_key(okey, ino);
+        size_t charged = inode->lineage.empty() ? 0 : inode->lineage.size() - 1;
+        batch.Put(okey, Slice((char*)inode->lineage.data(), charged * sizeof(uint64_t)));
+    }
+    for(uint64_t child : inode->linked) {
+        orphan_key(okey, child);
+        txn.batch(shard_of(child)).Delete(okey);
+    }
+    if(!inode->lineage.empty()) {
+        stage_usage(txn, inode->lineage.begin(), inode->lineage.end() - 1,
+                    (int64_t)inode->file_sz - (int64_t)inode->written_sz, inode->written ? 0 : 1);
+    }
+    if(!indexes.empty()) {
+        stage_index(txn, ino, inode);
+    }
+}
+
+/**
+ * keep a regular file of at most conf.inline_sz bytes in its inode, a lookup then reads it whole and its
+ * block 0 is dropped. a file grown past it, or whose blocks got shared, gets its block 0 back.
+ * called before the inode is staged, batch goes to its shard
+ */
+void rocksdb_fs::place_inline(uint64_t ino, inode_t *inode, WriteBatch &batch) {
+    bool fits = inode->file_sz <= conf.inline_sz && !inode->dedup && !inode->shared && inode->data_ino == 0;
+    auto b = inode->blocks.find(0);
+    if(fits) {
+        string bytes;
+        if(b != inode->blocks.end()) {
+            bytes = b->second.data;
+        } else if(inode->inlined) {
+            bytes = inode->inline_data();
+        } else if(inode->file_sz > 0) {
+            bytes = load_block(ino, inode, 0)->data;
+        }
+        bytes.resize(inode->file_sz);
+        // a file last written empty stores no block
+        if(!inode->inlined && inode->written_sz > 0) {
+            char key[BLOCK_KEY_LEN];
+            block_key(key, ino, 0);
+            batch.Delete(key);
+        }
+        inode->set_inline(bytes);
+        inode->blocks.erase(0);
+        return;
+    }
+    if(inode->inlined) {
+        if(b != inode->blocks.end()) {
+            b->second.dirty = true;
+        } else if(!inode->inline_data().empty()) {
+            inode->blocks[0] = {string(inode->inline_data()), true};
+        }
+        inode->clear_inline();
+    }
+}
+
+/**
+ * add a record of a namespace op to the WAL of the shard of ino with txn, for rfs_changes.
+ * nothing is logged unless the WAL is kept
+ * @param new_parent of a rename, where the entry goes with new_name
+ */
+void rocksdb_fs::stage_change(rfs_txn &txn, rfs_change_op op, uint64_t ino, file_type ftype, uint64_t parent,
+                              string_view name, uint64_t new_parent, string_view new_name) {
+    if(conf.change_log_ttl == 0) {
+        return;
+    }
+    rfs_change_d c = {CHANGE_MAGIC, op, ftype, ino, parent, new_parent, (uint8_t)name.size(), (uint8_t)new_name.size()};
+    string rec((char*)&c, sizeof(c));
+    rec.append(name).append(new_name);
+    txn.batch(shard_of(ino)).PutLogData(rec);
+}
+
+/**
+ * the inode staged has been committed, nothing of it is dirty any more
+ */
+void rocksdb_fs::written_back(uint64_t ino, inode_t *inode) {
+    inode_lru->put(ino, Slice((char*)inode->data(), inode->used_dat_sz + inode->attr_sz));
+    inode->blocks.clear();
+    inode->dirty_sz = 0;
+    inode->attr_dirty = false;
+    inode->linked.clear();
+    inode->written = true;
+    inode->written_sz = inode->file_sz;
+    inode->written_mtime = inode->mtime.tv_sec;
+}
+
+/**
+ * write back a directory that dropped the dentry of ino, ino is marked orphan in the same commit so
+ * a crash before the inode is dropped leaves it to recover_orphans
+ * @param usage what ino counted for, it leaves the directory and the ones above
+ */
+int rocksdb_fs::write_unlinked(uint64_t parent_ino, inode_t *parent, uint64_t ino, file_type ftype, string_view name,
+                               const rfs_usage_d& usage) {
+    char okey[ORPHAN_KEY_LEN];
+    orphan_key(okey, ino);
+    rfs_txn txn;
+    stage_inode(txn, parent_ino, parent);
+    stage_change(txn, change_unlink, ino, ftype, parent_ino, name);
+    stage_usage(txn, parent->lineage.begin(), parent->lineage.end(), -usage.bytes, -usage.inodes);
+    stage_unindex(txn, ino);
+    txn.batch(shard_of(ino)).Put(okey, Slice());
+    if(commit(txn) != 0) {
+        return -1;
+    }
+    written_back(parent_ino, parent);
+    return 0;
+}
+
 /**
  * @param ino
  */
 void rocksdb_fs::drop_inode(uint64_t ino) {
-    char key[20];
-    sprintf(key, "%lu", ino);
-    db->Delete(WriteOptions(), key);
+    char key[INODE_KEY_LEN], okey[ORPHAN_KEY_LEN], ukey[USAGE_KEY_LEN];
+    inode_key(key, ino);
+    orphan_key(okey, ino);
+    auto inode = unique_ptr<inode_t>(read_inode(ino));
+
+    // the marker outlives the inode until its blocks are gone too, a crash in between leaves them to the next mount
+    DB* db = db_of(ino);
+    WriteBatch batch;
+    batch.Delete(meta_of(ino), key);
+    batch.Put(okey, Slice());
+    if(inode == nullptr || (inode->mode & S_IFMT) != S_IFREG) {
+        // a directory's usage goes with it
+        usage_key(ukey, ino);
+        batch.Delete(ukey);
+    }
+    if(!indexes.empty()) {
+        drop_index(batch, ino, inode.get());
+    }
+    db->Write(WriteOptions(), &batch);
+    inode_lru->erase(ino);
+    if(inode != nullptr && inode->shared) {
+        release_blocks(inode->blk_ino(ino), inode->dedup);
+    } else {
+        // a clone left the only owner of its blocks keeps them under the ino of the file they came from
+        drop_blocks(inode != nullptr ? inode->blk_ino(ino) : ino, 0, UINT64_MAX, inode != nullptr && inode->dedup);
+    }
+    db->Delete(WriteOptions(), okey);
+}
+
+/**
+ * uncharge the inodes a crash left orphaned, their markers are still there, and drop them on orphan_thread so
+ * the mount doesn't wait. an orphaned directory takes the entries it was last written with along, as
+ * drop_dentry_d does for rmdir. the blocks go with a range delete, compaction reclaims their space.
+ * a new inode is charged to the directories above it before its entry is written, its marker holds them and
+ * what it counts for is taken off them first. the markers are emptied in the same commit, a crash before the
+ * drops are done doesn't uncharge them twice. an unlinked inode was uncharged with its entry
+ */
+void rocksdb_fs::recover_orphans() {
+    map<uint64_t, vector<uint64_t>> found; // the directories each one is charged to
+    for(DB* db : shards) {
+        auto it = unique_ptr<rocksdb::Iterator>(db->NewIterator(ReadOptions()));
+        for(it->Seek("o"); it->Valid() && it->key()[0] == 'o'; it->Next()) {
+            vector<uint64_t> charged(it->value().size() / sizeof(uint64_t));
+            memcpy(charged.data(), it->value().data(), charged.size() * sizeof(uint64_t));
+            found[strtoull(it->key().data() + 1, nullptr, 10)] = std::move(charged);
+        }
+    }
+
+    vector<std::pair<uint64_t, file_type>> drops;
+    rfs_txn txn;
+    char okey[ORPHAN_KEY_LEN];
+    for(auto& f : found) {
+        auto inode = unique_ptr<inode_t>(read_inode(f.first));
+        file_type ftype = inode != nullptr && S_ISDIR(inode->mode) ? dir : reg;
+        drops.emplace_back(f.first, ftype);
+        auto& above = f.second;
+        if(above.empty()) {
+            continue;
+        }
+        orphan_key(okey, f.first);
+        txn.batch(shard_of(f.first)).Put(okey, Slice());
+        // one below another orphaned directory leaves with the usage of that one
+        if(inode == nullptr || std::any_of(above.begin(), above.end(), [&](uint64_t a) { return found.count(a) > 0; })) {
+            continue;
+        }
+        rfs_usage_d usage = relink_usage(f.first, ftype, {});
+        stage_usage(txn, above.begin(), above.end(), -usage.bytes, -usage.inodes);
+    }
+    if(commit(txn) != 0 || drops.empty()) {
+        return;
+    }
+    orphan_stop = false;
+    orphan_thread = std::thread(&rocksdb_fs::reclaim_orphans, this, std::move(drops));
+}
+
+/**
+ * the drops recover_orphans left, an orphan not dropped before close keeps its marker for the next mount
+ */
+void rocksdb_fs::reclaim_orphans(vector<std::pair<uint64_t, file_type>> drops) {
+    for(auto& d : drops) {
+        if(orphan_stop) {
+            return;
+        }
+        drop_dentry_d(d.first, d.second);
+    }
+}
+
+/**
+ * load a block of a regular file into its inode, a hole is loaded as an empty block
+ */
+rfs_block* rocksdb_fs::load_block(uint64_t ino, inode_t *inode, uint64_t blk) {
+    auto it = inode->blocks.find(blk);
+    if(it != inode->blocks.end()) {
+        return &it->second;
+    }
+
+    rfs_block& b = inode->blocks[blk];
+    b.dirty = false;
+    if(inode->inlined) {
+        if(blk == 0) b.data.assign(inode->inline_data());
+    } else if(blk * BLOCK_SZ < inode->file_sz) {
+        PinnableSlice rV;
+        int off = get_block(ino, inode, blk, &rV);
+        if(off >= 0) {
+            b.data.assign(rV.data() + off, rV.size() - off);
+        }
+    }
+    return &b;
+}
+
+/**
+ * copy n bytes from offset off of a block into buf, holes read as zeros
+ */
+void rocksdb_fs::read_block(uint64_t ino, inode_t *inode, uint64_t blk, char *buf, size_t off, size_t n) {
+    auto it = inode->blocks.find(blk);
+    Slice data;
+    PinnableSlice rV;
+    if(it != inode->blocks.end()) {
+        data = it->second.data;
+    } else {
+        int boff = get_block(ino, inode, blk, &rV);
+        if(boff >= 0) {
+            data = Slice(rV.data() + boff, rV.size() - boff);
+        }
+    }
+
+    size_t stored = data.size() > off ? std::min(data.size() - off, n) : 0;
+    memcpy(buf, data.data() + off, stored);
+    memset(buf + stored, 0, n - stored);
+}
+
+/**
+ * read_block over the n bytes from offset off of block blk on. the blocks not loaded are fetched with one
+ * MultiGet, and the chunks of a deduplicated file with another, so a read spanning many blocks keeps that
+ * many reads in flight instead of one. the request still waits for them on its worker thread, the high level
+ * API replies when the op returns, so requests in flight are bounded by the workers, see --threads. read_async
+ * fetches the blocks of many requests together instead, see --async
+ */
+void rocksdb_fs::read_blocks(uint64_t ino, inode_t *inode, uint64_t blk, char *buf, size_t off, size_t n) {
+    size_t cnt = (off + n + BLOCK_SZ - 1) / BLOCK_SZ;
+    vector<Slice> data(cnt); // empty for a hole
+    vector<string> keys;
+    vector<size_t> at; // the block of each key
+    char key[BLOCK_KEY_LEN];
+    for(size_t i = 0;i < cnt;i++) {
+        auto it = inode->blocks.find(blk + i);
+        if(it != inode->blocks.end()) {
+            data[i] = it->second.data;
+            continue;
+        }
+        if(inode->inlined) {
+            // read with the inode, nothing to fetch
+            if(blk + i == 0) data[i] = Slice(inode->inline_data().data(), inode->inline_data().size());
+            continue;
+        }
+        block_key(key, inode->blk_ino(ino), blk + i);
+        keys.emplace_back(key);
+        at.push_back(i);
+    }
+
+    vector<PinnableSlice> vals(keys.size()), chunks;
+    if(!keys.empty()) {
+        DB* db = db_of(inode->blk_ino(ino));
+        ReadOptions opts;
+        opts.async_io = true;
+        opts.optimize_multiget_for_io = true;
+        vector<Slice> slices(keys.begin(), keys.end());
+        vector<Status> statuses(keys.size());
+        // the keys of consecutive blocks sort like the blocks
+        db->MultiGet(opts, db->DefaultColumnFamily(), keys.size(), slices.data(), vals.data(), statuses.data(), true);
+
+        if(inode->dedup) {
+            vector<string> refs;
+            vector<size_t> ref_at;
+            for(size_t k = 0;k < keys.size();k++) {
+                if(!statuses[k].ok()) continue;
+                refs.push_back(vals[k].ToString());
+                ref_at.push_back(at[k]);
+            }
+            chunks = vector<PinnableSlice>(refs.size());
+            slices.assign(refs.begin(), refs.end());
+            statuses.assign(refs.size(), Status());
+            db->MultiGet(opts, db->DefaultColumnFamily(), refs.size(), slices.data(), chunks.data(), statuses.data());
+            for(size_t k = 0;k < refs.size();k++) {
+                if(statuses[k].ok() && chunks[k].size() >= sizeof(int64_t)) {
+                    data[ref_at[k]] = Slice(chunks[k].data() + sizeof(int64_t), chunks[k].size() - sizeof(int64_t));
+                }
+            }
+        } else {
+            for(size_t k = 0;k < keys.size();k++) {
+                if(statuses[k].ok()) data[at[k]] = vals[k];
+            }
+        }
+    }
+
+    for(size_t i = 0, done = 0, len;i < cnt;i++, done += len, off = 0) {
+        len = std::min(n - done, BLOCK_SZ - off);
+        size_t stored = data[i].size() > off ? std::min(data[i].size() - off, len) : 0;
+        memcpy(buf + done, data[i].data() + off, stored);
+        memset(buf + done + stored, 0, len - stored);
+    }
+}
+
+/**
+ * fetch the stored bytes of a block, resolving the chunk a deduplicated file refers to
+ * @return offset of the block's bytes in val, -1 if the block is a hole
+ */
+int rocksdb_fs::get_block(uint64_t ino, inode_t *inode, uint64_t blk, PinnableSlice *val) {
+    if(inode->inlined) {
+        if(blk != 0 || inode->inline_data().empty()) return -1;
+        val->PinSelf(Slice(inode->inline_data().data(), inode->inline_data().size()));
+        return 0;
+    }
+    char key[BLOCK_KEY_LEN];
+    block_key(key, inode->blk_ino(ino), blk);
+    DB* db = db_of(inode->blk_ino(ino));
+    if(!db->Get(ReadOptions(), db->DefaultColumnFamily(), key, val).ok()) {
+        return -1;
+    }
+    if(!inode->dedup) {
+        return 0;
+    }
+
+    string chunk = val->ToString();
+    val->Reset();
+    if(!db->Get(ReadOptions(), db->DefaultColumnFamily(), chunk, val).ok() || val->size() < sizeof(int64_t)) {
+        RFS_DEBUG("rfs::get_block", "chunk missing");
+        return -1;
+    }
+    return sizeof(int64_t);
+}
+
+/**
+ * drop the stored blocks in [from_blk, to_blk) of a file
+ */
+void rocksdb_fs::drop_blocks(uint64_t ino, uint64_t from_blk, uint64_t to_blk, bool dedup) {
+    if(from_blk >= to_blk) {
+        return;
+    }
+    char beg[BLOCK_KEY_LEN], end[BLOCK_KEY_LEN];
+    block_key(beg, ino, from_blk);
+    block_key(end, ino, to_blk);
+    DB* db = db_of(ino);
+    if(dedup) {
+        drop_deduped_blocks(db, beg, end);
+    } else {
+        db->DeleteRange(WriteOptions(), db->DefaultColumnFamily(), beg, end);
+    }
+}
+
+/**
+ * find the first block from blk on that holds data, or that is a hole if data is false
+ * @return UINT64_MAX if there is no more data
+ */
+uint64_t rocksdb_fs::seek_block(uint64_t ino, inode_t *inode, uint64_t blk, bool data) {
+    if(inode->inlined) {
+        // the only stored block is the inlined one, the cached blocks take precedence
+        auto has_data = [inode](uint64_t b) {
+            auto c = inode->blocks.find(b);
+            return c != inode->blocks.end() ? !c->second.data.empty() : b == 0 && !inode->inline_data().empty();
+        };
+        if(data) {
+            auto cached = inode->blocks.lower_bound(blk);
+            while(cached != inode->blocks.end() && cached->second.data.empty()) cached++;
+            return blk == 0 && has_data(0) ? 0 : cached == inode->blocks.end() ? UINT64_MAX : cached->first;
+        }
+        while(has_data(blk)) blk++;
+        return blk;
+    }
+    char key[BLOCK_KEY_LEN], end[BLOCK_KEY_LEN];
+    block_key(key, inode->blk_ino(ino), blk);
+    block_key(end, inode->blk_ino(ino), UINT64_MAX);
+    Slice upper(end);
+    ReadOptions opts;
+    opts.iterate_upper_bound = &upper;
+    auto it = unique_ptr<rocksdb::Iterator>(db_of(inode->blk_ino(ino))->NewIterator(opts));
+    it->Seek(key);
+
+    // cached blocks take precedence over the stored ones
+    auto stored_blk = [&]() -> uint64_t {
+        return it->Valid() ? strtoull(it->key().data() + it->key().size() - 16, nullptr, 16) : UINT64_MAX;
+    };
+
+    if(data) {
+        auto cached = inode->blocks.lower_bound(blk);
+        while(cached != inode->blocks.end() && cached->second.data.empty()) cached++;
+        uint64_t cached_blk = cached == inode->blocks.end() ? UINT64_MAX : cached->first;
+
+        for(; it->Valid(); it->Next()) {
+            auto b = inode->blocks.find(stored_blk());
+            if(b == inode->blocks.end() || !b->second.data.empty()) break;
+        }
+        return std::min(cached_blk, stored_blk());
+    }
+
+    for(;; blk++) {
+        while(it->Valid() && stored_blk() < blk) it->Next();
+        auto b = inode->blocks.find(blk);
+        bool has_data = b != inode->blocks.end() ? !b->second.data.empty() : stored_blk() == blk;
+        if(!has_data) {
+            return blk;
+        }
+    }
+}
+
+/**
+ * let dst share the blocks of src copy-on-write, dst must be empty, not shared and in the shard of the blocks.
+ * both have to store their blocks the same way, bytes or chunk keys, the copy is the only way between them
+ */
+int rocksdb_fs::clone_blocks(uint64_t src_ino, inode_t *src, uint64_t dst_ino, inode_t *dst) {
+    if(src->dedup != dst->dedup) {
+        return -1;
+    }
+    // the shared blocks have to be in db first
+    if(write_inode(src_ino, src) != 0) {
+        return -1;
+    }
+
+    char key[REF_KEY_LEN];
+    uint64_t data_ino = src->blk_ino(src_ino);
+    ref_key(key, data_ino);
+
+    unique_lock<mutex> l(ref_lock);
+    uint64_t refs = src->shared ? get_refs(data_ino) : 1;
+    refs++;
+
+    src->shared = 1;
+    dst->shared = 1;
+    dst->data_ino = data_ino;
+    dst->file_sz = src->file_sz;
+    dst->blocks.clear();
+    dst->dirty_sz = 0;
+    dst->touch(RFS_MTIME | RFS_CTIME);
+
+    // the directories above dst take its new size, they may be in other shards
+    rfs_txn txn;
+    txn.batch(shard_of(data_ino)).Put(key, Slice((char*)&refs, sizeof(refs)));
+    stage_inode(txn, src_ino, src);
+    stage_inode(txn, dst_ino, dst);
+    if(commit(txn) != 0) {
+        return -1;
+    }
+    written_back(src_ino, src);
+    written_back(dst_ino, dst);
+    return 0;
+}
+
+/**
+ * give a file sharing its blocks a private copy of them before it changes any
+ */
+int rocksdb_fs::unshare_blocks(uint64_t ino, inode_t *inode) {
+    if(!inode->shared) {
+        return 0;
+    }
+
+    char key[REF_KEY_LEN];
+    uint64_t data_ino = inode->blk_ino(ino);
+    ref_key(key, data_ino);
+
+    unique_lock<mutex> l(ref_lock);
+    uint64_t refs = get_refs(data_ino);
+    WriteBatch batch;
+    if(refs > 1) {
+        // the blocks stay where they are for the other clones, the file that stored them first needs a new ino for its copy.
+        // the copy stays in the shard of the inode
+        uint64_t new_ino = data_ino == ino ? alloc_ino_on(shard_of(ino)) : ino;
+        if(copy_blocks(data_ino, new_ino, inode->dedup) != 0) {
+            return -1;
+        }
+        refs--;
+        batch.Put(key, Slice((char*)&refs, sizeof(refs)));
+        inode->data_ino = new_ino == ino ? 0 : new_ino;
+    } else {
+        batch.Delete(key);
+    }
+    inode->shared = 0;
+
+    char ikey[INODE_KEY_LEN];
+    inode_key(ikey, ino);
+    inode->before_write_back();
+    batch.Put(meta_of(ino), ikey, Slice((char*)inode->data(), inode->used_dat_sz + inode->attr_sz));
+    Status s = db_of(ino)->Write(WriteOptions(), &batch);
+    if(!s.ok()) {
+        return -1;
+    }
+    inode_lru->put(ino, Slice((char*)inode->data(), inode->used_dat_sz + inode->attr_sz));
+    return 0;
+}
+
+/**
+ * drop one reference of shared blocks, the blocks go with the last one
+ */
+void rocksdb_fs::release_blocks(uint64_t data_ino, bool dedup) {
+    char key[REF_KEY_LEN];
+    ref_key(key, data_ino);
+
+    unique_lock<mutex> l(ref_lock);
+    uint64_t refs = get_refs(data_ino);
+    if(refs > 1) {
+        refs--;
+        db_of(data_ino)->Put(WriteOptions(), key, Slice((char*)&refs, sizeof(refs)));
+    } else {
+        db_of(data_ino)->Delete(WriteOptions(), key);
+        drop_blocks(data_ino, 0, UINT64_MAX, dedup);
+    }
+}
+
+/**
+ * @return reference count of the blocks stored under data_ino, must be called with ref_lock held
+ */
+uint64_t rocksdb_fs::get_refs(uint64_t data_ino) {
+    char key[REF_KEY_LEN];
+    ref_key(key, data_ino);
+    string rV;
+    uint64_t refs = 1;
+    if(db_of(data_ino)->Get(ReadOptions(), key, &rV).ok() && rV.size() == sizeof(refs)) {
+        memcpy(&refs, rV.data(), sizeof(refs));
+    }
+    return refs;
+}
+
+/**
+ * copy all stored blocks of from_ino to to_ino inside db, in batches of about DIRTY_FLUSH_THRESHOLD bytes.
+ * the blocks of a deduplicated file only take one more reference of their chunks, so both inos are in one shard
+ */
+int rocksdb_fs::copy_blocks(uint64_t from_ino, uint64_t to_ino, bool dedup) {
+    char key[BLOCK_KEY_LEN], end[BLOCK_KEY_LEN];
+    block_key(key, from_ino, 0);
+    block_key(end, from_ino, UINT64_MAX);
+    Slice upper(end);
+    ReadOptions opts;
+    opts.iterate_upper_bound = &upper;
+    DB* db = db_of(to_ino);
+    auto it = unique_ptr<rocksdb::Iterator>(db->NewIterator(opts));
+
+    unique_lock<mutex> dedup_l(dedup_lock, std::defer_lock);
+    if(dedup) dedup_l.lock();
+    int64_t one = 1;
+
+    WriteBatch batch;
+    for(it->Seek(key); it->Valid(); it->Next()) {
+        uint64_t blk = strtoull(it->key().data() + it->key().size() - 16, nullptr, 16);
+        block_key(key, to_ino, blk);
+        batch.Put(key, it->value());
+        if(dedup) {
+            batch.Merge(it->value(), Slice((char*)&one, sizeof(one)));
+        }
+        if(batch.GetDataSize() >= DIRTY_FLUSH_THRESHOLD) {
+            if(!db->Write(WriteOptions(), &batch).ok()) return -1;
+            batch.Clear();
+        }
+    }
+    if(!it->status().ok() || !db->Write(WriteOptions(), &batch).ok()) {
+        return -1;
+    }
+    return 0;
 }
 
 /**
  * @return the last directory entry that can be retrieved
  * returning nullptr means that a directory has corrupted
  */
-unique_ptr<rfs_dentry> rocksdb_fs::lookup(char *path, bool& found) {
+unique_ptr<rfs_dentry> rocksdb_fs::lookup(string_view path, bool& found) {
 
     auto dentry_ret = make_unique<rfs_dentry>();
 
     // copy root directory entry to ret
     dentry_ret->ftype = dir;
-    strcpy(dentry_ret->name, "/");
     dentry_ret->ino = ROOT_DENTRY_INO;
     dentry_ret->inode = unique_ptr<inode_t>(read_inode(dentry_ret->ino));
     found = true;
+    // the directories passed through are charged for the changes of the inode returned
+    vector<uint64_t> lineage = {ROOT_DENTRY_INO};
 
-    // if path is root path
-    if(path[0] == '/' && strlen(path) == 1) {
-        return dentry_ret;
-    }
+    const rfs_dentry_d* dentry_cursor;
 
-    char* dir_name = strtok(path, "/");
+    // walk the components between the slashes, path itself is left untouched
+    size_t beg = path.find_first_not_of('/');
+    while(beg != string_view::npos) {
+        size_t end = std::min(path.find('/', beg), path.size());
+        string_view dir_name = path.substr(beg, end - beg);
+        beg = path.find_first_not_of('/', end);
 
-    const rfs_dentry_d* dentry_cursor;
-    int k;
-    size_t dir_cnt;
-
-    while(dir_name) {
-        if(dentry_ret->ftype == dir) {
-            dentry_cursor = (const rfs_dentry_d*)(dentry_ret->inode->data());
-            dir_cnt = dentry_ret->inode->used_dat_sz / sizeof(rfs_dentry_d);
-            for(k = 0;k < dir_cnt;dentry_cursor++) {
-                if(strcmp(dentry_cursor->name, dir_name) == 0) {
-                    break;
-                }
-                k++;
-            }
-            if(k == dir_cnt) {
-                RFS_DEBUG("rfs::lookup", "directory not found");
-                found = false;
-                break;
-            }
-        } else {
+        if(dentry_ret->ftype != dir) {
             // not a directory, still return the directory entry
             found = false;
             break;
         }
+        dentry_cursor = find_dentry_d(dentry_ret->inode.get(), dir_name);
+        if(dentry_cursor == nullptr) {
+            RFS_DEBUG("rfs::lookup", "directory not found");
+            found = false;
+            break;
+        }
 
         dentry_ret->ftype = dentry_cursor->ftype;
         dentry_ret->ino = dentry_cursor->ino;
-        strcpy(dentry_ret->name, dentry_cursor->name);
         dentry_ret->inode = shared_ptr<inode_t>(read_inode(dentry_ret->ino));
         // corrupted
         if(dentry_ret->inode == nullptr) {
             return nullptr;
         }
-
-        dir_name = strtok(nullptr, "/");
+        lineage.push_back(dentry_ret->ino);
     }
 
+    if(dentry_ret->inode != nullptr) {
+        dentry_ret->inode->lineage = std::move(lineage);
+    }
     return dentry_ret;
 }
 
-rfs_dentry_d* rocksdb_fs::new_dentry_d(const char* fname, file_type ftype) {
-    auto ret = new rfs_dentry_d;
-    ret->ftype = ftype;
-    strcpy(ret->name, fname);
+uint64_t rocksdb_fs::alloc_ino() {
     ino_lock.lock();
-    ret->ino = ++super.cur_ino;
+    uint64_t ino = ++super.cur_ino;
     if(++super.f_counter == FILE_COUNTER_THRESHOLD) {
-        db->Put(WriteOptions(), "0", Slice((char*)&super, sizeof(super_block_d)));
+        shards[0]->Put(WriteOptions(), metas[0], "0", Slice((char*)&super, sizeof(super_block_d)));
         super.f_counter = 0;
     }
     ino_lock.unlock();
-    return ret;
+    return ino;
+}
+
+/**
+ * an ino that lands in shard, the ones passed over are never used
+ */
+uint64_t rocksdb_fs::alloc_ino_on(size_t shard) {
+    uint64_t ino;
+    do {
+        ino = alloc_ino();
+    } while(shard_of(ino) != shard);
+    return ino;
 }
 
 //void rocksdb_fs::append_dentry_d(rfs_dentry* parent, rfs_dentry_d *dentry_d) {
@@ -142,13 +801,42 @@ rfs_dentry_d* rocksdb_fs::new_dentry_d(const char* fname, file_type ftype) {
 //}
 
 /**
- *  drop destination inode and copy to destination parent dentry
+ * copy src over the destination dentry. the inode dst pointed at is marked orphan and unindexed with txn, it's
+ * dropped once txn is committed so that a crash in between never leaves an entry without its inode
  */
-void rocksdb_fs::overwrite_dentry_d(rfs_dentry *parent_dst, rfs_dentry_d *src, rfs_dentry_d *dst) {
-    drop_inode(dst->ino);
+void rocksdb_fs::overwrite_dentry_d(rfs_txn &txn, rfs_dentry *parent_dst, rfs_dentry_d *src, rfs_dentry_d *dst) {
+    char okey[ORPHAN_KEY_LEN];
+    orphan_key(okey, dst->ino);
+    txn.batch(shard_of(dst->ino)).Put(okey, Slice());
+    stage_unindex(txn, dst->ino);
     parent_dst->inode->overwrite_dentry_d(src, dst);
 }
 
+/**
+ * whether src may replace the entry dst: one of the same type, a directory only when it's empty
+ * @return 0, or the -errno rename fails with
+ */
+int rocksdb_fs::check_replace(const rfs_dentry_d *src, const rfs_dentry_d *dst) {
+    if(src->ftype != dst->ftype) {
+        return dst->ftype == dir ? -EISDIR : -ENOTDIR;
+    }
+    if(dst->ftype != dir) {
+        return 0;
+    }
+    // an open directory's cached inode is newer than the one in db
+    shared_ptr<inode_t> inode;
+    cache_lock.lock_shared();
+    auto c = cache.find(dst->ino);
+    if(c != cache.end()) {
+        inode = c->second.i;
+    }
+    cache_lock.unlock_shared();
+    if(inode == nullptr) {
+        inode = shared_ptr<inode_t>(read_inode(dst->ino));
+    }
+    return inode != nullptr && inode->dentry_cnt() > 0 ? -ENOTEMPTY : 0;
+}
+
 /**
  * remove dentry in parent
  */
@@ -158,20 +846,18 @@ void rocksdb_fs::overwrite_dentry_d(rfs_dentry *parent_dst, rfs_dentry_d *src, r
 //}
 
 /**
- * drop dentry of directory recursively
+ * drop an inode, a directory's recursively
  */
-void rocksdb_fs::drop_dentry_d(const rfs_dentry_d *dentry_d) {
-    if (dentry_d->ftype == dir) {
-        auto inode = unique_ptr<inode_t>(read_inode(dentry_d->ino));
-        if (inode->used_dat_sz != 0) {
-            auto dentry_cursor = (const rfs_dentry_d *) (inode->data());
-            size_t dir_cnt = inode->used_dat_sz / sizeof(rfs_dentry_d);
-            for (size_t i = 0; i < dir_cnt;i++, dentry_cursor++) {
-                drop_dentry_d(dentry_cursor);
-            }
+void rocksdb_fs::drop_dentry_d(uint64_t ino, file_type ftype) {
+    if (ftype == dir) {
+        auto inode = unique_ptr<inode_t>(read_inode(ino));
+        size_t dir_cnt = inode == nullptr ? 0 : inode->dentry_cnt();
+        for (size_t i = 0; i < dir_cnt;i++) {
+            rfs_dentry_d* d = inode->dentry_at(i);
+            drop_dentry_d(d->ino, d->ftype);
         }
     }
-    drop_inode(dentry_d->ino);
+    drop_inode(ino);
 }
 
 /**
@@ -180,35 +866,60 @@ void rocksdb_fs::drop_dentry_d(const rfs_dentry_d *dentry_d) {
  * @param name
  * @return
  */
-rfs_dentry_d* rocksdb_fs::find_dentry_d(inode_t* inode, const char *name) {
-    auto* dentry_cursor = (rfs_dentry_d*)inode->data();
-    int i = inode->used_dat_sz / sizeof(rfs_dentry_d);
-    for(;i > 0;i--, dentry_cursor++) {
-        if(strcmp(dentry_cursor->name, name) == 0) {
-            break;
-        }
-    }
+rfs_dentry_d* rocksdb_fs::find_dentry_d(inode_t* inode, string_view name) {
+    return inode->find_dentry_d(name);
+}
 
-    if(i == 0) {
-        return nullptr;
+/**
+ * split path into its parent directory and file name, both are views into path
+ * @return the parent path, "/" for a file under the root
+ */
+string_view rocksdb_fs::parent_path(string_view path, string_view& name) {
+    size_t div_idx = path.rfind('/');
+    if(div_idx == string_view::npos) {
+        name = path;
+        return "/";
     }
-
-    return dentry_cursor;
+    name = path.substr(div_idx + 1);
+    return div_idx == 0 ? path.substr(0, 1) : path.substr(0, div_idx);
 }
 
+
 /**
- * @param path
- * @param div_idx divider index of parent and filename
+ * what the caches hold and how often they hit, over all the shards since connect.
+ * a block found in the secondary cache counts as a block cache hit as well
  */
-char* rocksdb_fs::parent_path(const char *path, int& div_idx) {
-    // remove the filename
-    div_idx = strlen(path);
-    while(div_idx >= 0 && path[div_idx] != '/') div_idx--;
-    if(div_idx == 0) div_idx = 1;
-    char* ret = new char[div_idx + 1];
-    memcpy(ret, path, div_idx + 1);
-    ret[div_idx] = '\0';
-    if(div_idx == 1) div_idx = 0;
-    return ret;
-}
+string rocksdb_fs::stats_report() {
+    string report;
+    auto line = [&report](const char* name, const char* fmt, auto val) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), fmt, val);
+        report.append(name).append(" ").append(buf).append("\n");
+    };
+    auto ratio = [](uint64_t hit, uint64_t total) { return total == 0 ? 0.0 : (double)hit / total; };
 
+    uint64_t hit = db_stats->getTickerCount(rocksdb::BLOCK_CACHE_HIT);
+    uint64_t miss = db_stats->getTickerCount(rocksdb::BLOCK_CACHE_MISS);
+    uint64_t secondary_hit = db_stats->getTickerCount(rocksdb::SECONDARY_CACHE_HITS);
+    line("block_cache.type", "%s", block_cache == nullptr ? "none" : conf.hyper_clock ? "hyper_clock" : "lru");
+    line("block_cache.capacity", "%zu", block_cache == nullptr ? 0 : block_cache->GetCapacity());
+    line("block_cache.usage", "%zu", block_cache == nullptr ? 0 : block_cache->GetUsage());
+    line("block_cache.pinned_usage", "%zu", block_cache == nullptr ? 0 : block_cache->GetPinnedUsage());
+    line("block_cache.hit", "%lu", hit - secondary_hit);
+    line("block_cache.miss", "%lu", miss + secondary_hit);
+    line("block_cache.hit_ratio", "%.4f", ratio(hit - secondary_hit, hit + miss));
+    line("secondary_cache.capacity", "%zu", block_cache == nullptr ? 0 : conf.secondary_cache_sz);
+    line("secondary_cache.hit", "%lu", secondary_hit);
+    line("secondary_cache.hit_ratio", "%.4f", ratio(secondary_hit, miss + secondary_hit));
+    line("cache.hit_ratio", "%.4f", ratio(hit, hit + miss));
+    line("inode_cache.capacity", "%zu", conf.inode_cache_sz);
+    line("inode_cache.usage", "%zu", inode_lru->get_usage());
+    if(conf.hot_set_sz > 0) {
+        line("hot_set.prefetched_inodes", "%lu", warm_inodes.load());
+        line("hot_set.prefetched_bytes", "%lu", warm_bytes.load());
+    }
+    if(!conf.cold_path.empty()) {
+        report.append(tier_report());
+    }
+    return report;
+}
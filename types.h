@@ -11,51 +11,340 @@
 #include<memory>
 #include <cstring>
 #include <cstdio>
+#include <ctime>
 #include <string>
+#include <string_view>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <sys/ioctl.h>
 
 using std::string;
+using std::string_view;
+using std::map;
 using std::shared_ptr;
 using std::make_shared;
 using std::unique_ptr;
 using std::make_unique;
 
 
-#define MAX_FILE_NAME_LEN 54
+#define MAX_FILE_NAME_LEN 255
 #define FILE_COUNTER_THRESHOLD 1024
 
+// file data is stored in blocks of BLOCK_SZ under "<ino>:<blk>", a missing block is a hole
+#define BLOCK_SZ 4096
+#define MAX_FILE_SZ (1ULL << 42)
+// dirty bytes an open file may hold before its blocks are written back
+#define DIRTY_FLUSH_THRESHOLD (4 << 20)
+// bytes copy_file_range copies at most per call, all under the cache lock. a short copy is repeated by the caller
+#define COPY_RANGE_MAX (16 << 20)
+// inodes of a directory readdir reads at once, about what fits the kernel's buffer
+#define READDIR_BATCH 32
+// seconds between the passes moving the tables read least off a shard's fast path
+#define TIER_INTERVAL 60
+// seconds between the saves of the hot set, the inos a prefetching thread reads at once and the bytes of a hot
+// file it reads from the start
+#define HOT_SET_INTERVAL 300
+#define HOT_SET_BATCH 256
+#define HOT_FILE_PREFETCH (1 << 20)
+
+// timestamps of an inode, see inode_t::touch
+#define RFS_ATIME 1
+#define RFS_MTIME 2
+#define RFS_CTIME 4
+// like relatime, a read refreshes atime once a day unless atime is older than mtime or ctime
+#define RELATIME_INTERVAL (24 * 60 * 60)
+
+#define INODE_KEY_LEN 21
+#define BLOCK_KEY_LEN 38
+#define REF_KEY_LEN 22
+#define ORPHAN_KEY_LEN 22
+#define CHUNK_KEY_LEN 32
+#define INTENT_KEY_LEN 18
+#define USAGE_KEY_LEN 22
+#define UPGRADED_KEY_LEN 22
+#define RELEASED_KEY_LEN (CHUNK_KEY_LEN + 1)
+
+inline void inode_key(char* key, uint64_t ino) {
+    sprintf(key, "%lu", ino);
+}
+
+inline void block_key(char* key, uint64_t ino, uint64_t blk) {
+    sprintf(key, "%lu:%016lx", ino, blk);
+}
+
+// reference count of blocks shared by cloned files, keyed by the ino the blocks are stored under
+inline void ref_key(char* key, uint64_t ino) {
+    sprintf(key, "r%lu", ino);
+}
+
+// marks an inode no directory references yet, or any more, until the operation on it completes
+inline void orphan_key(char* key, uint64_t ino) {
+    sprintf(key, "o%lu", ino);
+}
+
+// bytes of the regular files and number of inodes anywhere below a directory, as rfs_usage_d. kept by
+// rfs_counter_merge, the root's counts the whole fs but the root itself
+inline void usage_key(char* key, uint64_t ino) {
+    sprintf(key, "u%lu", ino);
+}
+
+struct rfs_usage_d {
+    int64_t bytes;
+    int64_t inodes;
+};
+
+// unique block contents of deduplicated files, the n-th chunk whose bytes hash to the same value.
+// a chunk is stored as its int64 reference count followed by the bytes
+inline void chunk_key(char* key, uint64_t hash, uint32_t n) {
+    if(n == 0) {
+        sprintf(key, "h%016lx", hash);
+    } else {
+        sprintf(key, "h%016lx.%u", hash, n);
+    }
+}
+
+// a chunk a write dropped a reference to, put with the write. the chunk is deleted if nothing refers to it any more
+// and the mark with it, the marks a crash left are swept at mount
+inline void released_key(char* key, const string& chunk) {
+    sprintf(key, "g%s", chunk.c_str());
+}
+
+// which shard of how many a db is, {uint32 index, uint32 count}
+#define SHARD_KEY "s"
+
+// the format of the records as a uint32, in shard 0. a volume without it is of format 0, from before inodes had
+// attributes and files blocks: a record is the data alone, a file's bytes or a directory's fixed size entries
+#define FORMAT_KEY "f"
+#define RFS_FORMAT 1
+
+// an inode rocksdb_fs::upgrade_format has converted already, until the volume is all converted
+inline void upgraded_key(char* key, uint64_t ino) {
+    sprintf(key, "v%lu", ino);
+}
+
+// the hot set, a file in the path of the first shard rather than a key, saving it writes nothing to the WAL.
+// "RFH1" then the inos as uint64
+#define HOT_SET_FILE "rfs_hot"
+#define HOT_SET_MAGIC 0x31484652
+
+// the column family inodes and the super block are kept in with rfs_config::meta_in_memory. META_KEY is in the
+// default one once those a shard had before are all moved there
+#define META_CF "meta"
+#define META_KEY "m"
+
+// the column family inodes are indexed in with rfs_config::index, by the shard of the inode:
+//   "m" <mtime> <ino> and "s" <size> <ino> with empty values, numbers are big endian so that they sort by value
+//   "n" <token> '\0' <ino>, a run of letters and digits of the name lowercased, with an empty value
+//   "p" <ino>, the entry pointing at the inode as its parent's ino followed by the name
+// INDEX_KEY is in it once every inode is
+#define INDEX_CF "index"
+#define INDEX_KEY "x"
+
+// a write spanning shards. in the shard that commits it the value holds the batches of the other shards,
+// in those an empty value marks the batch applied
+inline void intent_key(char* key, uint64_t txn) {
+    sprintf(key, "i%016lx", txn);
+}
+
+// a namespace op as put in the WAL with its batch through PutLogData, never in the db. rfs_changes reads it
+// back with the puts of the batch, the name follows, then the new name of a rename
+#define CHANGE_MAGIC 0x31484352
+
+enum rfs_change_op: uint8_t {
+    change_create,
+    change_unlink,
+    change_rename
+};
+
+// virtual xattr of the root, cache sizes and hit ratios of the fs, a "name value" line each
+#define RFS_XATTR_STATS "user.rfs.stats"
+// virtual xattr of a directory, the bytes and inodes below it
+#define RFS_XATTR_USAGE "user.rfs.usage"
+// virtual directory of an indexed fs, reading "<dir>/<query>" lists the paths matching the query
+#define RFS_FIND_DIR "/.rfs_find"
+
 enum file_type: uint8_t {
     reg,
     dir
 };
 
-struct rfs_dentry_d {
+/**
+ * namespace ops on the entries of a directory, applied all at once by the ioctl RFS_IOC_BATCH on a handle of it.
+ * the records follow each other in recs, each an rfs_batch_rec_d then its name and the new name of a rename.
+ * on return recs holds an int32 per record instead, 0 or the -errno it failed with. the caller needs the
+ * permissions the syscalls would need, "." and ".." are no names a record takes
+ */
+#define RFS_BATCH_SZ 16368
+
+enum rfs_batch_op: uint8_t {
+    batch_create, // mode is the file type and permissions, owned by the caller
+    batch_unlink, // a directory only when it's empty
+    batch_rename, // within the directory, replacing an entry of the same type
+    batch_setattr
+};
+
+// what a batch_setattr record changes
+#define RFS_BATCH_MODE 1
+#define RFS_BATCH_UID 2
+#define RFS_BATCH_GID 4
+#define RFS_BATCH_ATIME 8
+#define RFS_BATCH_MTIME 16
+
+struct __attribute__((packed)) rfs_batch_rec_d {
+    rfs_batch_op op;
+    uint8_t to_set; // of a batch_setattr
+    uint8_t name_len;
+    uint8_t new_name_len; // of a batch_rename
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    timespec atime;
+    timespec mtime;
+};
+
+struct rfs_batch_d {
+    uint32_t cnt;
+    uint32_t recs_sz;
+    char recs[RFS_BATCH_SZ];
+};
+
+// fuse copies as many bytes in and out as the number encodes, which is less than 16KiB
+#define RFS_IOC_BATCH _IOWR('R', 1, rfs_batch_d)
+
+struct __attribute__((packed)) rfs_change_d {
+    uint32_t magic;
+    rfs_change_op op;
+    file_type ftype;
+    uint64_t ino;
+    uint64_t parent;
+    uint64_t new_parent; // of a rename, where the entry went
+    uint8_t name_len;
+    uint8_t new_name_len;
+};
+
+/**
+ * the data of a directory: this header, the entries, then a slot per entry sorted by the hash of the name
+ * and then the name. "RFD2" tells it from the fixed 64 byte entries directories were written with before
+ */
+#define DIR_MAGIC 0x32444652
+
+struct rfs_dir_d {
+    uint32_t magic;
+    uint32_t cnt;
+    uint32_t dents_sz; // bytes of the entries, the slots follow
+};
+
+struct rfs_dslot_d {
+    uint32_t hash;
+    uint32_t off; // of the entry, from the first one
+};
+
+/**
+ * a directory entry as stored, only name_len bytes of the name and its terminator are kept.
+ * entries are padded to 4 bytes
+ */
+struct __attribute__((packed)) rfs_dentry_d {
     uint64_t ino;
     file_type ftype;
+    uint8_t name_len;
     char name[MAX_FILE_NAME_LEN + 1];
+
+    string_view get_name() const { return string_view(name, name_len); }
+};
+
+/**
+ * a directory entry to be added in bulk
+ */
+struct rfs_dirent {
+    uint64_t ino;
+    file_type ftype;
+    string name;
+};
+
+struct rfs_block {
+    string data; // bytes of the block, the ones past data.size() read as zeros
+    bool dirty;
 };
 
+// the end of an inode record, attr_sz bytes of attributes come before it. attributes are only ever appended, a
+// record is read by the size it was written with. records from before the tag have INODE_ATTR_UNTAGGED_SZ bytes,
+// the layout modes were first kept with
+struct __attribute__((packed)) rfs_attr_tag {
+    uint16_t attr_sz;
+    uint16_t magic;
+};
+#define INODE_ATTR_MAGIC 0x4652
+#define INODE_ATTR_UNTAGGED_SZ 80
+
 class inode_t {
 
 private:
     uint8_t* _data; // includes used and free areas
 public:
-    size_t attr_sz;
+    // regular file only, blocks loaded or written since the last write back
+    map<uint64_t, rfs_block> blocks;
+    size_t dirty_sz;
+    bool attr_dirty; // changed since the last write back, blocks included
+    std::vector<uint64_t> linked; // directory only, children added since the last write back, still marked orphans
+    std::vector<uint64_t> lineage; // inos from the root down to this inode as looked up, empty if it wasn't
+    // as last written back, what the usage of the directories above and the index count. an inode never written isn't
+    bool written;
+    uint64_t written_sz;
+    int64_t written_mtime;
+
+    size_t attr_sz; // bytes of the attributes in a record, their tag included
     size_t size; // size of the whole inode, which is sizeof(data) + sizeof(size_t)
     size_t used_dat_sz; // size of the used data areas, the persistent attributes begins here(not including used_dat_sz)
+    uint64_t file_sz; // logical size of a regular file, holes included
+    uint64_t data_ino; // ino the blocks are stored under, 0 for the file's own ino
+    uint8_t shared; // blocks may be shared with clones, copy them before any change
+    uint8_t dedup; // blocks hold chunk keys instead of bytes
+    uint8_t inlined; // regular file only, its bytes are the data area and no block is stored. in what was padding
+    uint32_t mode; // file type and permissions, 0 for inodes written before modes were kept
+    uint32_t uid;
+    uint32_t gid;
+    timespec atime;
+    timespec mtime;
+    timespec ctime;
 
 public:
     inode_t();
     inode_t(const char* data, size_t size);
+    inode_t(const char* data, size_t size, file_type ftype);
     const uint8_t* data() const;
     void before_write_back();
+    uint64_t blk_ino(uint64_t ino) const;
+    void touch(int which);
+    bool atime_stale() const;
 
     void write_data(const char* buf, size_t size, off_t offset);
-    void truncate(size_t size);
+    uint64_t truncate(size_t size);
+    void punch_hole(off_t offset, size_t len, uint64_t& from_blk, uint64_t& to_blk);
+    string_view inline_data() const;
+    void set_inline(string_view bytes);
+    void clear_inline();
 
-    void append_dentry_d(rfs_dentry_d *d);
+    // directory only
+    size_t dentry_cnt();
+    rfs_dentry_d* dentry_at(size_t i);
+    rfs_dentry_d* find_dentry_d(string_view name);
+    rfs_dentry_d* add_dentry_d(uint64_t ino, file_type ftype, string_view name);
+    void add_dentries_d(std::vector<rfs_dirent>& ents);
     void drop_dentry_d(rfs_dentry_d *d);
     void overwrite_dentry_d(rfs_dentry_d *src, rfs_dentry_d* dst);
+    size_t seek_dentry_d(uint64_t off);
+    uint64_t dentry_off(size_t i);
     ~inode_t();
+
+private:
+    rfs_dir_d* dir_d();
+    void load_dir();
+    rfs_dslot_d* dslots(rfs_dir_d* d);
+    char* dents(rfs_dir_d* d);
+    size_t find_dslot(rfs_dir_d* d, uint32_t hash, string_view name);
+    void reserve(size_t dat_sz);
+    void build_dir(std::vector<rfs_dirent>& ents);
 };
 
 //struct inode_d {
@@ -66,7 +355,6 @@ public:
 struct rfs_dentry {
     uint64_t ino;
     file_type ftype;
-    char name[MAX_FILE_NAME_LEN + 1];
 
     shared_ptr<inode_t> inode;
 };
@@ -74,7 +362,6 @@ struct rfs_dentry {
 // f_counter: new-created file counter, when it reaches FILE_COUNTER_THRESHOLD, write back the cur_ino to super_block
 struct super_block {
     uint64_t cur_ino;
-    rfs_dentry_d root_dentry;
     uint64_t f_counter;
 };
 
@@ -89,7 +376,6 @@ struct inode_cache {
 };
 
 struct dir_cache {
-    off_t off; // offset of stating
     shared_ptr<inode_t> i;
 };
 